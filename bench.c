@@ -0,0 +1,550 @@
+#include "fmime.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Micro benchmarks, run with the benchmark name and optionally the
+// number of iterations: ./bench date 1000000
+//   date  fmime_parse_date against strptime
+//   io    fmime_parse_file_ex strategies by file size, to place the
+//         read()/mmap() crossover (FMIME_IO_MMAP_MIN)
+//   parse fmime_parse_memory against a reused fmime_parser_ctx_t, with
+//         and without fmime_ctx_set_headers
+//   range 64K windows of a base64 attachment with
+//         fmime_part_decode_range against decoding it whole, and
+//         fmime_part_get_decoded_size counting it
+//   load  fmime_parse_files against a fmime_parse_file loop over a
+//         maildir like set of files; build with URING=1 for io_uring
+//   token fmime_tokenize against decoding the text whole, case folding
+//         a copy of it and splitting that
+//   rules 300 header rules with fmime_rules_match against a
+//         fmime_get_headers and strcasestr loop
+
+static const char *dates[] = {
+	"Wed, 10 Nov 2004 11:57:45 -0300 (Hora oficial do Brasil)",
+	"Fri, 22 Dec 2006 02:14:08 +0530",
+	"Fri, 16 Feb 2007 16:19:20 -0800 (PST)",
+	"Tue, 19 Jun 2007 20:14:22 +0000",
+	"10 Nov 2004 14:58:01 -0000",
+	NULL
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The usual strptime path: day of week and zone are handled by hand
+static int strptime_date(const char *date, gint64 *epoch)
+{
+	struct tm tm;
+	const char *p;
+	int zone = 0;
+
+	memset(&tm, 0, sizeof(tm));
+	if(!(p = strptime(date, "%a, %d %b %Y %H:%M:%S", &tm)) &&
+			!(p = strptime(date, "%d %b %Y %H:%M:%S", &tm))) {
+		return -1;
+	}
+	while(*p == ' ') {
+		p++;
+	}
+	if(*p == '+' || *p == '-') {
+		int hhmm = atoi(p + 1);
+		zone = (*p == '-' ? -1 : 1) * ((hhmm / 100) * 60 + hhmm % 100);
+	}
+	*epoch = timegm(&tm) - zone * 60;
+	return 0;
+}
+
+static void bench_date(long num)
+{
+	double start;
+	gint64 sum = 0, epoch;
+	long i;
+	int d, ndates;
+
+	for(ndates=0;dates[ndates];ndates++) {
+		// do nothing
+	}
+
+	start = now();
+	for(i=0;i<num;i++) {
+		for(d=0;dates[d];d++) {
+			if(!fmime_parse_date(dates[d], strlen(dates[d]), &epoch)) {
+				sum += epoch;
+			}
+		}
+	}
+	printf("fmime_parse_date: %.1f ns/date\n", (now() - start) * 1e9 / (num * ndates));
+
+	start = now();
+	for(i=0;i<num;i++) {
+		for(d=0;dates[d];d++) {
+			if(!strptime_date(dates[d], &epoch)) {
+				sum -= epoch;
+			}
+		}
+	}
+	printf("strptime+timegm:  %.1f ns/date\n", (now() - start) * 1e9 / (num * ndates));
+
+	// both paths must agree
+	if(sum) {
+		fprintf(stderr, "date parsers disagree: %lli\n", (long long)sum);
+		exit(1);
+	}
+}
+
+// A message of about size bytes, 76 column body
+static char *make_message(size_t size)
+{
+	const char *head = "From: \"Kamper\" <kamper@clanlixo.com.br>\n"
+		"To: <clanlixo@clanlixo.com.br>\n"
+		"Subject: io benchmark\n"
+		"Date: Wed, 10 Nov 2004 11:57:45 -0300\n"
+		"Content-Type: text/plain\n\n";
+	char *ret = g_malloc(size + 1);
+	size_t i, hlen = strlen(head);
+
+	memcpy(ret, head, hlen);
+	for(i=hlen;i<size;i++) {
+		ret[i] = (i - hlen) % 77 == 76 ? '\n' : 'a' + i % 26;
+	}
+	ret[size] = '\0';
+	return ret;
+}
+
+static void bench_io(long num)
+{
+	static const size_t sizes[] = {
+		1024, 2048, 4096, 8192, 16384, 32768, 65536,
+		128 * 1024, 256 * 1024, 1024 * 1024, 4096 * 1024, 0
+	};
+	static const struct {
+		const char *name;
+		int io;
+		int user;
+	} modes[] = {
+		{ "read", FMIME_IO_READ, 0 },
+		{ "read+buf", FMIME_IO_READ, 1 },
+		{ "mmap", FMIME_IO_MMAP, 0 },
+		{ "auto", FMIME_IO_AUTO, 0 },
+	};
+	fmime_buffer_t buf = { NULL, 0 };
+	char path[] = "/tmp/fmime-bench-XXXXXX";
+	int s, m, fd;
+
+	printf("%10s", "bytes");
+	for(m=0;m<(int)G_N_ELEMENTS(modes);m++) {
+		printf(" %12s", modes[m].name);
+	}
+	printf("   (us/message, page cache warm)\n");
+
+	for(s=0;sizes[s];s++) {
+		long i, iters = MAX(20, num * 4096 / (long)sizes[s] / 10);
+		char *msg = make_message(sizes[s]);
+
+		if((fd = mkstemp(path)) < 0 || write(fd, msg, sizes[s]) != (ssize_t)sizes[s]) {
+			perror("bench io");
+			exit(1);
+		}
+		close(fd);
+
+		printf("%10zu", sizes[s]);
+		for(m=0;m<(int)G_N_ELEMENTS(modes);m++) {
+			double start = now();
+			for(i=0;i<iters;i++) {
+				fmime_message_t *parsed = fmime_parse_file_ex(path, modes[m].io, modes[m].user ? &buf : NULL);
+				if(!parsed || parsed->len != sizes[s]) {
+					fprintf(stderr, "bench io: bad parse of %s\n", path);
+					exit(1);
+				}
+				fmime_free(parsed);
+			}
+			printf(" %12.2f", (now() - start) * 1e6 / iters);
+		}
+		printf("\n");
+		unlink(path);
+		strcpy(path, "/tmp/fmime-bench-XXXXXX");
+		g_free(msg);
+	}
+	fmime_buffer_free(&buf);
+}
+
+static void load_cb(fmime_message_t *msg, size_t idx, void *data)
+{
+	if(msg) {
+		__atomic_add_fetch((gint64 *)data, msg->len, __ATOMIC_RELAXED);
+	}
+}
+
+static void bench_parse(long num)
+{
+	static const char multi[] = "From: \"Kamper\" <kamper@clanlixo.com.br>\n"
+		"To: <clanlixo@clanlixo.com.br>\n"
+		"Subject: parse benchmark\n"
+		"Content-Type: multipart/mixed; boundary=\"outer\"\n\n"
+		"--outer\n"
+		"Content-Type: multipart/alternative; boundary=inner\n\n"
+		"--inner\nContent-Type: text/plain\n\nplain body\n"
+		"--inner\nContent-Type: text/html\n\n<p>html body</p>\n"
+		"--inner--\n"
+		"--outer\n"
+		"Content-Type: application/octet-stream\n"
+		"Content-Disposition: attachment; filename=\"a.bin\"\n"
+		"Content-Transfer-Encoding: base64\n\nAAECAwQF\n"
+		"--outer--\n";
+	static const char * const wanted[] = { "From", "To", "Subject", "Date", "Message-ID", NULL };
+	fmime_parser_ctx_t *ctx = fmime_ctx_new();
+	fmime_parser_ctx_t *filtered = fmime_ctx_new();
+	char *plain = make_message(4096);
+	GString *trace = g_string_new(NULL);
+	struct {
+		const char *name;
+		const char *data;
+		size_t len;
+	} msgs[] = {
+		{ "plain", plain, 4096 },
+		{ "multipart", multi, sizeof(multi) - 1 },
+		{ "trace", NULL, 0 },
+	};
+	double start;
+	long i;
+	int m;
+
+	// what a message looks like after a few relays and filters
+	for(m=0;m<40;m++) {
+		g_string_append_printf(trace, "Received: from relay%d.example.com (relay%d.example.com [10.0.0.%d])\n"
+			"\tby mx.example.com with ESMTPS id %08X; Wed, 10 Nov 2004 11:57:45 -0300\n", m, m, m, m * 7919);
+		g_string_append_printf(trace, "X-Filter-%d: pass score=%d\n", m, m);
+	}
+	g_string_append(trace, multi);
+	msgs[2].data = trace->str;
+	msgs[2].len = trace->len;
+	fmime_ctx_set_headers(filtered, wanted, 0);
+
+	for(m=0;m<(int)G_N_ELEMENTS(msgs);m++) {
+		start = now();
+		for(i=0;i<num;i++) {
+			fmime_free(fmime_parse_memory(msgs[m].data, msgs[m].len));
+		}
+		printf("%-10s fmime_parse_memory:     %.3f us\n", msgs[m].name, (now() - start) * 1e6 / num);
+
+		start = now();
+		for(i=0;i<num;i++) {
+			fmime_ctx_parse_memory(ctx, msgs[m].data, msgs[m].len);
+		}
+		printf("%-10s fmime_ctx_parse_memory: %.3f us\n", msgs[m].name, (now() - start) * 1e6 / num);
+
+		start = now();
+		for(i=0;i<num;i++) {
+			fmime_ctx_parse_memory(filtered, msgs[m].data, msgs[m].len);
+		}
+		printf("%-10s filtered headers:       %.3f us\n", msgs[m].name, (now() - start) * 1e6 / num);
+	}
+
+	fmime_ctx_free(ctx);
+	fmime_ctx_free(filtered);
+	g_string_free(trace, TRUE);
+	g_free(plain);
+}
+
+static void bench_range(long num)
+{
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const size_t size = 8 * 1024 * 1024, window = 65536;
+	GString *msg = g_string_new("Content-Type: multipart/mixed; boundary=b\n\n--b\n"
+		"Content-Type: application/octet-stream\n"
+		"Content-Transfer-Encoding: base64\n\n");
+	char *out = g_malloc(size);
+	fmime_message_t *parsed;
+	fmime_part_t *part;
+	double start;
+	size_t i;
+	long n;
+
+	// 76 characters a line, like everybody sends them
+	for(i=0;i<size / 3 * 4;i++) {
+		g_string_append_c(msg, b64[(i * 7) % 64]);
+		if(i % 76 == 75) {
+			g_string_append_c(msg, '\n');
+		}
+	}
+	g_string_append(msg, "\n--b--\n");
+	parsed = fmime_parse_memory(msg->str, msg->len);
+	part = fmime_part_by_section(parsed, "1");
+	num = MAX(num / 100, 1);
+
+	start = now();
+	fmime_part_decode_range(part, size - window, window, out);
+	printf("first window, indexing: %.1f us\n", (now() - start) * 1e6);
+
+	start = now();
+	for(n=0;n<num;n++) {
+		fmime_part_decode_range(part, (n * 7919 * window) % (size - window), window, out);
+	}
+	printf("64K window:             %.1f us\n", (now() - start) * 1e6 / num);
+
+	start = now();
+	for(n=0;n<num / 10 + 1;n++) {
+		fmime_part_decode_range(part, 0, size, out);
+	}
+	printf("whole 8M body:          %.1f us\n", (now() - start) * 1e6 / (num / 10 + 1));
+
+	// the counts are cached on the part, parse again each time
+	start = now();
+	for(n=0;n<num / 10 + 1;n++) {
+		fmime_message_t *again = fmime_parse_memory(msg->str, msg->len);
+		fmime_part_get_decoded_size(fmime_part_by_section(again, "1"));
+		fmime_free(again);
+	}
+	printf("decoded size, counted:  %.1f us\n", (now() - start) * 1e6 / (num / 10 + 1));
+
+	fmime_free(parsed);
+	g_string_free(msg, TRUE);
+	g_free(out);
+}
+
+// Drops the files from the page cache, so the next pass reads the disk
+static void evict(char **paths, long n)
+{
+	long i;
+	int fd;
+
+	for(i=0;i<n;i++) {
+		if((fd = open(paths[i], O_RDONLY)) >= 0) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+	}
+}
+
+static void bench_load(long num)
+{
+	char dir[] = "/tmp/fmime-load-XXXXXX";
+	char **paths;
+	gint64 bytes = 0, loop_bytes = 0;
+	double start, t;
+	long i, n = MAX(num / 10, 100);
+	int cold;
+
+	if(!mkdtemp(dir)) {
+		perror("bench load");
+		exit(1);
+	}
+	// mostly 2-8K, one in a hundred over the pooled buffer size
+	paths = g_new(char *, n);
+	for(i=0;i<n;i++) {
+		size_t size = i % 100 == 99 ? 200 * 1024 : 2048 + (i * 2654435761u) % 6144;
+		char *msg = make_message(size);
+		FILE *f;
+
+		paths[i] = g_strdup_printf("%s/%ld.eml", dir, i);
+		if(!(f = fopen(paths[i], "w")) || fwrite(msg, 1, size, f) != size) {
+			perror("bench load");
+			exit(1);
+		}
+		fclose(f);
+		g_free(msg);
+	}
+
+	for(cold=0;cold<2;cold++) {
+		if(cold) {
+			evict(paths, n);
+		}
+		start = now();
+		for(i=0,loop_bytes=0;i<n;i++) {
+			fmime_message_t *msg = fmime_parse_file(paths[i]);
+			loop_bytes += msg->len;
+			fmime_free(msg);
+		}
+		t = now() - start;
+		printf("%s fmime_parse_file loop: %.2f us/message, %.0f MB/s\n", cold ? "cold" : "warm",
+				t * 1e6 / n, loop_bytes / t / 1e6);
+
+		if(cold) {
+			evict(paths, n);
+		}
+		bytes = 0;
+		start = now();
+		fmime_parse_files((const char * const *)paths, n, 0, load_cb, &bytes);
+		t = now() - start;
+		printf("%s fmime_parse_files:     %.2f us/message, %.0f MB/s\n", cold ? "cold" : "warm",
+				t * 1e6 / n, bytes / t / 1e6);
+		if(bytes != loop_bytes) {
+			fprintf(stderr, "loaders disagree: %lli != %lli\n", (long long)bytes, (long long)loop_bytes);
+			exit(1);
+		}
+	}
+
+	for(i=0;i<n;i++) {
+		unlink(paths[i]);
+		g_free(paths[i]);
+	}
+	g_free(paths);
+	rmdir(dir);
+}
+
+static int count_token(const fmime_token_t *token, void *data)
+{
+	(*(long *)data)++;
+	return 0;
+}
+
+static void bench_token(long num)
+{
+	static const char *words[] = { "Reuni=E3o", "de", "amanh=E3", "na", "SALA", "3,", "pauta:", "or=E7amento" };
+	const size_t size = 4 * 1024 * 1024;
+	GString *msg = g_string_new("Content-Type: text/plain; charset=iso-8859-1\n"
+		"Content-Transfer-Encoding: quoted-printable\n\n");
+	fmime_message_t *parsed;
+	size_t i, line = 0;
+	long n, tokens = 0, split = 0;
+	double start;
+
+	for(i=0;msg->len < size;i++) {
+		const char *w = words[(i * 5) % G_N_ELEMENTS(words)];
+		g_string_append(msg, w);
+		line += strlen(w) + 1;
+		if(line > 70) {
+			g_string_append_c(msg, '\n');
+			line = 0;
+		} else {
+			g_string_append_c(msg, ' ');
+		}
+	}
+	parsed = fmime_parse_memory(msg->str, msg->len);
+	num = MAX(num / 10000, 1);
+
+	start = now();
+	for(n=0;n<num;n++) {
+		fmime_tokenize(parsed, count_token, &tokens);
+	}
+	printf("fmime_tokenize:           %.1f MB/s, %ld words\n",
+			msg->len * num / (now() - start) / 1e6, tokens / num);
+
+	start = now();
+	for(n=0;n<num;n++) {
+		size_t len;
+		char *text = fmime_get_text_utf8(parsed, &len);
+		char *folded = g_utf8_casefold(text, len);
+		char *p;
+		int in = 0;
+
+		for(p=folded;*p;p++) {
+			int word = isalnum((unsigned char)*p) || (*p & 0x80);
+			split += word && !in;
+			in = word;
+		}
+		g_free(folded);
+		g_free(text);
+	}
+	printf("decode, fold, split:      %.1f MB/s, %ld words\n",
+			msg->len * num / (now() - start) / 1e6, split / num);
+
+	fmime_free(parsed);
+	g_string_free(msg, TRUE);
+}
+
+static void bench_rules(long num)
+{
+	static const char * const headers[] = { "From", "To", "Subject", "Received", "X-Mailer", "Message-ID" };
+	static const char * const words[] = { "viagra", "lottery", "relay", "winner", "example", "bitcoin",
+		"urgent", "esmtps", "prize", "invoice", "casino", "pharmacy" };
+	const int count = 300;
+	fmime_rules_t *rules = fmime_rules_new();
+	GString *msg = g_string_new("From: \"Kamper\" <kamper@clanlixo.com.br>\n"
+		"To: <clanlixo@clanlixo.com.br>\n"
+		"Subject: Res: Quem aceita uma folha de bananeira?\n"
+		"Message-ID: <41922C69.000009.01352@QUARTO>\n"
+		"X-Mailer: IncrediMail (3001609)\n");
+	fmime_message_t *parsed;
+	char **patterns = g_new(char *, count);
+	guint64 matched[(300 + 63) / 64];
+	double start;
+	long n, hits = 0, loop_hits = 0;
+	int i, m;
+
+	for(m=0;m<40;m++) {
+		g_string_append_printf(msg, "Received: from relay%d.example.com (relay%d.example.com [10.0.0.%d])\n"
+			"\tby mx.example.com with ESMTPS id %08X; Wed, 10 Nov 2004 11:57:45 -0300\n", m, m, m, m * 7919);
+	}
+	g_string_append(msg, "\nbody\n");
+	parsed = fmime_parse_memory(msg->str, msg->len);
+
+	// a few match, most don't
+	for(i=0;i<count;i++) {
+		patterns[i] = g_strdup_printf("%s%d", words[(i / G_N_ELEMENTS(headers)) % G_N_ELEMENTS(words)], i % 40);
+		fmime_rules_add(rules, headers[i % G_N_ELEMENTS(headers)], patterns[i]);
+	}
+	fmime_rules_compile(rules);
+
+	start = now();
+	for(n=0;n<num;n++) {
+		hits += fmime_rules_match(rules, parsed, matched);
+	}
+	printf("fmime_rules_match:       %.2f us, %ld matched\n", (now() - start) * 1e6 / num, hits / num);
+
+	start = now();
+	for(n=0;n<num;n++) {
+		for(i=0;i<count;i++) {
+			const GList *l;
+			for(l=fmime_get_headers(parsed, headers[i % G_N_ELEMENTS(headers)]);l;l=l->next) {
+				if(strcasestr(l->data, patterns[i])) {
+					loop_hits++;
+					break;
+				}
+			}
+		}
+	}
+	printf("get_headers, strcasestr: %.2f us, %ld matched\n", (now() - start) * 1e6 / num, loop_hits / num);
+
+	for(i=0;i<count;i++) {
+		g_free(patterns[i]);
+	}
+	g_free(patterns);
+	fmime_rules_free(rules);
+	fmime_free(parsed);
+	g_string_free(msg, TRUE);
+}
+
+int main(int argc, char **argv)
+{
+	long num = 100000;
+
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s date|io|parse|range|load|token|rules [iterations]\n", argv[0]);
+		return 1;
+	}
+	if(argc > 2) {
+		num = atol(argv[2]);
+	}
+	fmime_init(0);
+
+	if(!strcmp(argv[1], "date")) {
+		bench_date(num);
+	} else if(!strcmp(argv[1], "io")) {
+		bench_io(num);
+	} else if(!strcmp(argv[1], "parse")) {
+		bench_parse(num);
+	} else if(!strcmp(argv[1], "range")) {
+		bench_range(num);
+	} else if(!strcmp(argv[1], "load")) {
+		bench_load(num);
+	} else if(!strcmp(argv[1], "token")) {
+		bench_token(num);
+	} else if(!strcmp(argv[1], "rules")) {
+		bench_rules(num);
+	} else {
+		fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
@@ -2,32 +2,175 @@
 #define __LIBFMIME_H__
 #include <glib.h>
 
+// A view into memory owned by someone else (the parsed buffer, a header
+// value or a cache kept on the part). It is NOT nul terminated.
+typedef struct fmime_slice {
+	const char *ptr;
+	size_t len;
+} fmime_slice_t;
+
+// The header fields of a message or part, use fmime_get_header(s)
+typedef struct fmime_headers fmime_headers_t;
+// Owns the memory of the message it parses, see fmime_ctx_parse_memory
+typedef struct fmime_parser_ctx fmime_parser_ctx_t;
 
+// Parts, their headers and caches are allocated with the message that
+// owns them and released by fmime_free. All the parts of a message are
+// in one array in document order (pre-order, the root first), see
+// fmime_message_parts. The tree links are indices in that array, -1 when
+// there's none, so a subtree walk is a sweep over the array.
 struct fmime_part {
 	const char *begin;
 	int start_off;
 	int len;
-	GHashTable *headers;
-	GList *children;
+	int body_off;    // the body starts at begin + body_off
+	fmime_headers_t *headers;
+	int index;
+	int parent;
+	int first_child;
+	int next_sibling;
+	int depth;       // 0 for the root
+	// use fmime_part_children
+	struct fmime_part **children;
+	int nchildren;
+
+	// lazily computed values, use the accessor functions
+	int _cached;
+	int _lines;
+	size_t _decoded_size;
+	struct fmime_b64_index *_b64_index;
+	fmime_slice_t _filename;
+	fmime_slice_t _type;
+	fmime_slice_t _subtype;
+	fmime_slice_t _disposition;
+	struct fmime_message *_message; // message/rfc822 body, see fmime_part_by_section
 };
 
 struct fmime_message {
-	GHashTable *headers;
+	fmime_headers_t *headers;
 	void (*_destroyCallBack)(struct fmime_message *);
 	void *_privData;
-	struct fmime_part *root;
+	struct fmime_part *root;   // &parts[0], NULL unless it's a multipart
+	struct fmime_part *parts;
+	int nparts;
+	const char *begin;
 	size_t len;
+	size_t body_off;
+
+	fmime_parser_ctx_t *_ctx;
+	const char *_envelope;
+	const char *_bodystructure;
+	struct fmime_part *_body;  // section 1 when there's no root
 };
 
+// A buffer owned by the caller, reused by fmime_parse_file_ex to read
+// messages into. It grows as needed; a message parsed into it is only
+// valid until the buffer is reused or freed with fmime_buffer_free.
+typedef struct fmime_buffer {
+	char *data;
+	size_t size;
+} fmime_buffer_t;
+
 struct fmime_message_fi {
-	int fd;
-	void *map;
+	int fd;          // -1, the file is closed once loaded
+	void *map;       // mmap()ed file, NULL when read()
 	size_t map_len;
+	char *buf;       // read() buffer, pooled or the caller's
+	size_t buf_size;
+	fmime_buffer_t *user;
 };
 
 typedef struct fmime_message fmime_message_t;
 typedef struct fmime_part fmime_part_t;
 
+#define FMIME_SUMMARY_SUBJECT_MAX 256
+#define FMIME_SUMMARY_PREVIEW_MAX 256
+
+// fmime_summarize flags
+#define FMIME_SUMMARY_SUBJECT 0x01 // fill subject_utf8
+#define FMIME_SUMMARY_PREVIEW 0x02 // fill preview
+#define FMIME_SUMMARY_RECOVER 0x04 // find the preview like FMIME_RECOVER parses
+
+// fmime_summary_t.flags
+#define FMIME_SUMMARY_SEEN        0x01 // Status: R
+#define FMIME_SUMMARY_OLD         0x02 // Status: O
+#define FMIME_SUMMARY_MULTIPART   0x04
+#define FMIME_SUMMARY_HAS_PREVIEW 0x08
+#define FMIME_SUMMARY_ERROR       0x10 // batch only, the file couldn't be read
+#define FMIME_SUMMARY_HAS_DATE    0x20 // timestamp is valid
+
+// One mailbox of an address list, see fmime_parse_addresses. The slices
+// point into the parsed value, unused ones have a NULL ptr.
+typedef struct fmime_address {
+	fmime_slice_t display; // raw phrase, or the comment of user@host (Name)
+	fmime_slice_t local;
+	fmime_slice_t domain;
+	fmime_slice_t group;   // name of the enclosing group, if any
+} fmime_address_t;
+
+#define FMIME_HOP_HAS_DATE 0x01 // timestamp is valid
+
+// One relay of the Received chain, see fmime_parse_received. The slices
+// point into the header value, missing clauses have a NULL ptr.
+typedef struct fmime_hop {
+	fmime_slice_t from;    // name the client gave (from clause)
+	fmime_slice_t from_ip; // address the relay saw the client connect from
+	fmime_slice_t by;
+	fmime_slice_t with;
+	fmime_slice_t id;
+	fmime_slice_t rcpt;    // for clause, without the <>
+	int flags;
+	gint64 timestamp;      // seconds since the epoch
+} fmime_hop_t;
+
+// What a message list needs, see fmime_summarize
+typedef struct fmime_summary {
+	size_t size;
+	size_t body_offset;
+	int flags;
+	// Date, or the newest Received if it's missing or broken, in seconds
+	// since the epoch. 0 when FMIME_SUMMARY_HAS_DATE isn't set
+	gint64 timestamp;
+	// raw header values pointing into the buffer, ptr is NULL if missing
+	fmime_slice_t status;
+	fmime_slice_t from;
+	fmime_slice_t to;
+	fmime_slice_t cc;
+	fmime_slice_t reply_to;
+	fmime_slice_t subject;
+	fmime_slice_t date;
+	fmime_slice_t message_id;
+	fmime_slice_t received; // the first, newest one
+	// RFC 2047 decoded, UTF-8, truncated on a character boundary
+	char subject_utf8[FMIME_SUMMARY_SUBJECT_MAX];
+	// start of the first text part, decoded to UTF-8, white space collapsed.
+	// HTML is stripped, and the plain part of an alternative preferred
+	char preview[FMIME_SUMMARY_PREVIEW_MAX];
+} fmime_summary_t;
+
+// Summaries of many messages, one array per field, ready for sorting and
+// filtering. Strings are nul terminated UTF-8 at the given offsets in pool.
+typedef struct fmime_summary_columns {
+	size_t count;
+	char *pool;
+	size_t pool_len;
+	guint32 *subject;
+	guint32 *from;
+	gint64 *size;
+	gint64 *date;
+	guint32 *flags;
+} fmime_summary_columns_t;
+
+// What fmime_message_has_attachment considers an attachment
+typedef struct fmime_attach_policy {
+	// parts bigger than this are attachments whatever their type, 0 disables
+	size_t inline_max_bytes;
+	// NULL terminated list of "type/subtype" (either can be "*") that are
+	// shown inline unless they have a filename or attachment disposition.
+	// NULL means text/* and message/*
+	const char * const *inline_types;
+} fmime_attach_policy_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,30 +180,273 @@ void fmime_free(fmime_message_t *msg);
 
 int fmime_addheader(fmime_message_t *msg, const char *header, const char *rawValue);
 
-// Parses a msgfile and returns a newly allocated fmime_message_t pointer
-// It used mmap internaly and will munmap the file when fmime_free is called
+// fmime_parse_file_ex io strategies
+#define FMIME_IO_AUTO 0 // read() small files, mmap() large ones
+#define FMIME_IO_READ 1 // one read() into a pooled buffer, or the caller's
+#define FMIME_IO_MMAP 2 // mmap() with MAP_POPULATE and MADV_SEQUENTIAL
+
+// Parses a msgfile and returns a newly allocated fmime_message_t pointer,
+// NULL if it can't be opened or read whole, or isn't a regular file. Same as
+// fmime_parse_file_ex(fname, FMIME_IO_AUTO, NULL)
 fmime_message_t *fmime_parse_file(const char *fname);
+// fmime_parse_file with an explicit io strategy. When buf isn't NULL,
+// read() goes into it instead of the internal pool. The file stays in
+// memory until fmime_free. Read buffers are always NUL terminated.
+fmime_message_t *fmime_parse_file_ex(const char *fname, int io, fmime_buffer_t *buf);
+void fmime_buffer_free(fmime_buffer_t *buf);
 
 // Parses a buffer and returns a newly allocated fmime_message_t pointer
 // It does not copy the suplied memory, so operations on mime parts
 // are dangerous if the buffer passed has been freed.
 fmime_message_t *fmime_parse_memory(const char *memory, size_t len);
 
+// A parser context keeps the memory of the message it parsed and reuses
+// it for the next one: once it has seen its largest message, parsing
+// doesn't allocate. One message at a time per context, and contexts are
+// not shared between threads.
+fmime_parser_ctx_t *fmime_ctx_new(void);
+void fmime_ctx_free(fmime_parser_ctx_t *ctx);
+// fmime_ctx_set_flags flags
+#define FMIME_RECOVER 0x01 // a multipart missing its close delimiter runs to the end of the buffer, delimiters may start mid-line
+
+// Parse options of ctx, for the parses that follow. 0 by default.
+void fmime_ctx_set_flags(fmime_parser_ctx_t *ctx, int flags);
+// fmime_ctx_set_headers flags
+#define FMIME_HEADERS_X 0x01 // keep every X-* header too
+
+// Parses on ctx only store the headers named here (case insensitive),
+// the others are skipped before being copied. Content-* headers are always
+// kept, parsing and the part accessors need them. names is a NULL
+// terminated list and is copied; NULL keeps every header, the default.
+void fmime_ctx_set_headers(fmime_parser_ctx_t *ctx, const char * const *names, int flags);
+// Like fmime_parse_memory, but the message belongs to ctx: it's valid
+// until the next parse on ctx or fmime_ctx_free. fmime_free on it only
+// releases it early.
+fmime_message_t *fmime_ctx_parse_memory(fmime_parser_ctx_t *ctx, const char *memory, size_t len);
+
+// Fills summary from a raw message in a single scan of its header, without
+// building a fmime_message_t. Only reads the body up to the first text part,
+// and only if FMIME_SUMMARY_PREVIEW is set. The slices point into memory.
+int fmime_summarize(const char *memory, size_t len, fmime_summary_t *summary, int flags);
+// Summarizes n messages in memory, or read from paths, across a pool of
+// threads (0 means one per cpu). Returns NULL if the string pool would
+// outgrow 4GB. Free with fmime_summary_columns_free. Paths that can't be
+// read whole or aren't regular files get FMIME_SUMMARY_ERROR.
+fmime_summary_columns_t *fmime_summarize_batch(const char * const *bufs, const size_t *lens, size_t n, int threads);
+fmime_summary_columns_t *fmime_summarize_files(const char * const *paths, size_t n, int threads);
+void fmime_summary_columns_free(fmime_summary_columns_t *cols);
+
+// Called by fmime_parse_files for every file, from a parser thread. msg is
+// NULL when the file couldn't be read, and is freed once this returns.
+typedef void (*fmime_file_cb)(fmime_message_t *msg, size_t idx, void *data);
+// Loads and parses n files, calling cb for each as it's ready (not in
+// order) on `threads` parser threads, 0 means one per cpu. Built with
+// URING=1, reads go through io_uring, hundreds in flight, and hand pooled
+// buffers to the parsers; without it, or if the kernel refuses io_uring or
+// lacks its file ops (before linux 5.6), the parser threads read their own
+// files. Returns when all are done.
+void fmime_parse_files(const char * const *paths, size_t n, int threads, fmime_file_cb cb, void *data);
+
+// Parses a RFC 5322 date-time, obsolete forms included, into seconds since
+// the epoch. Returns 0 on success, -1 for days the month doesn't have,
+// zone minutes over 59 or names that aren't the abbreviated or full
+// English ones (or a four letter month, "Sept"). Doesn't allocate.
+int fmime_parse_date(const char *date, size_t len, gint64 *epoch);
+// Date header of the message, falling back to fmime_get_arrival_date
+int fmime_get_date(fmime_message_t *msg, gint64 *epoch);
+// Timestamp of the first (newest) Received header
+int fmime_get_arrival_date(fmime_message_t *msg, gint64 *epoch);
+// Splits a Received value in its clauses with one forward scan. Returns 0
+// if the trailing date was found, -1 otherwise; the hop is filled anyway
+int fmime_parse_received(const char *value, size_t len, fmime_hop_t *hop);
+// Parses the Received chain, newest hop first. Fills up to max entries and
+// returns the number of Received headers
+int fmime_get_hops(fmime_message_t *msg, fmime_hop_t *out, int max);
+
+// Parses a RFC 5322 address-list (From, To, Cc...) without copying: groups,
+// comments, quoted strings and obsolete routes are handled. A display name
+// that is a single quoted-string loses its quotes, other slices are raw
+// (RFC 2047 encoded, quoted-pairs kept). Fills up to max entries and
+// returns the number of mailboxes found, which may be bigger than max.
+int fmime_parse_addresses(const char *value, size_t len, fmime_address_t *out, int max);
+// fmime_parse_addresses over the first value of a message header
+int fmime_get_addresses(fmime_message_t *msg, const char *header, fmime_address_t *out, int max);
+
+// Part of an IMAP section like "1.2.3" in O(depth). A .MIME, .HEADER or
+// .TEXT suffix is checked and stripped, "2.TEXT" is part 2 (which must be
+// a message/rfc822). The numbers go on inside message/rfc822 parts, their
+// message is parsed on the first lookup and kept with msg. Section 1 of a
+// single part message is its body, a part that isn't in fmime_message_parts.
+// NULL if there's no such part, or the section names none ("", "TEXT").
+fmime_part_t *fmime_part_by_section(fmime_message_t *msg, const char *section);
+// Raw bytes of BODY[section]: "" is the whole message, "HEADER" and "TEXT"
+// (alone or after the number of a message/rfc822 part) its header with
+// the empty line and its body, "1.MIME" the header of part 1 and "1" its
+// body. HEADER.FIELDS is left to the caller, over the HEADER bytes.
+// Returns 0 if the section is invalid or there's no such part.
+int fmime_get_section(fmime_message_t *msg, const char *section, fmime_slice_t *out);
+// IMAP ENVELOPE and BODYSTRUCTURE (extension data included) of the
+// message, built on the first call and cached on it: don't free them.
+// Sizes come from the parse, line counts are counted once per part.
+const char *fmime_get_envelope(fmime_message_t *msg);
+const char *fmime_get_bodystructure(fmime_message_t *msg);
+// Lines in the part body as IMAP counts them, and its size once the
+// Content-Transfer-Encoding is undone. Both come from one counting pass
+// over the encoded body, no decoding, cached on the part.
+int fmime_part_get_lines(fmime_part_t *part);
+size_t fmime_part_get_decoded_size(fmime_part_t *part);
+// Body of a text/* part, transfer decoded and converted from its charset
+// to UTF-8 in one pass. Bytes that aren't valid in the charset become
+// U+FFFD, or windows-1252 when it should be UTF-8, so the result is always
+// valid. NULL if it isn't text. Free with g_free, len may be NULL.
+char *fmime_part_get_text_utf8(fmime_part_t *part, size_t *len);
+// The same for the body of a single part message, NULL for multiparts
+char *fmime_get_text_utf8(fmime_message_t *msg, size_t *len);
+// Readable text of a part for previews and indexing, as UTF-8: text/html
+// has its markup stripped and entities decoded, a multipart/alternative
+// gives its plain child unless that is blank, or else its html one, other
+// multiparts their first text part. Stops after max characters, 0 for all
+// of it. NULL if there's no text. Free with g_free, len may be NULL.
+char *fmime_part_get_plaintext(fmime_part_t *part, size_t max, size_t *len);
+char *fmime_get_plaintext(fmime_message_t *msg, size_t max, size_t *len);
+
+// Longest word fmime_tokenize hands out, in bytes of UTF-8. Longer ones
+// (base64 or hex blobs in the text, mostly) are skipped.
+#define FMIME_TOKEN_MAX 64
+
+// A word of the text of a part, see fmime_tokenize
+typedef struct fmime_token {
+	const char *word;    // lower case UTF-8, NOT nul terminated, only valid in the callback
+	size_t len;
+	fmime_part_t *part;  // NULL for the body of a single part message
+	size_t offset;       // of the word in fmime_part_get_plaintext(part), in bytes
+	size_t position;     // words before it in the part
+} fmime_token_t;
+
+// Called by fmime_tokenize for every word, a non zero return stops it
+typedef int (*fmime_token_cb)(const fmime_token_t *token, void *data);
+// Splits the text of every text part in words for indexing: the same text
+// as fmime_part_get_plaintext, so only the chosen part of an alternative
+// and html without its markup. Words are runs of letters and digits, case
+// folded, with an ascii fast path. The text streams through a fixed window
+// and nothing is copied, so memory use doesn't grow with the message.
+// Returns what cb returned to stop, or 0.
+int fmime_tokenize(fmime_message_t *msg, fmime_token_cb cb, void *data);
+int fmime_part_tokenize(fmime_part_t *part, fmime_token_cb cb, void *data);
+// Copies len bytes of the decoded part body, from decoded offset off, to
+// out. Returns how many were copied, fewer than len at the end of the body.
+// The first call on a base64 part indexes it, then every call decodes just
+// its window. quoted-printable is decoded from the start of the body.
+size_t fmime_part_decode_range(fmime_part_t *part, size_t off, size_t len, char *out);
+
 // Return a GList object wich data pointer points to the raw value of the header, minus line breaks
 const GList *fmime_get_headers(fmime_message_t *msg, const char *header);
 // Return a GList object wich data pointer points to the raw value of the header, minus line breaks
 const char *fmime_get_header(fmime_message_t *msg, const char *header);
+// Return the first value of the header with RFC 2047 encoded words decoded,
+// converted to UTF-8 and unfolded. Plain ascii values are returned as is.
+// The result is cached on the message, don't free it.
+const char *fmime_get_header_decoded(fmime_message_t *msg, const char *header);
 
 const GList *fmime_part_get_headers(fmime_part_t *msg, const char *header);
 // Return a GList object wich data pointer points to the raw value of the header, minus line breaks
 const char *fmime_part_get_header(fmime_part_t *msg, const char *header);
 
+// Does nothing, parts are released with their message
 void fmime_part_free(fmime_part_t *part);
+
+// Sub parts of a multipart part, in document order
+int fmime_part_child_count(const fmime_part_t *part);
+// Returns NULL if idx is out of range
+fmime_part_t *fmime_part_child_at(const fmime_part_t *part, int idx);
+// Contiguous array of the sub parts, for walking them. NULL if there are none.
+fmime_part_t **fmime_part_children(const fmime_part_t *part, int *count);
+// All the parts of the message in document order, NULL if it has none.
+// Children come after their parent and before its next sibling.
+fmime_part_t *fmime_message_parts(const fmime_message_t *msg, int *count);
+
 int fmime_part_is_type(fmime_part_t *part, const char *type, const char *subtype);
 int fmime_part_is_disposition(fmime_part_t *part, const char *desiredDisposition);
+// Content-Type split in type and subtype, text/plain if missing.
+// Parsed once and cached on the part, like the disposition.
+int fmime_part_get_content_type(fmime_part_t *part, fmime_slice_t *type, fmime_slice_t *subtype);
+
+// A part is an attachment if it is bigger than policy->inline_max_bytes,
+// isn't an inline type, or is an inline type with an attachment disposition
+// or a filename. Multipart containers never are. NULL policy means
+// 1MB, text/* and message/*.
+int fmime_part_is_attachment(fmime_part_t *part, const fmime_attach_policy_t *policy);
+// Walks the part tree and stops at the first attachment. The body of a
+// single part message is classified like a part, with the message headers.
+int fmime_message_has_attachment(fmime_message_t *msg, const fmime_attach_policy_t *policy);
 
 // free with g_free
 char *fmime_part_get_filename(fmime_part_t *part);
+// Same as fmime_part_get_filename, but does not copy. Returns 1 and fills out
+// if the part has a filename (Content-Disposition filename, then Content-Type
+// name), RFC 2231 and RFC 2047 decoded to UTF-8. The value is cached on the
+// part, so repeated calls are free. Don't free it.
+int fmime_part_get_filename_slice(fmime_part_t *part, fmime_slice_t *out);
+
+// Looks up parameter `name` in a structured header value, such as
+// Content-Type or Content-Disposition, returns 1 if found.
+// When the value needs no unquoting or decoding, out points into `value`.
+// Otherwise it points into a newly allocated UTF-8 buffer returned in
+// *decoded, which must be freed with g_free. *decoded is NULL when unused.
+int fmime_header_get_param(const char *value, const char *name, fmime_slice_t *out, char **decoded);
+
+// Case insensitive substring rules on header values, compiled into one
+// Aho-Corasick automaton per header name so every value is scanned once
+// whatever the number of rules. Values are matched unfolded, a line break
+// and the white space after it read as one space. Compiled rules are read
+// only and can be shared by threads.
+typedef struct fmime_rules fmime_rules_t;
+
+fmime_rules_t *fmime_rules_new(void);
+// Adds a rule matching pattern anywhere in a value of header, or of any
+// header if header is NULL or "*". Returns the rule number, counting from
+// 0, or -1 if pattern is empty or the rules are compiled.
+int fmime_rules_add(fmime_rules_t *rules, const char *header, const char *pattern);
+// Builds the automata, no rules can be added after. -1 if done already.
+int fmime_rules_compile(fmime_rules_t *rules);
+// Size of a match bitset, in guint64
+int fmime_rules_words(const fmime_rules_t *rules);
+// Sets bit n % 64 of matched[n / 64] for every rule n matching a header
+// of msg, and clears the others. Returns how many rules matched, -1 if
+// the rules aren't compiled.
+int fmime_rules_match(const fmime_rules_t *rules, fmime_message_t *msg, guint64 *matched);
+void fmime_rules_free(fmime_rules_t *rules);
+
+// Rewrites a message without copying it: header and part changes are
+// recorded, then the result comes out as a list of iovecs pointing into
+// the original message, only the new header lines are in memory of the
+// edit's own. The message must outlive the edit, and isn't changed.
+typedef struct fmime_edit fmime_edit_t;
+struct iovec;
+
+fmime_edit_t *fmime_edit_new(fmime_message_t *msg);
+// Header lines are written "name: value", ending like the message lines.
+// value goes as is, fold it if it's long. Prepended lines go above the
+// header (below an mbox From_ line) and the lines prepended before them,
+// like trace headers should.
+void fmime_edit_prepend_header(fmime_edit_t *edit, const char *name, const char *value);
+void fmime_edit_append_header(fmime_edit_t *edit, const char *name, const char *value);
+// Replaces the first occurrence of the header in place, drops the others.
+// Appended if the message doesn't have it.
+void fmime_edit_replace_header(fmime_edit_t *edit, const char *name, const char *value);
+// Drops every occurrence of the header, and lines added with that name
+// before this call
+void fmime_edit_remove_header(fmime_edit_t *edit, const char *name);
+// Drops a part of msg with its delimiter line, -1 if it isn't a sub part
+// of msg. Removing every part of a multipart is left to the caller.
+int fmime_edit_remove_part(fmime_edit_t *edit, fmime_part_t *part);
+// The rewritten message, *count vectors of *size bytes in all, for
+// writev (in IOV_MAX chunks). Valid until the next call on the edit.
+const struct iovec *fmime_edit_iovec(fmime_edit_t *edit, int *count, size_t *size);
+// Writes the rewritten message to fd with writev, retrying short writes.
+// Returns the bytes written, or -1 with errno set.
+gssize fmime_edit_write(fmime_edit_t *edit, int fd);
+void fmime_edit_free(fmime_edit_t *edit);
 
 #ifdef __cplusplus
 };
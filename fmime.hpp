@@ -0,0 +1,296 @@
+#ifndef __LIBFMIME_HPP__
+#define __LIBFMIME_HPP__
+// C++17 wrapper for libfmime. Header only, everything is inline and only
+// forwards to the C api: views point into the message, nothing is copied
+// unless fmime::copy() is called. The wrapper doesn't allocate, the
+// message's memory is the library's own (reuse it with a parser context).
+#include <cstddef>
+#include <iterator>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "fmime.h"
+
+namespace fmime {
+
+// Copies a view out of a message that is about to be freed into a string
+// of the given memory resource. Only the copy comes from mr.
+inline std::pmr::string copy(std::string_view v,
+		std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+{
+	return std::pmr::string(v, mr);
+}
+
+namespace detail {
+
+inline std::string_view view(const char *s) noexcept
+{
+	return s ? std::string_view(s) : std::string_view();
+}
+
+// Forward iterator over a GList, converting each node with Conv
+template <typename T, typename Conv>
+class list_iterator {
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = T;
+	using difference_type = std::ptrdiff_t;
+	using pointer = void;
+	using reference = T;
+
+	list_iterator() noexcept = default;
+	explicit list_iterator(const GList *node) noexcept : node_(node) {}
+
+	T operator*() const noexcept { return Conv()(node_->data); }
+	list_iterator &operator++() noexcept { node_ = node_->next; return *this; }
+	list_iterator operator++(int) noexcept { list_iterator r = *this; ++*this; return r; }
+	bool operator==(const list_iterator &o) const noexcept { return node_ == o.node_; }
+	bool operator!=(const list_iterator &o) const noexcept { return node_ != o.node_; }
+
+private:
+	const GList *node_ = nullptr;
+};
+
+template <typename T, typename Conv>
+class list_range {
+public:
+	using iterator = list_iterator<T, Conv>;
+
+	explicit list_range(const GList *first) noexcept : first_(first) {}
+	iterator begin() const noexcept { return iterator(first_); }
+	iterator end() const noexcept { return iterator(); }
+	bool empty() const noexcept { return first_ == nullptr; }
+
+private:
+	const GList *first_;
+};
+
+struct to_view {
+	std::string_view operator()(gpointer data) const noexcept
+	{
+		return std::string_view(static_cast<const char *>(data));
+	}
+};
+
+} // namespace detail
+
+// All values of a (possibly repeated) header, such as Received
+using HeaderValues = detail::list_range<std::string_view, detail::to_view>;
+
+// A mime part. Parts are owned by their Message, this is a borrowed handle
+// that is only valid while the Message is alive.
+class Part {
+public:
+	class Children;
+
+	explicit Part(fmime_part_t *part) noexcept : part_(part) {}
+
+	fmime_part_t *get() const noexcept { return part_; }
+
+	// The raw part, headers included
+	std::string_view raw() const noexcept
+	{
+		return std::string_view(part_->begin, part_->len);
+	}
+
+	// First value of the header, data() is nullptr if it's missing
+	std::string_view header(const char *name) const noexcept
+	{
+		return detail::view(fmime_part_get_header(part_, name));
+	}
+
+	HeaderValues headers(const char *name) const noexcept
+	{
+		return HeaderValues(fmime_part_get_headers(part_, name));
+	}
+
+	bool is_type(const char *type, const char *subtype) const noexcept
+	{
+		return fmime_part_is_type(part_, type, subtype);
+	}
+
+	bool is_disposition(const char *disposition) const noexcept
+	{
+		return fmime_part_is_disposition(part_, disposition);
+	}
+
+	bool is_attachment(const fmime_attach_policy_t *policy = nullptr) const noexcept
+	{
+		return fmime_part_is_attachment(part_, policy);
+	}
+
+	// Decoded filename, cached on the part. data() is nullptr if there's none
+	std::string_view filename() const noexcept
+	{
+		fmime_slice_t s;
+		if(!fmime_part_get_filename_slice(part_, &s)) {
+			return std::string_view();
+		}
+		return std::string_view(s.ptr, s.len);
+	}
+
+	inline Children children() const noexcept;
+
+private:
+	fmime_part_t *part_;
+};
+
+// The sub parts of a multipart part, a view over the contiguous child array
+class Part::Children {
+public:
+	class iterator {
+	public:
+		using iterator_category = std::random_access_iterator_tag;
+		using value_type = Part;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = Part;
+
+		iterator() noexcept = default;
+		explicit iterator(fmime_part_t **p) noexcept : p_(p) {}
+
+		Part operator*() const noexcept { return Part(*p_); }
+		Part operator[](difference_type n) const noexcept { return Part(p_[n]); }
+		iterator &operator++() noexcept { ++p_; return *this; }
+		iterator operator++(int) noexcept { iterator r = *this; ++p_; return r; }
+		iterator &operator--() noexcept { --p_; return *this; }
+		iterator operator--(int) noexcept { iterator r = *this; --p_; return r; }
+		iterator &operator+=(difference_type n) noexcept { p_ += n; return *this; }
+		iterator &operator-=(difference_type n) noexcept { p_ -= n; return *this; }
+		iterator operator+(difference_type n) const noexcept { return iterator(p_ + n); }
+		iterator operator-(difference_type n) const noexcept { return iterator(p_ - n); }
+		difference_type operator-(const iterator &o) const noexcept { return p_ - o.p_; }
+		bool operator==(const iterator &o) const noexcept { return p_ == o.p_; }
+		bool operator!=(const iterator &o) const noexcept { return p_ != o.p_; }
+		bool operator<(const iterator &o) const noexcept { return p_ < o.p_; }
+
+	private:
+		fmime_part_t **p_ = nullptr;
+	};
+
+	explicit Children(const fmime_part_t *part) noexcept
+	{
+		first_ = fmime_part_children(part, &count_);
+	}
+
+	iterator begin() const noexcept { return iterator(first_); }
+	iterator end() const noexcept { return iterator(first_ + count_); }
+	std::size_t size() const noexcept { return count_; }
+	bool empty() const noexcept { return count_ == 0; }
+	Part operator[](std::size_t i) const noexcept { return Part(first_[i]); }
+
+private:
+	fmime_part_t **first_;
+	int count_;
+};
+
+inline Part::Children Part::children() const noexcept
+{
+	return Children(part_);
+}
+
+// Owns a parsed fmime_message_t and frees it with fmime_free. Move only.
+class Message {
+public:
+	Message() noexcept = default;
+	explicit Message(fmime_message_t *msg) noexcept : msg_(msg) {}
+	~Message() { reset(); }
+
+	Message(const Message &) = delete;
+	Message &operator=(const Message &) = delete;
+
+	Message(Message &&o) noexcept : msg_(std::exchange(o.msg_, nullptr)) {}
+	Message &operator=(Message &&o) noexcept
+	{
+		if(this != &o) {
+			reset(std::exchange(o.msg_, nullptr));
+		}
+		return *this;
+	}
+
+	// The memory is not copied and must outlive the Message
+	static Message parse(std::string_view memory) noexcept
+	{
+		return Message(fmime_parse_memory(memory.data(), memory.size()));
+	}
+
+	// Parses into the context's storage. The Message only clears it, and it
+	// is invalidated by the next parse on the same context
+	static Message parse(fmime_parser_ctx_t *ctx, std::string_view memory) noexcept
+	{
+		return Message(fmime_ctx_parse_memory(ctx, memory.data(), memory.size()));
+	}
+
+	// Empty Message if the file can't be opened
+	static Message parse_file(const char *fname) noexcept
+	{
+		return Message(fmime_parse_file(fname));
+	}
+
+	// With an explicit FMIME_IO_* strategy, buf is reused for read()
+	static Message parse_file(const char *fname, int io, fmime_buffer_t *buf = nullptr) noexcept
+	{
+		return Message(fmime_parse_file_ex(fname, io, buf));
+	}
+
+	explicit operator bool() const noexcept { return msg_ != nullptr; }
+	fmime_message_t *get() const noexcept { return msg_; }
+
+	fmime_message_t *release() noexcept { return std::exchange(msg_, nullptr); }
+
+	void reset(fmime_message_t *msg = nullptr) noexcept
+	{
+		if(msg_) {
+			fmime_free(msg_);
+		}
+		msg_ = msg;
+	}
+
+	std::size_t size() const noexcept { return msg_->len; }
+
+	// First value of the header, data() is nullptr if it's missing
+	std::string_view header(const char *name) const noexcept
+	{
+		return detail::view(fmime_get_header(msg_, name));
+	}
+
+	// RFC 2047 decoded UTF-8 value, cached on the message
+	std::string_view header_decoded(const char *name) const noexcept
+	{
+		return detail::view(fmime_get_header_decoded(msg_, name));
+	}
+
+	HeaderValues headers(const char *name) const noexcept
+	{
+		return HeaderValues(fmime_get_headers(msg_, name));
+	}
+
+	bool has_attachment(const fmime_attach_policy_t *policy = nullptr) const noexcept
+	{
+		return fmime_message_has_attachment(msg_, policy);
+	}
+
+	// IMAP ENVELOPE and BODYSTRUCTURE, built once and cached on the message
+	std::string_view envelope() const noexcept
+	{
+		return std::string_view(fmime_get_envelope(msg_));
+	}
+
+	std::string_view bodystructure() const noexcept
+	{
+		return std::string_view(fmime_get_bodystructure(msg_));
+	}
+
+	// Only multipart messages have a root part
+	bool has_root() const noexcept { return msg_->root != nullptr; }
+	Part root() const noexcept { return Part(msg_->root); }
+
+private:
+	fmime_message_t *msg_ = nullptr;
+};
+
+} // namespace fmime
+
+#endif
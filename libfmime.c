@@ -1,13 +1,23 @@
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <iconv.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
-#include <pcre.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef FMIME_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 #include "fmime.h"
 
@@ -17,152 +27,386 @@
 #define D(X)
 #endif
 
-#define DEFAULT_PCRE_COMPILE_OPTIONS (PCRE_CASELESS | PCRE_EXTRA)
+// fmime_part_t._cached bits
+#define FMIME_CACHED_FILENAME    0x01
+#define FMIME_CACHED_CTYPE       0x02
+#define FMIME_CACHED_DISPOSITION 0x04
+#define FMIME_CACHED_COUNTS      0x08 // _lines and _decoded_size
 
-static const char *identify_boundary_re_str = "boundary\\s*=\\s*(([^\"]\\S*)+|\"([^\"]+)?\");{0,1}";
-static pcre *identify_boundary_re =  NULL; 
-static pcre_extra *identify_boundary_extra =  NULL; 
+// multipart nesting we follow, deeper ones are kept as leaves
+#define FMIME_MAX_DEPTH 32
+// RFC 2046 says 70, leave room for broken mailers
+#define FMIME_BOUNDARY_MAX 256
 
-static const char *mtype_str = "\\s*(.+)?/([^; ]+)";
-static pcre *mtype_re =  NULL; 
-static pcre_extra *mtype_extra =  NULL; 
+// fmime_parse_file: files from this size on are mmap()ed, ./bench io has
+// read() and mmap() even around 256K with a warm page cache
+#define FMIME_IO_MMAP_MIN (256 * 1024)
+// pooled read() buffers, files up to FMIME_IO_POOL_BUF - 1 bytes fit
+#define FMIME_IO_POOL_BUF (64 * 1024)
+#define FMIME_IO_POOL_MAX 16
+// fmime_parse_files: files read ahead of the parsers, and io_uring reads
+// kept in flight
+#define FMIME_LOAD_QUEUE 512
+#define FMIME_LOAD_BATCH 16
+#define FMIME_URING_DEPTH 256
+// arena chunks, a typical message fits in one
+#define FMIME_ARENA_CHUNK (16 * 1024)
+// base64 characters between fmime_part_decode_range checkpoints, a
+// multiple of 4 so they start a group. 16 bytes of index per 12K decoded.
+#define FMIME_B64_CHECKPOINT (16 * 1024)
+// fmime_part_get_text_utf8 decodes this much at a time on the stack
+#define FMIME_TEXT_WINDOW 4096
+// fmime_rules_t automata with up to this many distinct first bytes skip
+// to them with SSE2 compares
+#define FMIME_RULES_PREFILTER 6
 
-static const char *fname_str = "(file){0,1}name=(\"([^\"]+)\"|([^\"]\\S*));{0,1}";
-static pcre *fname_re = NULL;
-static pcre_extra *fname_extra = NULL;
+struct _fmime_arena;
 
-static __attribute__ ((used)) size_t _fmime_generic_parse_header(GHashTable *headers, const char *memory, size_t len);
-static int _fmime_generic_addheader(GHashTable *headers, const char *header, const char *rawValue);
+struct _fmime_hfilter;
+static size_t _fmime_generic_parse_header(fmime_headers_t *headers, const struct _fmime_hfilter *filter, const char *memory, size_t len);
+static int _fmime_generic_addheader(fmime_headers_t *headers, const char *header, const char *rawValue);
 
-// You must free the returned string with pcre_free_substring
-const char *_fmime_get_boundary(const char *ctype, size_t ctype_len);
+static fmime_message_t *_fmime_parse_memory(fmime_parser_ctx_t *ctx, const char *memory, size_t len);
 
-static fmime_message_t *_fmime_parse_memory(fmime_message_t *ret, const char *memory, size_t len);
-
-// pass ctype so we can get the boundary from the content type header
-static __attribute__ ((used)) fmime_part_t *_fmime_parse_part_memory(const char *memory, size_t len, const char *ctype);
-// make sure we don't have especial regexp chars in our boundary
-static  __attribute__ ((used)) char *_fmime_escape_boundary(const char *boundary);
+static int _fmime_parse_part_memory(fmime_parser_ctx_t *ctx, int parent, const char *memory, size_t len, int depth);
+static void _fmime_parse_multipart(fmime_parser_ctx_t *ctx, int parent, const char *body, size_t len, const char *ctype, int depth);
+static fmime_part_t *_fmime_part_new(fmime_parser_ctx_t *ctx, int parent, const char *begin, size_t len);
+static void _fmime_parts_link(fmime_parser_ctx_t *ctx);
+static int _fmime_part_add_child(fmime_parser_ctx_t *ctx, int parent, int last, const char *memory, size_t len, int depth);
 
 static int initialized = 0;
 
-static void fmime_exit(void)
+void fmime_init(int flags)
 {
-	if(identify_boundary_re)
-		pcre_free(identify_boundary_re);
-	if(identify_boundary_extra)
-		pcre_free(identify_boundary_extra);
-	if(mtype_re)
-		pcre_free(mtype_re);
-	if(mtype_extra)
-		pcre_free(mtype_extra);
-	if(fname_re)
-		pcre_free(fname_re);
-	if(fname_extra)
-		pcre_free(fname_extra);
+	if(initialized) {
+		return;
+	}
+	initialized = 1;
 }
 
-static guint _fmime_str_hsh(gconstpointer key)
+
+// Bump allocator behind a message: its parts, header copies and lazy
+// caches. A reset keeps the chunks, so a context parsing messages back to
+// back stops allocating once it has seen its biggest one.
+struct _fmime_arena_chunk {
+	struct _fmime_arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__ ((aligned(16)));
+};
+
+struct _fmime_arena {
+	struct _fmime_arena_chunk *first;
+	struct _fmime_arena_chunk *cur;
+};
+
+static void *_fmime_arena_alloc(struct _fmime_arena *a, size_t len)
 {
-	char *k;
-	guint ret = 0;
+	struct _fmime_arena_chunk *c;
+	void *ret;
 
-	k = g_ascii_strdown(key, strlen(key));
-	ret = g_str_hash(k);
-	g_free(k);
+	len = (len + 15) & ~(size_t)15;
+	// the chunks after cur are free, left there by a reset
+	for(c=a->cur;c && c->size - c->used < len;c=c->next) {
+		// do nothing
+	}
+	if(!c) {
+		size_t size = MAX(len, FMIME_ARENA_CHUNK);
 
+		c = g_malloc(sizeof(struct _fmime_arena_chunk) + size);
+		c->size = size;
+		c->used = 0;
+		if(a->cur) {
+			c->next = a->cur->next;
+			a->cur->next = c;
+		} else {
+			c->next = a->first;
+			a->first = c;
+		}
+	}
+	a->cur = c;
+	ret = c->data + c->used;
+	c->used += len;
 	return ret;
 }
 
-static gboolean _fmime_str_eq(gconstpointer a, gconstpointer b)
+static void *_fmime_arena_alloc0(struct _fmime_arena *a, size_t len)
 {
-	return !g_ascii_strcasecmp((const gchar *)a, (const gchar *)b);
+	return memset(_fmime_arena_alloc(a, len), 0, len);
 }
 
-void fmime_init(int flags)
+static char *_fmime_arena_strndup(struct _fmime_arena *a, const char *s, size_t len)
 {
-	const char *err;
-	int err_off;
-	if(initialized) {
-		return;
-	} 
+	char *ret = _fmime_arena_alloc(a, len + 1);
+
+	memcpy(ret, s, len);
+	ret[len] = '\0';
+	return ret;
+}
+
+static void _fmime_arena_reset(struct _fmime_arena *a)
+{
+	struct _fmime_arena_chunk *c;
 
-	identify_boundary_re = pcre_compile(identify_boundary_re_str, DEFAULT_PCRE_COMPILE_OPTIONS, &err, &err_off, NULL);
-	if(!identify_boundary_re) {
-		fprintf(stderr, "Error compiling `%s`: %s at %i\n", identify_boundary_re_str, err, err_off);
-		assert(identify_boundary_re);
+	for(c=a->first;c;c=c->next) {
+		c->used = 0;
 	}
-	err = NULL;
-	identify_boundary_extra = pcre_study(identify_boundary_re, 0, &err);
-	if(err) {
-		fprintf(stderr, "Error studying `%s`: %s\n", identify_boundary_re_str, err);
-		assert(!err);
+	a->cur = a->first;
+}
+
+static void _fmime_arena_free(struct _fmime_arena *a)
+{
+	struct _fmime_arena_chunk *c, *next;
+
+	for(c=a->first;c;c=next) {
+		next = c->next;
+		g_free(c);
 	}
+	a->first = a->cur = NULL;
+}
+
+// One header name and all its values, in order
+struct _fmime_hfield {
+	const char *name;
+	guint hash;
+	GList *first;  // nodes live in the arena, don't g_list_free them
+	GList *last;
+	const char *decoded; // fmime_get_header_decoded cache
+};
+
+struct fmime_headers {
+	struct _fmime_arena *arena;
+	struct _fmime_hfield *fields;
+	int count;
+	int alloc;
+};
+
+// The headers fmime_ctx_set_headers asked for
+struct _fmime_hfilter {
+	int flags;
+	int count;
+	struct {
+		char *name;
+		size_t len;
+		char first; // lower case, to reject without a compare
+	} names[];
+};
+
+struct fmime_parser_ctx {
+	fmime_message_t msg;
+	struct _fmime_arena arena;
+	fmime_part_t *parts; // grows to the most parts seen, kept across parses
+	int parts_alloc;
+	struct _fmime_hfilter *filter; // NULL keeps all headers
+	int standalone; // made for a single fmime_parse_* call, freed with the message
+	GList *nested;  // message/rfc822 bodies parsed by fmime_part_by_section
+	int flags;      // fmime_ctx_set_flags
+};
 
-	mtype_re = pcre_compile(mtype_str, DEFAULT_PCRE_COMPILE_OPTIONS, &err, &err_off, NULL);
-	if(!mtype_re) {
-		fprintf(stderr, "Error compiling `%s`: %s at %i\n", mtype_str, err, err_off);
-		assert(mtype_re);
+// Content-* is always kept, parsing and the part accessors need it
+static int _fmime_hfilter_match(const struct _fmime_hfilter *filter, const char *name, size_t len)
+{
+	char first = g_ascii_tolower(*name);
+	int i;
+
+	if(first == 'c' && len > 8 && !g_ascii_strncasecmp(name, "content-", 8)) {
+		return 1;
+	}
+	if(first == 'x' && len > 2 && name[1] == '-' && (filter->flags & FMIME_HEADERS_X)) {
+		return 1;
 	}
-	err = NULL;
-	mtype_extra = pcre_study(mtype_re, 0, &err);
-	if(err) {
-		fprintf(stderr, "Error studying `%s`: %s\n", mtype_str, err);
-		assert(!err);
+	for(i=0;i<filter->count;i++) {
+		if(filter->names[i].len == len && filter->names[i].first == first &&
+				!g_ascii_strncasecmp(filter->names[i].name, name, len)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void _fmime_hfilter_free(struct _fmime_hfilter *filter)
+{
+	int i;
+
+	if(filter) {
+		for(i=0;i<filter->count;i++) {
+			g_free(filter->names[i].name);
+		}
+		g_free(filter);
 	}
+}
+
+void fmime_ctx_set_headers(fmime_parser_ctx_t *ctx, const char * const *names, int flags)
+{
+	int i, n;
 
-	fname_re = pcre_compile(fname_str, DEFAULT_PCRE_COMPILE_OPTIONS, &err, &err_off, NULL);
-	if(!fname_re) {
-		fprintf(stderr, "Error compiling `%s`: %s at %i\n", fname_str, err, err_off);
-		assert(fname_re);
+	_fmime_hfilter_free(ctx->filter);
+	ctx->filter = NULL;
+	if(!names) {
+		return;
+	}
+	for(n=0;names[n];n++) {
+		// do nothing
 	}
-	err = NULL;
-	fname_extra = pcre_study(fname_re, 0, &err);
-	if(err) {
-		fprintf(stderr, "Error studying `%s`: %s\n", fname_str, err);
-		assert(!err);
+	ctx->filter = g_malloc(sizeof(struct _fmime_hfilter) + n * sizeof(ctx->filter->names[0]));
+	ctx->filter->flags = flags;
+	ctx->filter->count = 0;
+	for(i=0;i<n;i++) {
+		size_t len = strlen(names[i]);
+		if(len) {
+			ctx->filter->names[ctx->filter->count].name = g_strndup(names[i], len);
+			ctx->filter->names[ctx->filter->count].len = len;
+			ctx->filter->names[ctx->filter->count++].first = g_ascii_tolower(names[i][0]);
+		}
 	}
+}
 
-	initialized = 1;
-	atexit(fmime_exit);
+void fmime_ctx_set_flags(fmime_parser_ctx_t *ctx, int flags)
+{
+	ctx->flags = flags;
 }
 
+static guint _fmime_hname_hash(const char *name, size_t len)
+{
+	guint h = 5381;
+	size_t i;
+
+	for(i=0;i<len;i++) {
+		h = h * 33 + (guchar)g_ascii_tolower(name[i]);
+	}
+	return h;
+}
 
-static gboolean _fmime_free_foreach(gpointer key, gpointer value, gpointer user_data)
+static fmime_headers_t *_fmime_headers_new(struct _fmime_arena *arena)
 {
-	GList *cur;
+	fmime_headers_t *ret = _fmime_arena_alloc0(arena, sizeof(fmime_headers_t));
 
-	g_free(key);
-	
-	cur = (GList *)value;
-	do {
-		g_free(cur->data);
-	} while((cur = g_list_next(cur)));
+	ret->arena = arena;
+	return ret;
+}
+
+// Case insensitive lookup: a few dozen names at most, a linear scan over
+// the hashes beats building a table for each part
+static struct _fmime_hfield *_fmime_headers_find(const fmime_headers_t *headers, const char *name, size_t len)
+{
+	guint hash = _fmime_hname_hash(name, len);
+	int i;
 
-	g_list_free((GList *)value);
-	return TRUE;
+	for(i=0;i<headers->count;i++) {
+		struct _fmime_hfield *f = &headers->fields[i];
+		if(f->hash == hash && !g_ascii_strncasecmp(f->name, name, len) && !f->name[len]) {
+			return f;
+		}
+	}
+	return NULL;
 }
 
-void fmime_free(fmime_message_t *msg)
+static void _fmime_headers_add(fmime_headers_t *headers, const char *name, size_t name_len, const char *value, size_t value_len)
 {
-	D(fprintf(stderr, "msg->root: %p\n", msg->root));
-	if(msg->root) {
-		D(fprintf(stderr, "Calling fmime_part_free: %p\n", msg->root));
-		fmime_part_free(msg->root);
+	struct _fmime_hfield *f = _fmime_headers_find(headers, name, name_len);
+	GList *node;
+
+	if(!f) {
+		if(headers->count == headers->alloc) {
+			struct _fmime_hfield *fields;
+
+			headers->alloc = headers->alloc ? headers->alloc * 2 : 8;
+			fields = _fmime_arena_alloc(headers->arena, headers->alloc * sizeof(struct _fmime_hfield));
+			if(headers->count) {
+				memcpy(fields, headers->fields, headers->count * sizeof(struct _fmime_hfield));
+			}
+			headers->fields = fields;
+		}
+		f = &headers->fields[headers->count++];
+		f->name = _fmime_arena_strndup(headers->arena, name, name_len);
+		f->hash = _fmime_hname_hash(name, name_len);
+		f->first = f->last = NULL;
+		f->decoded = NULL;
+	}
+	node = _fmime_arena_alloc(headers->arena, sizeof(GList));
+	node->data = _fmime_arena_strndup(headers->arena, value, value_len);
+	node->next = NULL;
+	node->prev = f->last;
+	if(f->last) {
+		f->last->next = node;
+	} else {
+		f->first = node;
+	}
+	f->last = node;
+}
+
+static const GList *_fmime_headers_get(const fmime_headers_t *headers, const char *header)
+{
+	struct _fmime_hfield *f;
+
+	if(!headers || !header || !(f = _fmime_headers_find(headers, header, strlen(header)))) {
+		return NULL;
+	}
+	return f->first;
+}
+
+static const char *_fmime_headers_value(const fmime_headers_t *headers, const char *name)
+{
+	const GList *first = _fmime_headers_get(headers, name);
+
+	return first ? first->data : NULL;
+}
+
+fmime_parser_ctx_t *fmime_ctx_new(void)
+{
+	return g_new0(fmime_parser_ctx_t, 1);
+}
+
+// Releases what the message holds outside the arena
+static void _fmime_ctx_clear(fmime_parser_ctx_t *ctx)
+{
+	GList *l;
+
+	// they point into this message
+	for(l=ctx->nested;l;l=l->next) {
+		fmime_free(l->data);
 	}
-	if(msg->_destroyCallBack) {
-		msg->_destroyCallBack(msg);
+	g_list_free(ctx->nested);
+	ctx->nested = NULL;
+	if(ctx->msg._destroyCallBack) {
+		ctx->msg._destroyCallBack(&ctx->msg);
 	}
-	if(msg->headers) {
-		g_hash_table_foreach_steal(msg->headers, _fmime_free_foreach, NULL);
-		g_hash_table_destroy(msg->headers);
+	memset(&ctx->msg, 0, sizeof(ctx->msg));
+}
+
+void fmime_ctx_free(fmime_parser_ctx_t *ctx)
+{
+	if(ctx) {
+		_fmime_ctx_clear(ctx);
+		_fmime_arena_free(&ctx->arena);
+		_fmime_hfilter_free(ctx->filter);
+		g_free(ctx->parts);
+		g_free(ctx);
+	}
+}
+
+fmime_message_t *fmime_ctx_parse_memory(fmime_parser_ctx_t *ctx, const char *memory, size_t len)
+{
+	_fmime_ctx_clear(ctx);
+	_fmime_arena_reset(&ctx->arena);
+	return _fmime_parse_memory(ctx, memory, len);
+}
+
+void fmime_free(fmime_message_t *msg)
+{
+	fmime_parser_ctx_t *ctx = msg->_ctx;
+
+	D(fprintf(stderr, "msg->root: %p\n", msg->root));
+	if(ctx->standalone) {
+		fmime_ctx_free(ctx);
+	} else {
+		_fmime_ctx_clear(ctx);
 	}
-	g_free(msg);
 }
 
 const char *fmime_get_header(fmime_message_t *msg, const char *header)
 {
-	GList *first = g_hash_table_lookup(msg->headers, header);
+	const GList *first = _fmime_headers_get(msg->headers, header);
 	if(first) {
 		return first->data;
 	}
@@ -171,7 +415,7 @@ const char *fmime_get_header(fmime_message_t *msg, const char *header)
 
 const GList *fmime_get_headers(fmime_message_t *msg, const char *header)
 {
-	return g_hash_table_lookup(msg->headers, header);
+	return _fmime_headers_get(msg->headers, header);
 }
 
 int fmime_addheader(fmime_message_t *msg, const char *header, const char *rawValue)
@@ -181,7 +425,7 @@ int fmime_addheader(fmime_message_t *msg, const char *header, const char *rawVal
 
 const char *fmime_part_get_header(fmime_part_t *msg, const char *header)
 {
-	GList *first = g_hash_table_lookup(msg->headers, header);
+	const GList *first = _fmime_headers_get(msg->headers, header);
 	if(first) {
 		return first->data;
 	}
@@ -190,7 +434,7 @@ const char *fmime_part_get_header(fmime_part_t *msg, const char *header)
 
 const GList *fmime_part_get_headers(fmime_part_t *msg, const char *header)
 {
-	return g_hash_table_lookup(msg->headers, header);
+	return _fmime_headers_get(msg->headers, header);
 }
 
 int fmime_part_addheader(fmime_part_t *msg, const char *header, const char *rawValue)
@@ -198,133 +442,254 @@ int fmime_part_addheader(fmime_part_t *msg, const char *header, const char *rawV
 	return _fmime_generic_addheader(msg->headers, header, rawValue);
 }
 
+// Returned to the pool by fmime_free, so reading small messages in a loop
+// doesn't go back to malloc for each one
+static GMutex _fmime_io_lock;
+static char *_fmime_io_pool[FMIME_IO_POOL_MAX];
+static int _fmime_io_pooled = 0;
+
+static char *_fmime_io_get(size_t need, size_t *size)
+{
+	char *ret = NULL;
+
+	if(need > FMIME_IO_POOL_BUF) {
+		*size = need;
+		return g_malloc(need);
+	}
+	g_mutex_lock(&_fmime_io_lock);
+	if(_fmime_io_pooled) {
+		ret = _fmime_io_pool[--_fmime_io_pooled];
+	}
+	g_mutex_unlock(&_fmime_io_lock);
+	*size = FMIME_IO_POOL_BUF;
+	return ret ? ret : g_malloc(FMIME_IO_POOL_BUF);
+}
+
+static void _fmime_io_put(char *buf, size_t size)
+{
+	if(size == FMIME_IO_POOL_BUF) {
+		g_mutex_lock(&_fmime_io_lock);
+		if(_fmime_io_pooled < FMIME_IO_POOL_MAX) {
+			_fmime_io_pool[_fmime_io_pooled++] = buf;
+			buf = NULL;
+		}
+		g_mutex_unlock(&_fmime_io_lock);
+	}
+	g_free(buf);
+}
+
+// read() until len bytes or EOF, returns the number of bytes read
+static size_t _fmime_read_all(int fd, char *buf, size_t len)
+{
+	size_t done;
+	ssize_t r;
+
+	for(done=0;done<len;done+=r) {
+		if((r = read(fd, buf + done, len - done)) < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if(r <= 0) {
+			break;
+		}
+	}
+	return done;
+}
+
+// Size of an open regular file, -1 for anything else (directories,
+// fifos...)
+static int _fmime_file_size(int fd, size_t *len)
+{
+	struct stat st;
+
+	if(fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		return -1;
+	}
+	*len = st.st_size;
+	return 0;
+}
+
+// Opens a regular file for reading, -1 for anything else. *len is its size.
+static int _fmime_open_file(const char *fname, size_t *len)
+{
+	int fd;
+
+	if((fd = open(fname, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if(_fmime_file_size(fd, len)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Grows a caller's buffer to len bytes and a NUL
+static void _fmime_buffer_reserve(fmime_buffer_t *buf, size_t len)
+{
+	if(buf->size < len + 1) {
+		buf->size = len + 1;
+		buf->data = g_realloc(buf->data, buf->size);
+	}
+}
+
+// Reads a whole regular file into a caller's buffer, NUL terminated.
+// Returns 0 on success, -1 if it can't be opened or read to the end.
+static int _fmime_read_file(const char *fname, fmime_buffer_t *buf, size_t *len)
+{
+	int fd = _fmime_open_file(fname, len);
+	int ret = -1;
+
+	if(fd < 0) {
+		return -1;
+	}
+	_fmime_buffer_reserve(buf, *len);
+	if(_fmime_read_all(fd, buf->data, *len) == *len) {
+		buf->data[*len] = '\0';
+		ret = 0;
+	}
+	close(fd);
+	return ret;
+}
+
+void fmime_buffer_free(fmime_buffer_t *buf)
+{
+	g_free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+}
+
 static void _fmime_file_destroy(fmime_message_t *msg)
 {
 	struct fmime_message_fi *fi = msg->_privData;
-	munmap(fi->map, fi->map_len);
-	close(fi->fd);
+	if(fi->map) {
+		munmap(fi->map, fi->map_len);
+	}
+	if(fi->buf && !fi->user) {
+		_fmime_io_put(fi->buf, fi->buf_size);
+	}
 	g_free(fi);
 }
 
 fmime_message_t *fmime_parse_file(const char *fname)
+{
+	return fmime_parse_file_ex(fname, FMIME_IO_AUTO, NULL);
+}
+
+fmime_message_t *fmime_parse_file_ex(const char *fname, int io, fmime_buffer_t *buf)
 {
 	fmime_message_t *ret = NULL;
 	struct fmime_message_fi *fi;
-	struct stat st;
+	const char *memory;
+	size_t len;
+	int fd;
 	assert(initialized);
 
-	fi = g_malloc0(sizeof(struct fmime_message_fi));
-	fi->fd = open(fname, O_RDONLY);
-	if(fi->fd<0) {
-		g_free(fi);
+	if((fd = _fmime_open_file(fname, &len)) < 0) {
 		return NULL;
 	}
-	fstat(fi->fd, &st);
-	fi->map_len = st.st_size;
-
-	fi->map = mmap(NULL, fi->map_len, PROT_READ, MAP_SHARED, fi->fd, 0);
+	fi = g_malloc0(sizeof(struct fmime_message_fi));
+	fi->fd = -1;
+	if(io == FMIME_IO_AUTO) {
+		io = len >= FMIME_IO_MMAP_MIN ? FMIME_IO_MMAP : FMIME_IO_READ;
+	}
 
-	ret = g_malloc0(sizeof(fmime_message_t));
+	if(io == FMIME_IO_MMAP && len) {
+		// large messages are read once front to back, fault them in
+		// with the mapping instead of page by page
+		fi->map = mmap(NULL, len, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+		if(fi->map == MAP_FAILED) {
+			fi->map = NULL;
+		} else {
+			madvise(fi->map, len, MADV_SEQUENTIAL);
+			fi->map_len = len;
+		}
+	}
+	if(fi->map) {
+		memory = fi->map;
+	} else {
+		// small file, or mmap failed: one read()
+		if(buf) {
+			_fmime_buffer_reserve(buf, len);
+			fi->user = buf;
+			fi->buf = buf->data;
+			fi->buf_size = buf->size;
+		} else {
+			fi->buf = _fmime_io_get(len + 1, &fi->buf_size);
+		}
+		if(_fmime_read_all(fd, fi->buf, len) != len) {
+			// a read error, or the file shrank
+			close(fd);
+			if(!fi->user) {
+				_fmime_io_put(fi->buf, fi->buf_size);
+			}
+			g_free(fi);
+			return NULL;
+		}
+		fi->buf[len] = '\0';
+		memory = fi->buf;
+	}
+	close(fd);
 
+	ret = fmime_parse_memory(memory, len);
 	ret->_privData = fi;
 	ret->_destroyCallBack = _fmime_file_destroy;
 
-	return _fmime_parse_memory(ret, fi->map, fi->map_len);
+	return ret;
 }
 
 fmime_message_t *fmime_parse_memory(const char *memory, size_t len)
 {
-	fmime_message_t *ret = NULL;
-	ret = g_malloc0(sizeof(fmime_message_t));
+	fmime_parser_ctx_t *ctx = fmime_ctx_new();
 
-	return _fmime_parse_memory(ret, memory, len);
+	ctx->standalone = 1;
+	return _fmime_parse_memory(ctx, memory, len);
 }
 
-static fmime_message_t *_fmime_parse_memory(fmime_message_t *ret, const char *memory, size_t len)
+static fmime_message_t *_fmime_parse_memory(fmime_parser_ctx_t *ctx, const char *memory, size_t len)
 {
+	fmime_message_t *ret = &ctx->msg;
+	struct _fmime_arena *arena = &ctx->arena;
 	size_t i;
 	const char *ctype;
 	assert(initialized);
 
+	ret->_ctx = ctx;
+	ret->begin = memory;
 	ret->len = len;
+	ret->headers = _fmime_headers_new(arena);
 
-	ret->headers = g_hash_table_new_full(
-		_fmime_str_hsh, _fmime_str_eq,
-		g_free, NULL
-	);
-
-	i = _fmime_generic_parse_header(ret->headers, memory, len);
+	i = ret->body_off = _fmime_generic_parse_header(ret->headers, ctx->filter, memory, len);
 
 	if((ctype = fmime_get_header(ret, "Content-Type"))) {
 		for(;*ctype && isspace(*ctype); ctype++) {
 			// do nothing
 		}
 		if(!strncasecmp("multipart/", ctype, strlen("multipart/"))) {
+			fmime_part_t *root;
 			int r;
-			const char *boundary = NULL;
 			char *copyheaders[] = {
 				"Content-Type",
 				"Content-Disposition",
 				NULL
 			};
 			// ok we got a mime multipart msg;
-			ret->root = g_malloc0(sizeof(fmime_part_t));
-			ret->root->len = len - i;
-			ret->root->begin = memory+i;
-			ret->root->headers = g_hash_table_new_full(
-					_fmime_str_hsh, _fmime_str_eq,
-					g_free, NULL
-				);
-			D(fprintf(stderr, "Adding part %p\n", ret->root));
-
-
-			for(;i< len && isspace(*(ret->root->begin));ret->root->begin++, i++) {
-				D(fprintf(stderr, "skiping: %i\n", *(ret->root->begin)));
+			for(;i < len && isspace(memory[i]);i++) {
+				D(fprintf(stderr, "skiping: %i\n", memory[i]));
 			}
-			ret->root->len = len - i;
-			//D(fprintf(stderr, "Will parse: \n-------------\n%s\n----------------------\n", ret->root->begin));
+			root = _fmime_part_new(ctx, -1, memory + i, len - i);
+			root->headers = _fmime_headers_new(arena);
+			D(fprintf(stderr, "Adding part %p\n", root));
 
 			for(r=0;copyheaders[r];r++) {
 				const char *h = fmime_get_header(ret, copyheaders[r]);
 				if(h) {
-					fmime_part_addheader(ret->root, copyheaders[r], h);
+					fmime_part_addheader(root, copyheaders[r], h);
 				}
 			}
 
-			if((boundary = _fmime_get_boundary(ctype, strlen(ctype)))) {
-				const char *begin = memory + i;
-				const int blen = strlen(boundary);
-				D(fprintf(stderr, "**** Boundary: %s\n", boundary));
-				while((begin = g_strstr_len(begin, len - (begin - memory), boundary))) {
-					const char *data = begin +  blen + 1;
-					const char *end = g_strstr_len(data, len - (data - memory), boundary);
-
-					if(end) {
-						size_t data_len;
-						fmime_part_t *part;
-
-						data_len = end - data;
-						D(fprintf(stderr, "Got a part with %zi bytes\n", data_len));
-
-						part = _fmime_parse_part_memory(data, data_len, ctype);
-						D(fprintf(stderr, "Adding subpart: %p\n", part));
-						ret->root->children = g_list_append(ret->root->children, part);
-
-						if(*(end + blen) == '-' &&
-								*(end + blen + 1) == '-' ) {
-
-							D(fprintf(stderr, "LAST PART DONE\n"));
-							break;
-						}
-						begin = end;
-					} else {
-						fprintf(stderr, "MISSING LAST PART\n");
-						break;
-					}
-				}
-				D(fprintf(stderr, "**** Done searching for %s\n", boundary));
-				pcre_free_substring(boundary);
-			}
+			_fmime_parse_multipart(ctx, 0, root->begin, root->len, ctype, 0);
+			_fmime_parts_link(ctx);
 		}
 	} else {
 		// single part text only
@@ -334,298 +699,5184 @@ static fmime_message_t *_fmime_parse_memory(fmime_message_t *ret, const char *me
 	return ret;
 }
 
-static fmime_part_t *_fmime_parse_part_memory(const char *memory, size_t len, const char *pctype)
+// Appends a part to the context's array. Pointers to parts are only
+// stable once the whole message is parsed, until then use indices.
+static fmime_part_t *_fmime_part_new(fmime_parser_ctx_t *ctx, int parent, const char *begin, size_t len)
 {
-	size_t i;
-	const char *ctype;
 	fmime_part_t *ret;
-	assert(initialized);
 
-	ret = g_malloc0(sizeof(fmime_part_t));
+	if(ctx->msg.nparts == ctx->parts_alloc) {
+		ctx->parts_alloc = ctx->parts_alloc ? ctx->parts_alloc * 2 : 16;
+		ctx->parts = g_renew(fmime_part_t, ctx->parts, ctx->parts_alloc);
+	}
+	ret = &ctx->parts[ctx->msg.nparts];
+	memset(ret, 0, sizeof(*ret));
+	ret->begin = begin;
 	ret->len = len;
-	ret->begin = memory;
+	ret->index = ctx->msg.nparts++;
+	ret->parent = parent;
+	ret->first_child = -1;
+	ret->next_sibling = -1;
+	ret->depth = parent < 0 ? 0 : ctx->parts[parent].depth + 1;
+	return ret;
+}
 
-	ret->headers = g_hash_table_new_full(
-		//g_str_hash, g_str_equal,
-		_fmime_str_hsh, _fmime_str_eq,
-		g_free, NULL
-	);
+// Sets the pointer views once the array stopped moving. The children
+// arrays are slices of one array, laid out part after part.
+static void _fmime_parts_link(fmime_parser_ctx_t *ctx)
+{
+	fmime_message_t *msg = &ctx->msg;
+	fmime_part_t **kids;
+	int i, c;
 
-	i = _fmime_generic_parse_header(ret->headers, memory, len);
+	msg->parts = ctx->parts;
+	msg->root = ctx->parts;
+	kids = _fmime_arena_alloc(&ctx->arena, msg->nparts * sizeof(fmime_part_t *));
+	for(i=0;i<msg->nparts;i++) {
+		fmime_part_t *part = &msg->parts[i];
 
-	if((ctype = fmime_part_get_header(ret, "Content-Type"))) {
-		for(;*ctype && isspace(*ctype); ctype++) {
-			// do nothing
+		if(part->nchildren) {
+			part->children = kids;
+			for(c=part->first_child;c >= 0;c=msg->parts[c].next_sibling) {
+				*kids++ = &msg->parts[c];
+			}
 		}
-		if(!strncasecmp("multipart/", ctype, strlen("multipart/"))) {
-			const char *boundary = NULL;
-			// ok we got a mime multipart msg;
-
-			if((boundary = _fmime_get_boundary(ctype, strlen(ctype)))) {
-				const char *begin = memory + i;
-				const int blen = strlen(boundary);
-				while((begin = g_strstr_len(begin, len - (begin - memory), boundary))) {
-					const char *data = begin +  blen + 1;
-					const char *end = g_strstr_len(data, len - (data - memory), boundary);
-					if(end) {
-						size_t data_len;
-						fmime_part_t *part;
-
-						data_len = end - data;
-						D(fprintf(stderr, "Got a part with %zi bytes\n", data_len));
+	}
+}
 
-						part = _fmime_parse_part_memory(data, data_len, ctype);
-						ret->children = g_list_append(ret->children, part);
+static int _fmime_parse_part_memory(fmime_parser_ctx_t *ctx, int parent, const char *memory, size_t len, int depth)
+{
+	fmime_part_t *part;
+	fmime_headers_t *headers;
+	const GList *h;
+	const char *ctype;
+	size_t i;
+	int ret;
+	assert(initialized);
 
-						// XXX: todo: look for other parts inside this one in a recursive function
+	part = _fmime_part_new(ctx, parent, memory, len);
+	ret = part->index;
+	headers = part->headers = _fmime_headers_new(&ctx->arena);
 
-						if(*(end + strlen(boundary)) == '-' &&
-								*(end + strlen(boundary) + 1) == '-' ) {
+	i = part->body_off = _fmime_generic_parse_header(headers, ctx->filter, memory, len);
 
-							D(fprintf(stderr, "LAST PART DONE\n"));
-							break;
-						}
-						begin = end;
-					} else {
-						// XXX: is this valid?
-						// What should we do? consider memory + len as the end of this part?
-						fprintf(stderr, "MISSING LAST PART\n");
-						break;
-					}
-				}
-				fprintf(stderr, "**** Done searching for %s\n", boundary);
-				pcre_free_substring(boundary);
-			}
+	// part is dangling once children are added
+	if((h = _fmime_headers_get(headers, "Content-Type"))) {
+		for(ctype=h->data;*ctype && isspace(*ctype); ctype++) {
+			// do nothing
+		}
+		// past FMIME_MAX_DEPTH a multipart is kept as a leaf, each level
+		// rescans its body so this bounds the work on nested bombs
+		if(!strncasecmp("multipart/", ctype, strlen("multipart/")) && depth < FMIME_MAX_DEPTH) {
+			_fmime_parse_multipart(ctx, ret, memory + i, len - i, ctype, depth + 1);
 		}
 	}
 
 	return ret;
 }
 
+// Builds "--boundary" from the Content-Type into delim, which has room
+// for FMIME_BOUNDARY_MAX. Returns its length, 0 if there's no usable one.
+static size_t _fmime_get_delimiter(const char *ctype, char *delim)
+{
+	fmime_slice_t b;
+	char *decoded;
+	size_t ret = 0;
 
-static char * _fmime_escape_boundary(const char *boundary)
-{
-	GString *escaped = g_string_new(NULL);
-	for(;boundary && *boundary; boundary++) {
-		switch(*boundary) {
-			case '.':
-			case '+':
-			case '*':
-			case '(':
-			case ')':
-			case '{':
-			case '}':
-			case '[':
-			case ']':
-			case '?':
-			case '\\':
-				g_string_append_c(escaped, '\\');
-			default:
-				g_string_append_c(escaped, *boundary);
-		}
+	if(fmime_header_get_param(ctype, "boundary", &b, &decoded) && b.len && b.len <= FMIME_BOUNDARY_MAX) {
+		delim[0] = delim[1] = '-';
+		memcpy(delim + 2, b.ptr, b.len);
+		delim[b.len + 2] = '\0';
+		ret = b.len + 2;
 	}
-
-	return g_string_free(escaped, FALSE);
+	g_free(decoded);
+	return ret;
 }
 
-
-int _fmime_generic_addheader(GHashTable *headers, const char *header, const char *rawValue)
+// Finds the next delimiter line in [p, end). Returns its first dash, or
+// NULL; *next is set past the line break ending it and *close when it is
+// the close delimiter. A rejected candidate skips its whole line, so each
+// byte is looked at a bounded number of times whatever the input.
+// In recovery mode the delimiter doesn't need to start the line.
+static const char *_fmime_next_delimiter(const char *body, const char *p, const char *end,
+		const char *delim, size_t dlen, int recover, const char **next, int *close)
 {
-	GList *values;
-	//fprintf(stderr, "header: '%s' value: '%s'\n", header, rawValue);
+	const char *q, *s, *eol;
 
-	values = g_hash_table_lookup(headers, header);
-	values = g_list_append(values, g_strdup(rawValue));
-
-	g_hash_table_insert(headers, g_strdup(header), values);
-	return 0;
+	while((q = memmem(p, end - p, delim, dlen))) {
+		if(!recover && q != body && q[-1] != '\n') {
+			eol = memchr(q + dlen, '\n', end - q - dlen);
+			p = eol ? eol + 1 : end;
+			continue;
+		}
+		s = q + dlen;
+		*close = end - s >= 2 && s[0] == '-' && s[1] == '-';
+		if(*close) {
+			s += 2;
+		}
+		for(;s < end && (*s == ' ' || *s == '\t' || *s == '\r');s++) {
+			// transport padding
+		}
+		eol = s < end ? memchr(s, '\n', end - s) : NULL;
+		*next = eol ? eol + 1 : end;
+		if(s == end || *s == '\n') {
+			return q;
+		}
+		// a longer boundary sharing our prefix
+		p = *next;
+	}
+	return NULL;
 }
 
-
-static size_t _fmime_generic_parse_header(GHashTable *headers, const char *memory, size_t len)
+// Splits a multipart body in its parts, adding them to parent. The
+// preamble and epilogue are skipped. Without a close delimiter the last
+// part is dropped, unless the ctx has FMIME_RECOVER: then it runs to the end
+// of the buffer, like MUAs display it.
+static void _fmime_parse_multipart(fmime_parser_ctx_t *ctx, int parent, const char *body, size_t len, const char *ctype, int depth)
 {
-	size_t i;
-	int inHeaders = 1;
-	int begin_off = 0;
-	int headersDone = 0;
-	char *current_header = NULL;
-	GString *value = NULL;
-	assert(initialized);
-
-	for(i=0;i<len && !headersDone;i++) {
-		if(inHeaders) {
-			if(memory[i] == ':') {
-				inHeaders = 0;
-				current_header = g_strndup(memory + begin_off, i - begin_off);
-				if(value) {
-					D(fprintf(stderr, "** value not null: %s!!!!\n", value->str));
-					g_string_free(value, TRUE);
-				}
-				assert(value==NULL);
+	const char *end = body + len;
+	const char *p = body;
+	const char *start = NULL;
+	const char *q, *next, *data_end;
+	char delim[FMIME_BOUNDARY_MAX + 3];
+	size_t dlen;
+	int close = 0;
+	int recover = ctx->flags & FMIME_RECOVER;
+	int last = -1;
 
-				value = g_string_new(NULL);
-				//fprintf(stderr, "-- Header: %s\n", current_header);
-				begin_off = i+1;
-				if(i+1 < len && isspace(memory[i+1])) {
-					begin_off ++;
+	if(!(dlen = _fmime_get_delimiter(ctype, delim))) {
+		return;
+	}
+	D(fprintf(stderr, "**** Boundary: %s\n", delim));
+	while((q = _fmime_next_delimiter(body, p, end, delim, dlen, recover, &next, &close))) {
+		if(start) {
+			// the line break before the delimiter belongs to it
+			data_end = q;
+			if(data_end > start && data_end[-1] == '\n') {
+				data_end--;
+				if(data_end > start && data_end[-1] == '\r') {
+					data_end--;
 				}
 			}
+			D(fprintf(stderr, "Got a part with %zi bytes\n", (size_t)(data_end - start)));
+			last = _fmime_part_add_child(ctx, parent, last, start, data_end - start, depth);
+		}
+		if(close) {
+			D(fprintf(stderr, "LAST PART DONE\n"));
+			start = NULL;
+			break;
+		}
+		start = p = next;
+	}
+	if(start) {
+		if(recover) {
+			_fmime_part_add_child(ctx, parent, last, start, end - start, depth);
 		} else {
-			if((memory[i] == '\n') && ((i+1) < len)) {
-				//fprintf(stderr, "nextchar: 0x%02x '%c'\n", memory[i+1], memory[i+1]);
-				switch(memory[i+1]) {
-					case ' ':
-					case '\t':
-						D(fprintf(stderr, "** multiline header\n"));
-						break;
-					case '\n':
-					case '\r':
-						D(fprintf(stderr, "** end of headers\n"));
-						headersDone = 1;
-						// add last header
-					default:
-						// add header
-						g_string_append_len(value, memory + begin_off, i - begin_off);
-						_fmime_generic_addheader(headers, current_header, value->str);
-						g_string_free(value, TRUE); value = NULL;
-						g_free(current_header); current_header = NULL;
-						inHeaders = 1;
-						begin_off = i + 1;
-						break;
-				}
-			}
-		}
-	}
-	if(value != NULL) {
-		D(fprintf(stderr, "Error parsing: value: '%s'\n", value->str));
-		D(fprintf(stderr, "Error parsing: memory: '%s'\n", memory));
-		g_string_free(value, TRUE);
-	}
-	assert(value == NULL);
-	return i;
+			fprintf(stderr, "MISSING LAST PART\n");
+		}
+	}
+	D(fprintf(stderr, "**** Done searching for %s\n", delim));
 }
 
 
-/*
-	GHashTable *headers;
-	GList *children;
-*/
-
-void fmime_part_free(fmime_part_t *part)
+static int _fmime_generic_addheader(fmime_headers_t *headers, const char *header, const char *rawValue)
 {
-	D(fprintf(stderr, "%s: %p\n", __func__, part));
-	if(part) {
-		if(part->children) {
-			GList *child;
-			for(child = part->children ; child; child = g_list_next(child)) {
-				fmime_part_free(child->data);
-			}
-			g_list_free(child);
-		}
-		if(part->headers) {
-			g_hash_table_foreach_steal(part->headers, _fmime_free_foreach, NULL);
-			g_hash_table_destroy(part->headers);
-		}
-		g_free(part);
-	}
+	_fmime_headers_add(headers, header, strlen(header), rawValue, strlen(rawValue));
+	return 0;
 }
 
-int fmime_part_is_type(fmime_part_t *part, const char *type, const char *subtype)
-{
-	int t = 0;
-	int s = 0;
-	int ovector[30];
-	int r;
-	const char *mtype = fmime_part_get_header(part, "Content-Type");
 
-	mtype = mtype ? mtype : "text/plain;";
+// A header field found by _fmime_next_header. The value keeps the folding
+// line breaks but not the final one.
+struct _fmime_hline {
+	const char *name;
+	size_t name_len;
+	const char *value;
+	size_t value_len;
+};
 
-	if((r = pcre_exec(mtype_re, mtype_extra,
-			mtype, strlen(mtype), 0, 
-			0, ovector, 30)) != PCRE_ERROR_NOMATCH) {
-		if(type && type[0] == '*') {
-			t = 1;
-		} else {
-			const char *type2;
-			pcre_get_substring(mtype, ovector, r, 1, &type2);
-			t = !strcasecmp(type, type2);
-			pcre_free_substring(type2);
+// Reads the header field starting at off, without copying. Returns the
+// offset of the next field, or 0 at the end of the header, with *body set
+// to the offset of the body. The mbox From_ line, lines without a colon
+// and fields whose name isn't RFC 5322 ftext (printable, no spaces) are
+// skipped; white space before the colon is allowed, like obs-optional.
+static size_t _fmime_next_header(const char *buf, size_t len, size_t off, struct _fmime_hline *h, size_t *body)
+{
+	while(off < len) {
+		const char *line = buf + off;
+		const char *eol, *colon, *v, *ve;
+		size_t next;
+
+		if(*line == '\n') {
+			*body = off + 1;
+			return 0;
 		}
-		if(subtype && subtype[0] == '*') {
-			s = 1;
-		} else {
-			const char *stype2;
-			pcre_get_substring(mtype, ovector, r, 2, &stype2);
-			s = !strcasecmp(subtype, stype2);
-			pcre_free_substring(stype2);
+		if(*line == '\r' && off + 1 < len && line[1] == '\n') {
+			*body = off + 2;
+			return 0;
+		}
+
+		eol = memchr(line, '\n', len - off);
+		next = eol ? (eol - buf) + 1 : len;
+		colon = memchr(line, ':', (eol ? eol : buf + len) - line);
+		if(!colon || colon == line || (!off && len >= 5 && !memcmp(line, "From ", 5))) {
+			// mbox From_ line (its time has colons) or garbage
+			off = next;
+			continue;
+		}
+		while(next < len && (buf[next] == ' ' || buf[next] == '\t')) {
+			eol = memchr(buf + next, '\n', len - next);
+			next = eol ? (eol - buf) + 1 : len;
+		}
+
+		h->name = line;
+		for(h->name_len = colon - line;h->name_len && isspace((unsigned char)line[h->name_len - 1]);h->name_len--) {
+			// do nothing
+		}
+		for(v=line;v < line + h->name_len && *v > ' ' && *v < 127;v++) {
+			// do nothing
+		}
+		if(!h->name_len || v < line + h->name_len) {
+			// not a field name, the whole field is dropped
+			off = next;
+			continue;
+		}
+		for(v=colon+1;v < buf + next && (*v == ' ' || *v == '\t');v++) {
+			// do nothing
+		}
+		for(ve=buf+next;ve > v && isspace((unsigned char)ve[-1]);ve--) {
+			// do nothing
 		}
+		h->value = v;
+		h->value_len = ve - v;
+		return next;
+	}
+	*body = len;
+	return 0;
+}
+
+// Fills headers from the header block at memory, LF or CRLF terminated
+// (mixed too): values never keep the final \r. Returns the offset of the
+// body, past the empty line.
+static size_t _fmime_generic_parse_header(fmime_headers_t *headers, const struct _fmime_hfilter *filter, const char *memory, size_t len)
+{
+	struct _fmime_hline h;
+	size_t off, body = len;
+	assert(initialized);
+
+	for(off=0;(off = _fmime_next_header(memory, len, off, &h, &body));) {
+		if(!filter || _fmime_hfilter_match(filter, h.name, h.name_len)) {
+			_fmime_headers_add(headers, h.name, h.name_len, h.value, h.value_len);
+		}
+	}
+	return body;
+}
+
+
+void fmime_part_free(fmime_part_t *part)
+{
+	// parts live in their message's arena
+}
+
+// Parses a sub part of parent and links it after its last child.
+// Returns the new child.
+static int _fmime_part_add_child(fmime_parser_ctx_t *ctx, int parent, int last, const char *memory, size_t len, int depth)
+{
+	int child = _fmime_parse_part_memory(ctx, parent, memory, len, depth);
+
+	if(last < 0) {
+		ctx->parts[parent].first_child = child;
+	} else {
+		ctx->parts[last].next_sibling = child;
+	}
+	ctx->parts[parent].nchildren++;
+	return child;
+}
+
+int fmime_part_child_count(const fmime_part_t *part)
+{
+	return part->nchildren;
+}
+
+fmime_part_t *fmime_part_child_at(const fmime_part_t *part, int idx)
+{
+	if(idx < 0 || idx >= part->nchildren) {
+		return NULL;
+	}
+	return part->children[idx];
+}
+
+fmime_part_t **fmime_part_children(const fmime_part_t *part, int *count)
+{
+	*count = part->nchildren;
+	return part->children;
+}
+
+fmime_part_t *fmime_message_parts(const fmime_message_t *msg, int *count)
+{
+	*count = msg->nparts;
+	return msg->parts;
+}
+
+// The body of a message without root as a part, with the message headers
+// (IMAP section 1)
+static fmime_part_t *_fmime_message_body(fmime_message_t *msg)
+{
+	fmime_part_t *part = msg->_body;
+
+	if(!part) {
+		part = msg->_body = _fmime_arena_alloc0(&msg->_ctx->arena, sizeof(fmime_part_t));
+		part->begin = msg->begin;
+		part->len = msg->len;
+		part->body_off = msg->body_off;
+		part->headers = msg->headers;
+		part->index = part->parent = part->first_child = part->next_sibling = -1;
+	}
+	return part;
+}
+
+// Splits `type/subtype; params`, returns 0 if it isn't a media type
+static int _fmime_split_ctype(const char *h, fmime_slice_t *type, fmime_slice_t *subtype)
+{
+	const char *t, *s;
+
+	for(t=h;*t && isspace((unsigned char)*t);t++) {
+		// do nothing
+	}
+	for(s=t;*s && *s != '/' && *s != ';' && !isspace((unsigned char)*s);s++) {
+		// do nothing
+	}
+	if(*s != '/' || s == t) {
+		return 0;
+	}
+	type->ptr = t;
+	type->len = s - t;
+	for(t=++s;*s && *s != ';' && !isspace((unsigned char)*s);s++) {
+		// do nothing
+	}
+	subtype->ptr = t;
+	subtype->len = s - t;
+	return s > t;
+}
 
+// Splits the Content-Type once and caches the tokens on the part.
+// Missing or broken Content-Type means text/plain (RFC 2045 5.2).
+static void _fmime_part_parse_ctype(fmime_part_t *part)
+{
+	const char *h = fmime_part_get_header(part, "Content-Type");
+
+	part->_cached |= FMIME_CACHED_CTYPE;
+	if(!h || !_fmime_split_ctype(h, &part->_type, &part->_subtype)) {
+		part->_type.ptr = "text";
+		part->_type.len = 4;
+		part->_subtype.ptr = "plain";
+		part->_subtype.len = 5;
+	}
+}
+
+int fmime_part_get_content_type(fmime_part_t *part, fmime_slice_t *type, fmime_slice_t *subtype)
+{
+	if(!(part->_cached & FMIME_CACHED_CTYPE)) {
+		_fmime_part_parse_ctype(part);
+	}
+	if(type) {
+		*type = part->_type;
+	}
+	if(subtype) {
+		*subtype = part->_subtype;
+	}
+	return 1;
+}
+
+static int _fmime_slice_eq(const fmime_slice_t *s, const char *str, size_t len)
+{
+	return s->len == len && !g_ascii_strncasecmp(s->ptr, str, len);
+}
+
+int fmime_part_is_type(fmime_part_t *part, const char *type, const char *subtype)
+{
+	if(!(part->_cached & FMIME_CACHED_CTYPE)) {
+		_fmime_part_parse_ctype(part);
+	}
+	if(!type || !subtype) {
+		return 0;
+	}
+	return (type[0] == '*' || _fmime_slice_eq(&part->_type, type, strlen(type))) &&
+		(subtype[0] == '*' || _fmime_slice_eq(&part->_subtype, subtype, strlen(subtype)));
+}
+
+// Caches the disposition token (inline, attachment) of the part
+static void _fmime_part_parse_disposition(fmime_part_t *part)
+{
+	const char *h = fmime_part_get_header(part, "Content-Disposition");
+	const char *e;
+
+	part->_cached |= FMIME_CACHED_DISPOSITION;
+	part->_disposition.ptr = NULL;
+	part->_disposition.len = 0;
+	if(h) {
+		for(;*h && isspace((unsigned char)*h);h++) {
+			// do nothing
+		}
+		for(e=h;*e && *e != ';' && !isspace((unsigned char)*e);e++) {
+			// do nothing
+		}
+		part->_disposition.ptr = h;
+		part->_disposition.len = e - h;
 	}
-	return t && s;
 }
 
 int fmime_part_is_disposition(fmime_part_t *part, const char *desiredDisposition)
 {
-	const char *disp = fmime_part_get_header(part, "Content-Disposition");
-	if(disp && desiredDisposition) {
-		return strcasestr(disp, desiredDisposition) ? 1 : 0;
+	if(!(part->_cached & FMIME_CACHED_DISPOSITION)) {
+		_fmime_part_parse_disposition(part);
+	}
+	if(part->_disposition.ptr && desiredDisposition) {
+		return _fmime_slice_eq(&part->_disposition, desiredDisposition, strlen(desiredDisposition));
 	}
 	return 0;
 }
 
-char *fmime_part_get_filename(fmime_part_t *part)
+static const char * const _fmime_default_inline_types[] = {
+	"text/*",
+	"message/*",
+	NULL
+};
+
+static const fmime_attach_policy_t _fmime_default_attach_policy = {
+	1024 * 1024,
+	_fmime_default_inline_types
+};
+
+// Checks the part type against a "type/subtype" list, either may be `*`
+static int _fmime_part_type_in(fmime_part_t *part, const char * const *types)
+{
+	for(;*types;types++) {
+		const char *slash = strchr(*types, '/');
+		const char *sub = slash ? slash + 1 : "*";
+		size_t tlen = slash ? slash - *types : strlen(*types);
+
+		if(((tlen == 1 && (*types)[0] == '*') || _fmime_slice_eq(&part->_type, *types, tlen)) &&
+				(sub[0] == '*' || _fmime_slice_eq(&part->_subtype, sub, strlen(sub)))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int fmime_part_is_attachment(fmime_part_t *part, const fmime_attach_policy_t *policy)
+{
+	fmime_slice_t fname;
+
+	if(!policy) {
+		policy = &_fmime_default_attach_policy;
+	}
+	if(policy->inline_max_bytes && part->len > policy->inline_max_bytes) {
+		return 1;
+	}
+	if(!(part->_cached & FMIME_CACHED_CTYPE)) {
+		_fmime_part_parse_ctype(part);
+	}
+	if(_fmime_slice_eq(&part->_type, "multipart", 9)) {
+		return 0;
+	}
+	if(!_fmime_part_type_in(part, policy->inline_types ? policy->inline_types : _fmime_default_inline_types)) {
+		return 1;
+	}
+	// an inline type, unless marked otherwise
+	return fmime_part_is_disposition(part, "attachment") ||
+		fmime_part_get_filename_slice(part, &fname);
+}
+
+int fmime_message_has_attachment(fmime_message_t *msg, const fmime_attach_policy_t *policy)
 {
 	int i;
-	const char *headers[] = {
-		"Content-Type",
-		"Content-Disposition",
-		NULL
-	};
-	char *ret = NULL;
-	for(i=0;headers[i];i++) {
-		int c;
-		int ovector[30];
-		const char *h = fmime_part_get_header(part, headers[i]);
-		//D(fprintf(stderr, "*** header: %s: %s\n", headers[i], h));
-		if(h && ((c = pcre_exec(fname_re, fname_extra, h, strlen(h), 0, 0, ovector, 30))!=PCRE_ERROR_NOMATCH)) {
-			char filename[1024] = "";
-			pcre_copy_substring(h, ovector, c, 3, filename, sizeof(filename));
-			if(filename[0]) {
-				ret = g_strdup(filename);
-				break;
+
+	if(!msg->root) {
+		// a single part message is its own only part
+		return fmime_part_is_attachment(_fmime_message_body(msg), policy);
+	}
+	// every part but the root, in document order
+	for(i=1;i<msg->nparts;i++) {
+		if(fmime_part_is_attachment(&msg->parts[i], policy)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int _fmime_hexval(int c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static const signed char _fmime_b64_tab[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+#define FMIME_CTE_IDENTITY 0
+#define FMIME_CTE_QP       1
+#define FMIME_CTE_BASE64   2
+
+// Undoes a Content-Transfer-Encoding a window at a time, so the output
+// can be consumed as it's made instead of decoding the whole body first
+struct _fmime_tdec {
+	const char *in;
+	size_t len;
+	size_t pos;
+	int cte;
+	guint32 acc; // base64 bits not output yet
+	int bits;
+};
+
+static void _fmime_tdec_init(struct _fmime_tdec *d, int cte, const char *in, size_t len)
+{
+	d->in = in;
+	d->len = len;
+	d->pos = 0;
+	d->cte = cte;
+	d->acc = 0;
+	d->bits = 0;
+}
+
+// Decodes up to size bytes into buf. Returns how many, fewer than size
+// only once the input is over.
+// base64: characters outside the alphabet (line breaks, garbage) are
+// skipped, '=' ends the data.
+// quoted-printable: soft line breaks are removed, broken escapes are
+// copied verbatim.
+static size_t _fmime_tdec_read(struct _fmime_tdec *d, char *buf, size_t size)
+{
+	const char *in = d->in;
+	size_t len = d->len;
+	size_t i = d->pos, n = 0;
+	int h, l;
+
+	switch(d->cte) {
+		case FMIME_CTE_BASE64:
+			for(;i<len && in[i] != '=' && n < size;i++) {
+				int v = _fmime_b64_tab[(unsigned char)in[i]];
+				if(v < 0) {
+					continue;
+				}
+				d->acc = (d->acc << 6) | v;
+				d->bits += 6;
+				if(d->bits >= 8) {
+					d->bits -= 8;
+					buf[n++] = (char)(d->acc >> d->bits);
+				}
 			}
-			pcre_copy_substring(h, ovector, c, 4, filename, sizeof(filename));
-			if(filename[0]) {
-				ret = g_strdup(filename);
-				break;
+			break;
+		case FMIME_CTE_QP:
+			for(;i<len && n < size;i++) {
+				if(in[i] != '=') {
+					buf[n++] = in[i];
+				} else if(i + 1 < len && in[i+1] == '\n') {
+					i++;
+				} else if(i + 2 < len && in[i+1] == '\r' && in[i+2] == '\n') {
+					i += 2;
+				} else if(i + 2 < len &&
+						(h = _fmime_hexval(in[i+1])) >= 0 && (l = _fmime_hexval(in[i+2])) >= 0) {
+					buf[n++] = (char)(h << 4 | l);
+					i += 2;
+				} else {
+					buf[n++] = in[i];
+				}
 			}
+			break;
+		default:
+			n = MIN(size, len - i);
+			memcpy(buf, in + i, n);
+			i += n;
+			break;
+	}
+	d->pos = i;
+	return n;
+}
+
+// Appends at most max decoded bytes to out, straight into its buffer
+static void _fmime_tdec_append(GString *out, struct _fmime_tdec *d, size_t max)
+{
+	while(max) {
+		size_t start = out->len;
+		size_t want = MIN(max, MAX(d->len - d->pos, 64));
+		size_t n;
+
+		g_string_set_size(out, start + want);
+		n = _fmime_tdec_read(d, out->str + start, want);
+		g_string_set_size(out, start + n);
+		if(n < want) {
+			break;
 		}
+		max -= n;
 	}
+}
 
-#ifndef NDEBUG
-	if(ret) {
-		D(fprintf(stderr, "*** filename: %s\n", ret));
+static void _fmime_b64_decode(GString *out, const char *in, size_t len, size_t max)
+{
+	struct _fmime_tdec d;
+
+	_fmime_tdec_init(&d, FMIME_CTE_BASE64, in, len);
+	_fmime_tdec_append(out, &d, max);
+}
+
+// Decodes the Q encoding of RFC 2047, appending the result to out
+static void _fmime_q_decode(GString *out, const char *in, size_t len)
+{
+	size_t i;
+
+	for(i=0;i<len;i++) {
+		int h, l;
+		if(in[i] == '_') {
+			g_string_append_c(out, ' ');
+		} else if(in[i] == '=' && i + 2 < len &&
+				(h = _fmime_hexval(in[i+1])) >= 0 && (l = _fmime_hexval(in[i+2])) >= 0) {
+			g_string_append_c(out, (char)(h << 4 | l));
+			i += 2;
+		} else {
+			g_string_append_c(out, in[i]);
+		}
+	}
+}
+
+static void _fmime_qp_decode(GString *out, const char *in, size_t len, size_t max)
+{
+	struct _fmime_tdec d;
+
+	_fmime_tdec_init(&d, FMIME_CTE_QP, in, len);
+	_fmime_tdec_append(out, &d, max);
+}
+
+static int _fmime_cte_lookup(const char *cte, size_t len)
+{
+	for(;len && isspace((unsigned char)*cte);cte++, len--) {
+		// do nothing
+	}
+	if(len >= 16 && !g_ascii_strncasecmp(cte, "quoted-printable", 16)) {
+		return FMIME_CTE_QP;
+	}
+	if(len >= 6 && !g_ascii_strncasecmp(cte, "base64", 6)) {
+		return FMIME_CTE_BASE64;
+	}
+	return FMIME_CTE_IDENTITY;
+}
+
+// Where the base64 groups of a part start, every FMIME_B64_CHECKPOINT
+// characters of the alphabet. Line breaks make it impossible to compute.
+struct fmime_b64_index {
+	size_t size;  // decoded
+	size_t count;
+	struct {
+		size_t dec;
+		size_t enc; // from the start of the body
+	} points[];
+};
+
+static struct fmime_b64_index *_fmime_b64_index(fmime_part_t *part)
+{
+	const char *body = part->begin + part->body_off;
+	size_t len = part->len - part->body_off;
+	struct fmime_b64_index *idx;
+	size_t i, n = 0;
+
+	if(part->_b64_index) {
+		return part->_b64_index;
+	}
+	idx = _fmime_arena_alloc(part->headers->arena,
+		sizeof(*idx) + (len / FMIME_B64_CHECKPOINT + 1) * sizeof(idx->points[0]));
+	idx->count = 0;
+	for(i=0;i<len && body[i] != '=';i++) {
+		if(_fmime_b64_tab[(unsigned char)body[i]] < 0) {
+			continue;
+		}
+		if(n % FMIME_B64_CHECKPOINT == 0) {
+			idx->points[idx->count].dec = n / 4 * 3;
+			idx->points[idx->count++].enc = i;
+		}
+		n++;
+	}
+	idx->size = n * 6 / 8;
+	return part->_b64_index = idx;
+}
+
+static size_t _fmime_b64_decode_range(fmime_part_t *part, size_t off, size_t len, char *out)
+{
+	struct fmime_b64_index *idx = _fmime_b64_index(part);
+	const char *body = part->begin + part->body_off;
+	size_t blen = part->len - part->body_off;
+	size_t lo = 0, hi = idx->count;
+	size_t i, quanta, skip, got = 0;
+	guint32 acc = 0;
+	int bits = 0;
+
+	if(off >= idx->size) {
+		return 0;
+	}
+	len = MIN(len, idx->size - off);
+	// the last checkpoint at or before off
+	while(hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if(idx->points[mid].dec <= off) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	i = idx->points[lo].enc;
+	// whole groups before off are only counted
+	quanta = (off - idx->points[lo].dec) / 3;
+	skip = (off - idx->points[lo].dec) % 3;
+	for(quanta*=4;quanta;i++) {
+		if(_fmime_b64_tab[(unsigned char)body[i]] >= 0) {
+			quanta--;
+		}
+	}
+	for(;i<blen && got < len;i++) {
+		int v = _fmime_b64_tab[(unsigned char)body[i]];
+		if(v < 0) {
+			continue;
+		}
+		acc = (acc << 6) | v;
+		bits += 6;
+		if(bits >= 8) {
+			bits -= 8;
+			if(skip) {
+				skip--;
+			} else {
+				out[got++] = (char)(acc >> bits);
+			}
+		}
+	}
+	return got;
+}
+
+size_t fmime_part_decode_range(fmime_part_t *part, size_t off, size_t len, char *out)
+{
+	const char *cte = fmime_part_get_header(part, "Content-Transfer-Encoding");
+	const char *body = part->begin + part->body_off;
+	size_t blen = part->len - part->body_off;
+	GString *buf;
+	size_t ret;
+
+	switch(cte ? _fmime_cte_lookup(cte, strlen(cte)) : FMIME_CTE_IDENTITY) {
+		case FMIME_CTE_BASE64:
+			return _fmime_b64_decode_range(part, off, len, out);
+		case FMIME_CTE_QP:
+			// escapes and soft line breaks are rare enough not to index
+			buf = g_string_sized_new(MIN(blen, off + len));
+			_fmime_qp_decode(buf, body, blen, off + len);
+			ret = off < buf->len ? MIN(len, buf->len - off) : 0;
+			memcpy(out, buf->str + off, ret);
+			g_string_free(buf, TRUE);
+			return ret;
+		default:
+			if(off >= blen) {
+				return 0;
+			}
+			ret = MIN(len, blen - off);
+			memcpy(out, body + off, ret);
+			return ret;
 	}
+}
+
+// Running counts of _fmime_count_body
+struct _fmime_counter {
+	size_t nl;
+	size_t b64;  // alphabet characters before the first '='
+	size_t out;  // quoted-printable decoded size
+	size_t next; // first byte after the last quoted-printable escape
+	int cte;
+	int b64_done;
+};
+
+// Counts p[from..to), len is there to look ahead past to. A '=' ends
+// base64; in quoted-printable escapes and soft line breaks shrink the
+// output, matched like _fmime_qp_decode does.
+static void _fmime_count_scalar(struct _fmime_counter *c, const char *p, size_t from, size_t to, size_t len)
+{
+	size_t i;
+
+	for(i=from;i<to;i++) {
+		if(p[i] == '\n') {
+			c->nl++;
+		} else if(p[i] == '=') {
+			c->b64_done = 1;
+			if(c->cte != FMIME_CTE_QP || i < c->next) {
+				continue;
+			}
+			if(i + 1 < len && p[i+1] == '\n') {
+				c->out -= 2;
+				c->next = i + 2;
+			} else if(i + 2 < len && p[i+1] == '\r' && p[i+2] == '\n') {
+				c->out -= 3;
+				c->next = i + 3;
+			} else if(i + 2 < len && _fmime_hexval(p[i+1]) >= 0 && _fmime_hexval(p[i+2]) >= 0) {
+				c->out -= 2;
+				c->next = i + 3;
+			}
+		} else if(!c->b64_done && _fmime_b64_tab[(unsigned char)p[i]] >= 0) {
+			c->b64++;
+		}
+	}
+}
+
+#ifdef __SSE2__
+// 0xff in the lanes holding a base64 alphabet character
+static __m128i _fmime_b64_alpha_epi8(__m128i v)
+{
+	// or 0x20 folds upper case into lower, bytes >= 0x80 are negative
+	__m128i l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+		_mm_cmplt_epi8(l, _mm_set1_epi8('z' + 1)));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	__m128i sym = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+
+	return _mm_or_si128(_mm_or_si128(letter, digit), sym);
+}
+
+static size_t _fmime_sum_epu8(__m128i v)
+{
+	guint64 s[2];
+
+	_mm_storeu_si128((__m128i *)s, _mm_sad_epu8(v, _mm_setzero_si128()));
+	return s[0] + s[1];
+}
 #endif
-	return ret;
+
+// Counts the lines of an encoded body and its decoded size in one read.
+// With SSE2 16 bytes go at a time, into per lane counters folded every
+// 255 blocks; the rare blocks holding a '=' go byte by byte.
+static void _fmime_count_body(const char *p, size_t len, int cte, size_t *lines, size_t *size)
+{
+	struct _fmime_counter c = { 0, 0, len, 0, cte, cte != FMIME_CTE_BASE64 };
+	size_t off = 0;
+
+#ifdef __SSE2__
+	while(len - off >= 16) {
+		__m128i nl = _mm_setzero_si128();
+		__m128i alpha = _mm_setzero_si128();
+		size_t end = off + MIN((len - off) / 16, 255) * 16;
+
+		for(;off<end;off+=16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + off));
+
+			if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('=')))) {
+				_fmime_count_scalar(&c, p, off, off + 16, len);
+				continue;
+			}
+			// the compares give -1 per match
+			nl = _mm_sub_epi8(nl, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+			if(!c.b64_done) {
+				alpha = _mm_sub_epi8(alpha, _fmime_b64_alpha_epi8(v));
+			}
+		}
+		c.nl += _fmime_sum_epu8(nl);
+		c.b64 += _fmime_sum_epu8(alpha);
+	}
+#endif
+	_fmime_count_scalar(&c, p, off, len, len);
+	*lines = c.nl + (len && p[len-1] != '\n');
+	*size = cte == FMIME_CTE_BASE64 ? c.b64 * 6 / 8 : c.out;
+}
+
+static void _fmime_part_count(fmime_part_t *part)
+{
+	const char *cte = fmime_part_get_header(part, "Content-Transfer-Encoding");
+	size_t lines;
+
+	_fmime_count_body(part->begin + part->body_off, part->len - part->body_off,
+		cte ? _fmime_cte_lookup(cte, strlen(cte)) : FMIME_CTE_IDENTITY, &lines, &part->_decoded_size);
+	part->_lines = lines;
+	part->_cached |= FMIME_CACHED_COUNTS;
+}
+
+int fmime_part_get_lines(fmime_part_t *part)
+{
+	if(!(part->_cached & FMIME_CACHED_COUNTS)) {
+		_fmime_part_count(part);
+	}
+	return part->_lines;
+}
+
+size_t fmime_part_get_decoded_size(fmime_part_t *part)
+{
+	if(!(part->_cached & FMIME_CACHED_COUNTS)) {
+		_fmime_part_count(part);
+	}
+	return part->_decoded_size;
+}
+
+// Single byte charsets are converted with these tables, mapping 0x80-0xff
+// to unicode. Anything else goes through iconv.
+// windows-1252, also used for iso-8859-1 and us-ascii with 8 bit bytes, like browsers do
+static const guint16 _fmime_cs_cp1252[128] = {
+	0x20ac, 0xfffd, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+	0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0xfffd, 0x017d, 0xfffd,
+	0xfffd, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+	0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0xfffd, 0x017e, 0x0178,
+	0x00a0, 0x00a1, 0x00a2, 0x00a3, 0x00a4, 0x00a5, 0x00a6, 0x00a7,
+	0x00a8, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x00af,
+	0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x00b4, 0x00b5, 0x00b6, 0x00b7,
+	0x00b8, 0x00b9, 0x00ba, 0x00bb, 0x00bc, 0x00bd, 0x00be, 0x00bf,
+	0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7,
+	0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+	0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7,
+	0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+	0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7,
+	0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+	0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7,
+	0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff,
+};
+
+// iso-8859-15
+static const guint16 _fmime_cs_iso8859_15[128] = {
+	0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+	0x0088, 0x0089, 0x008a, 0x008b, 0x008c, 0x008d, 0x008e, 0x008f,
+	0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+	0x0098, 0x0099, 0x009a, 0x009b, 0x009c, 0x009d, 0x009e, 0x009f,
+	0x00a0, 0x00a1, 0x00a2, 0x00a3, 0x20ac, 0x00a5, 0x0160, 0x00a7,
+	0x0161, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x00af,
+	0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x017d, 0x00b5, 0x00b6, 0x00b7,
+	0x017e, 0x00b9, 0x00ba, 0x00bb, 0x0152, 0x0153, 0x0178, 0x00bf,
+	0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7,
+	0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+	0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7,
+	0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+	0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7,
+	0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+	0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7,
+	0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff,
+};
+
+// iso-8859-2
+static const guint16 _fmime_cs_iso8859_2[128] = {
+	0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+	0x0088, 0x0089, 0x008a, 0x008b, 0x008c, 0x008d, 0x008e, 0x008f,
+	0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+	0x0098, 0x0099, 0x009a, 0x009b, 0x009c, 0x009d, 0x009e, 0x009f,
+	0x00a0, 0x0104, 0x02d8, 0x0141, 0x00a4, 0x013d, 0x015a, 0x00a7,
+	0x00a8, 0x0160, 0x015e, 0x0164, 0x0179, 0x00ad, 0x017d, 0x017b,
+	0x00b0, 0x0105, 0x02db, 0x0142, 0x00b4, 0x013e, 0x015b, 0x02c7,
+	0x00b8, 0x0161, 0x015f, 0x0165, 0x017a, 0x02dd, 0x017e, 0x017c,
+	0x0154, 0x00c1, 0x00c2, 0x0102, 0x00c4, 0x0139, 0x0106, 0x00c7,
+	0x010c, 0x00c9, 0x0118, 0x00cb, 0x011a, 0x00cd, 0x00ce, 0x010e,
+	0x0110, 0x0143, 0x0147, 0x00d3, 0x00d4, 0x0150, 0x00d6, 0x00d7,
+	0x0158, 0x016e, 0x00da, 0x0170, 0x00dc, 0x00dd, 0x0162, 0x00df,
+	0x0155, 0x00e1, 0x00e2, 0x0103, 0x00e4, 0x013a, 0x0107, 0x00e7,
+	0x010d, 0x00e9, 0x0119, 0x00eb, 0x011b, 0x00ed, 0x00ee, 0x010f,
+	0x0111, 0x0144, 0x0148, 0x00f3, 0x00f4, 0x0151, 0x00f6, 0x00f7,
+	0x0159, 0x016f, 0x00fa, 0x0171, 0x00fc, 0x00fd, 0x0163, 0x02d9,
+};
+
+static const struct {
+	const char *name; // lowercase, alphanumerics only
+	const guint16 *high;
+} _fmime_charsets[] = {
+	{ "iso88591", _fmime_cs_cp1252 },
+	{ "latin1", _fmime_cs_cp1252 },
+	{ "l1", _fmime_cs_cp1252 },
+	{ "windows1252", _fmime_cs_cp1252 },
+	{ "cp1252", _fmime_cs_cp1252 },
+	{ "iso885915", _fmime_cs_iso8859_15 },
+	{ "latin9", _fmime_cs_iso8859_15 },
+	{ "iso88592", _fmime_cs_iso8859_2 },
+	{ "latin2", _fmime_cs_iso8859_2 },
+	{ "l2", _fmime_cs_iso8859_2 },
+};
+
+#define FMIME_CS_UTF8  1
+#define FMIME_CS_TABLE 2
+#define FMIME_CS_ICONV 3
+
+// Classifies a charset label. For table charsets *high is set.
+static int _fmime_charset_lookup(const char *charset, size_t charset_len, const guint16 **high)
+{
+	char norm[32];
+	size_t i, n = 0;
+
+	for(i=0;i<charset_len && n < sizeof(norm) - 1;i++) {
+		if(isalnum((unsigned char)charset[i])) {
+			norm[n++] = g_ascii_tolower(charset[i]);
+		}
+	}
+	norm[n] = '\0';
+
+	if(!n || !strcmp(norm, "utf8") || !strcmp(norm, "usascii") || !strcmp(norm, "ascii")) {
+		return FMIME_CS_UTF8;
+	}
+	for(i=0;i<G_N_ELEMENTS(_fmime_charsets);i++) {
+		if(!strcmp(norm, _fmime_charsets[i].name)) {
+			*high = _fmime_charsets[i].high;
+			return FMIME_CS_TABLE;
+		}
+	}
+	return FMIME_CS_ICONV;
 }
 
-const char *_fmime_get_boundary(const char *ctype, size_t ctype_len)
+// Length of the valid UTF-8 sequence at p, whose first byte is >= 0x80.
+// 0 if it's invalid (overlong, surrogate, past U+10FFFF), -1 if it's
+// valid so far but cut by the end of the buffer.
+static int _fmime_utf8_seq(const unsigned char *p, size_t n)
 {
-	int ovector[30];
-	int r;
-	const char *boundary = NULL;
+	unsigned char lo = 0x80, hi = 0xbf;
+	int len, i;
 
-	if((r = pcre_exec(identify_boundary_re, identify_boundary_extra, ctype, ctype_len, 0, 0, ovector, 30))!=PCRE_ERROR_NOMATCH) {
-		D(fprintf(stderr, "r: %i\n", r));
-		pcre_get_substring(ctype, ovector, r, 2, (const char **)&boundary);
-		if(boundary && !boundary[0]) {
-			pcre_free_substring(boundary);
-			boundary = NULL;
+	if(p[0] >= 0xc2 && p[0] <= 0xdf) {
+		len = 2;
+	} else if(p[0] >= 0xe0 && p[0] <= 0xef) {
+		len = 3;
+		if(p[0] == 0xe0) {
+			lo = 0xa0;
+		} else if(p[0] == 0xed) {
+			hi = 0x9f;
+		}
+	} else if(p[0] >= 0xf0 && p[0] <= 0xf4) {
+		len = 4;
+		if(p[0] == 0xf0) {
+			lo = 0x90;
+		} else if(p[0] == 0xf4) {
+			hi = 0x8f;
+		}
+	} else {
+		return 0;
+	}
+	for(i=1;i<len;i++) {
+		if(i >= n) {
+			return -1;
 		}
-		if(!boundary) {
-			pcre_get_substring(ctype, ovector, r, 3, (const char **)&boundary);
+		if(p[i] < lo || p[i] > hi) {
+			return 0;
 		}
+		lo = 0x80;
+		hi = 0xbf;
+	}
+	return len;
+}
+
+// Length of the valid UTF-8 prefix of s. ascii, most of any mail, is
+// skipped 16 bytes at a time with SSE2.
+static size_t _fmime_utf8_valid(const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	size_t i = 0;
+	int n;
+
+	while(i < len) {
+#ifdef __SSE2__
+		if(len - i >= 16) {
+			guint mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)));
+			if(!mask) {
+				i += 16;
+				continue;
+			}
+			i += __builtin_ctz(mask);
+		}
+#endif
+		if(p[i] < 0x80) {
+			i++;
+		} else if((n = _fmime_utf8_seq(p + i, len - i)) > 0) {
+			i += n;
+		} else {
+			break;
+		}
+	}
+	return i;
+}
+
+// Appends in to out, the bytes that aren't valid UTF-8 taken as
+// windows-1252. Returns the bytes used: a sequence cut at the end is
+// left for the next call, unless last is set.
+static size_t _fmime_utf8_append(GString *out, const char *in, size_t len, int last)
+{
+	size_t i = 0, v;
+
+	while(i < len) {
+		v = _fmime_utf8_valid(in + i, len - i);
+		g_string_append_len(out, in + i, v);
+		if((i += v) == len) {
+			break;
+		}
+		if(!last && _fmime_utf8_seq((const unsigned char *)in + i, len - i) < 0) {
+			break;
+		}
+		g_string_append_unichar(out, _fmime_cs_cp1252[(unsigned char)in[i] - 0x80]);
+		i++;
+	}
+	return i;
+}
+
+static void _fmime_table_append(GString *out, const guint16 *high, const char *in, size_t len)
+{
+	size_t i, run;
+
+	for(i=0;i<len;) {
+		// copy ascii runs in one go
+		for(run=i;run<len && !(in[run] & 0x80);run++) {
+			// do nothing
+		}
+		if(run > i) {
+			g_string_append_len(out, in + i, run - i);
+			i = run;
+		}
+		if(i < len) {
+			g_string_append_unichar(out, high[(unsigned char)in[i] - 0x80]);
+			i++;
+		}
+	}
+}
+
+#define FMIME_ICONV_CACHE_SIZE 4
+
+// iconv handles are expensive to open, each thread keeps the last few
+struct _fmime_iconv_cache {
+	struct {
+		char charset[32];
+		iconv_t cd;
+	} slot[FMIME_ICONV_CACHE_SIZE];
+	int next;
+};
+
+static void _fmime_iconv_cache_free(gpointer data)
+{
+	struct _fmime_iconv_cache *cache = data;
+	int i;
+
+	for(i=0;i<FMIME_ICONV_CACHE_SIZE;i++) {
+		if(cache->slot[i].charset[0]) {
+			iconv_close(cache->slot[i].cd);
+		}
+	}
+	g_free(cache);
+}
+
+static GPrivate _fmime_iconv_key = G_PRIVATE_INIT(_fmime_iconv_cache_free);
+
+static iconv_t _fmime_iconv_get(const char *charset, size_t charset_len)
+{
+	struct _fmime_iconv_cache *cache = g_private_get(&_fmime_iconv_key);
+	char name[32];
+	iconv_t cd;
+	int i;
+
+	if(charset_len >= sizeof(name)) {
+		return (iconv_t)-1;
+	}
+	memcpy(name, charset, charset_len);
+	name[charset_len] = '\0';
+
+	if(!cache) {
+		cache = g_malloc0(sizeof(struct _fmime_iconv_cache));
+		g_private_set(&_fmime_iconv_key, cache);
+	}
+	for(i=0;i<FMIME_ICONV_CACHE_SIZE;i++) {
+		if(!g_ascii_strcasecmp(cache->slot[i].charset, name)) {
+			return cache->slot[i].cd;
+		}
+	}
+
+	if((cd = iconv_open("UTF-8", name)) == (iconv_t)-1) {
+		return cd;
+	}
+	i = cache->next;
+	cache->next = (cache->next + 1) % FMIME_ICONV_CACHE_SIZE;
+	if(cache->slot[i].charset[0]) {
+		iconv_close(cache->slot[i].cd);
+	}
+	strcpy(cache->slot[i].charset, name);
+	cache->slot[i].cd = cd;
+	return cd;
+}
+
+// Converts in appending to out. Returns the bytes used: a sequence cut at
+// the end is left for the next call, unless last is set.
+static size_t _fmime_iconv_step(GString *out, iconv_t cd, const char *in, size_t len, int last)
+{
+	char buf[1024];
+	char *inp = (char *)in;
+	size_t inleft = len;
+
+	while(inleft) {
+		char *outp = buf;
+		size_t outleft = sizeof(buf);
+		size_t r = iconv(cd, &inp, &inleft, &outp, &outleft);
+
+		g_string_append_len(out, buf, outp - buf);
+		if(r == (size_t)-1 && errno == EINVAL && !last) {
+			break;
+		}
+		if(r == (size_t)-1 && errno != E2BIG) {
+			// invalid or truncated sequence
+			g_string_append_unichar(out, 0xfffd);
+			inp++;
+			inleft--;
+		}
+	}
+	return inp - in;
+}
+
+// Flushes the shift state, the handle is reused
+static void _fmime_iconv_flush(GString *out, iconv_t cd)
+{
+	char buf[64];
+	char *outp = buf;
+	size_t outleft = sizeof(buf);
+
+	iconv(cd, NULL, NULL, &outp, &outleft);
+	g_string_append_len(out, buf, outp - buf);
+}
+
+static void _fmime_iconv_append(GString *out, iconv_t cd, const char *in, size_t len)
+{
+	_fmime_iconv_step(out, cd, in, len, 1);
+	_fmime_iconv_flush(out, cd);
+}
+
+// Converts len bytes of text in charset to UTF-8 appending it to out.
+// Text claiming to be UTF-8 that isn't valid is taken as windows-1252,
+// unknown charsets are appended untouched.
+static void _fmime_append_utf8(GString *out, const char *charset, size_t charset_len, const char *in, size_t len)
+{
+	const guint16 *high = NULL;
+	iconv_t cd;
+
+	switch(_fmime_charset_lookup(charset, charset_len, &high)) {
+		case FMIME_CS_UTF8:
+			if(_fmime_utf8_valid(in, len) == len) {
+				g_string_append_len(out, in, len);
+				return;
+			}
+			high = _fmime_cs_cp1252;
+			// fall through
+		case FMIME_CS_TABLE:
+			_fmime_table_append(out, high, in, len);
+			return;
+		default:
+			if((cd = _fmime_iconv_get(charset, charset_len)) != (iconv_t)-1) {
+				_fmime_iconv_append(out, cd, in, len);
+			} else {
+				g_string_append_len(out, in, len);
+			}
+			return;
+	}
+}
+
+// HTML to text, fed UTF-8 a window at a time so tags and entities may be
+// cut anywhere. Markup, comments and script or style contents are dropped,
+// entities decoded, white space collapsed and block elements end a line.
+#define FMIME_HTML_TEXT 0
+#define FMIME_HTML_LT 1      // after '<'
+#define FMIME_HTML_NAME 2    // tag name
+#define FMIME_HTML_TAG 3     // attributes, up to '>'
+#define FMIME_HTML_BANG 4    // after "<!"
+#define FMIME_HTML_COMMENT 5
+#define FMIME_HTML_ENTITY 6
+
+struct _fmime_html {
+	int state;
+	int close;      // </tag>
+	int skip;       // inside script, style or title, index + 1
+	int quote;      // quote char of an attribute value, or '=' after one
+	int space;      // white space pending
+	int breaks;     // line breaks pending, at most 2
+	size_t n;
+	char buf[16];   // tag name or entity so far
+	size_t chars;   // characters written
+	size_t max;     // 0 is no limit
+	int done;
+};
+
+// elements whose contents aren't text
+static const char * const _fmime_html_skip[] = { "script", "style", "title" };
+
+// elements that end a line, br ends one even if empty
+static const char * const _fmime_html_block[] = {
+	"p", "div", "tr", "li", "ul", "ol", "table", "blockquote", "pre", "hr",
+	"h1", "h2", "h3", "h4", "h5", "h6", "dl", "dt", "dd", "center", "form",
+};
+
+// entities of U+00A0 to U+00FF in order
+static const char * const _fmime_html_latin1[96] = {
+	"nbsp", "iexcl", "cent", "pound", "curren", "yen", "brvbar", "sect",
+	"uml", "copy", "ordf", "laquo", "not", "shy", "reg", "macr",
+	"deg", "plusmn", "sup2", "sup3", "acute", "micro", "para", "middot",
+	"cedil", "sup1", "ordm", "raquo", "frac14", "frac12", "frac34", "iquest",
+	"Agrave", "Aacute", "Acirc", "Atilde", "Auml", "Aring", "AElig", "Ccedil",
+	"Egrave", "Eacute", "Ecirc", "Euml", "Igrave", "Iacute", "Icirc", "Iuml",
+	"ETH", "Ntilde", "Ograve", "Oacute", "Ocirc", "Otilde", "Ouml", "times",
+	"Oslash", "Ugrave", "Uacute", "Ucirc", "Uuml", "Yacute", "THORN", "szlig",
+	"agrave", "aacute", "acirc", "atilde", "auml", "aring", "aelig", "ccedil",
+	"egrave", "eacute", "ecirc", "euml", "igrave", "iacute", "icirc", "iuml",
+	"eth", "ntilde", "ograve", "oacute", "ocirc", "otilde", "ouml", "divide",
+	"oslash", "ugrave", "uacute", "ucirc", "uuml", "yacute", "thorn", "yuml",
+};
+
+static const struct {
+	const char *name;
+	gunichar c;
+} _fmime_html_entities[] = {
+	{ "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' },
+	{ "ndash", 0x2013 }, { "mdash", 0x2014 }, { "lsquo", 0x2018 }, { "rsquo", 0x2019 },
+	{ "sbquo", 0x201a }, { "ldquo", 0x201c }, { "rdquo", 0x201d }, { "bdquo", 0x201e },
+	{ "bull", 0x2022 }, { "hellip", 0x2026 }, { "euro", 0x20ac }, { "trade", 0x2122 },
+	{ "AMP", '&' }, { "LT", '<' }, { "GT", '>' }, { "QUOT", '"' },
+};
+
+static int _fmime_html_is(const char *name, size_t n, const char * const *list, size_t count)
+{
+	size_t i;
+
+	for(i=0;i<count;i++) {
+		if(!g_ascii_strncasecmp(list[i], name, n) && !list[i][n]) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+// Writes one byte of text. Pending breaks or space go first, but never at
+// the start of the output. Sets done instead once max characters are out.
+static void _fmime_html_put(struct _fmime_html *h, GString *out, char c)
+{
+	int lead = (c & 0xc0) != 0x80;
+
+	if(h->done || (lead && h->max && h->chars >= h->max)) {
+		h->done = 1;
+		return;
+	}
+	if(lead && h->chars && (h->breaks || h->space)) {
+		int k = h->breaks ? h->breaks : 1;
+		if(h->max && h->chars + k >= h->max) {
+			h->done = 1;
+			return;
+		}
+		while(k--) {
+			g_string_append_c(out, h->breaks ? '\n' : ' ');
+			h->chars++;
+		}
+	}
+	if(lead) {
+		h->breaks = h->space = 0;
+		h->chars++;
+	}
+	g_string_append_c(out, c);
+}
+
+static void _fmime_html_unichar(struct _fmime_html *h, GString *out, gunichar c)
+{
+	char u[6];
+	int i, n;
+
+	if(c == 0xa0) {
+		h->space = 1;
+		return;
+	}
+	if(c == 0xad) {
+		// soft hyphen
+		return;
+	}
+	n = g_unichar_to_utf8(c, u);
+	for(i=0;i<n;i++) {
+		_fmime_html_put(h, out, u[i]);
+	}
+}
+
+// The entity in buf, without the & and ;. Returns 0 if it isn't known.
+static int _fmime_html_entity(struct _fmime_html *h, GString *out)
+{
+	gunichar c = 0;
+	size_t i;
+
+	h->buf[h->n] = '\0';
+	if(h->buf[0] == '#') {
+		const char *p = h->buf + 1;
+		int base = 10;
+		char *end;
+		unsigned long v;
+
+		if(*p == 'x' || *p == 'X') {
+			base = 16;
+			p++;
+		}
+		if(!*p) {
+			return 0;
+		}
+		v = strtoul(p, &end, base);
+		if(*end) {
+			return 0;
+		}
+		if(v >= 0x80 && v < 0xa0) {
+			// browsers read these as windows-1252
+			c = _fmime_cs_cp1252[v - 0x80];
+		} else if(!v || v > 0x10ffff || (v >= 0xd800 && v < 0xe000)) {
+			c = 0xfffd;
+		} else {
+			c = v;
+		}
+	} else {
+		for(i=0;!c && i<G_N_ELEMENTS(_fmime_html_entities);i++) {
+			if(!strcmp(_fmime_html_entities[i].name, h->buf)) {
+				c = _fmime_html_entities[i].c;
+			}
+		}
+		for(i=0;!c && i<G_N_ELEMENTS(_fmime_html_latin1);i++) {
+			if(!strcmp(_fmime_html_latin1[i], h->buf)) {
+				c = 0xa0 + i;
+			}
+		}
+		if(!c) {
+			return 0;
+		}
+	}
+	_fmime_html_unichar(h, out, c);
+	return 1;
+}
+
+// Writes what looked like an entity as it was
+static void _fmime_html_literal(struct _fmime_html *h, GString *out, const char *pre, size_t n)
+{
+	size_t i;
+
+	for(i=0;i<n;i++) {
+		_fmime_html_put(h, out, pre[i]);
+	}
+	for(i=0;i<h->n;i++) {
+		_fmime_html_put(h, out, h->buf[i]);
+	}
+}
+
+// A tag name was read
+static void _fmime_html_tag(struct _fmime_html *h)
+{
+	int i;
+
+	if(h->n >= sizeof(h->buf)) {
+		return;
+	}
+	if(h->skip) {
+		if(h->close && _fmime_html_is(h->buf, h->n, _fmime_html_skip, G_N_ELEMENTS(_fmime_html_skip)) == h->skip) {
+			h->skip = 0;
+		}
+		return;
+	}
+	if(!h->close && (i = _fmime_html_is(h->buf, h->n, _fmime_html_skip, G_N_ELEMENTS(_fmime_html_skip)))) {
+		h->skip = i;
+	} else if(h->n == 2 && !g_ascii_strncasecmp(h->buf, "br", 2)) {
+		if(h->breaks < 2) {
+			h->breaks++;
+		}
+	} else if(_fmime_html_is(h->buf, h->n, _fmime_html_block, G_N_ELEMENTS(_fmime_html_block))) {
+		if(!h->breaks) {
+			h->breaks = 1;
+		}
+	} else if(h->n == 2 && (!g_ascii_strncasecmp(h->buf, "td", 2) || !g_ascii_strncasecmp(h->buf, "th", 2))) {
+		h->space = 1;
+	}
+}
+
+// Feeds len bytes of UTF-8 HTML, writing the text to out. Returns 1 once
+// max characters were written.
+static int _fmime_html_feed(struct _fmime_html *h, GString *out, const char *in, size_t len)
+{
+	size_t i;
+
+	for(i=0;i<len && !h->done;i++) {
+		char c = in[i];
+
+		switch(h->state) {
+			case FMIME_HTML_TEXT:
+				if(c == '<') {
+					h->state = FMIME_HTML_LT;
+					h->close = 0;
+					h->n = 0;
+				} else if(h->skip) {
+					// do nothing
+				} else if(c == '&') {
+					h->state = FMIME_HTML_ENTITY;
+					h->n = 0;
+				} else if(c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f') {
+					h->space = 1;
+				} else {
+					_fmime_html_put(h, out, c);
+				}
+				break;
+			case FMIME_HTML_LT:
+				if(c == '/' && !h->close) {
+					h->close = 1;
+				} else if(h->skip && !(h->close && isalpha((unsigned char)c))) {
+					// raw text, only its end tag counts
+					h->state = FMIME_HTML_TEXT;
+					i--;
+				} else if(c == '!' && !h->close) {
+					h->state = FMIME_HTML_BANG;
+				} else if(isalpha((unsigned char)c)) {
+					h->state = FMIME_HTML_NAME;
+					h->buf[h->n++] = c;
+				} else if(c == '>' || c == '?') {
+					// </> or a processing instruction
+					h->state = c == '>' ? FMIME_HTML_TEXT : FMIME_HTML_TAG;
+					h->quote = 0;
+				} else {
+					// a lone '<', it's text
+					h->state = FMIME_HTML_TEXT;
+					if(!h->skip) {
+						_fmime_html_put(h, out, '<');
+						if(h->close) {
+							_fmime_html_put(h, out, '/');
+						}
+					}
+					i--;
+				}
+				break;
+			case FMIME_HTML_NAME:
+				if(isalnum((unsigned char)c) || c == ':' || c == '-') {
+					// too long names can't match, only count them
+					if(h->n < sizeof(h->buf)) {
+						h->buf[h->n] = c;
+					}
+					h->n++;
+					break;
+				}
+				_fmime_html_tag(h);
+				h->state = FMIME_HTML_TAG;
+				h->quote = 0;
+				// fall through
+			case FMIME_HTML_TAG:
+				if(h->quote == '"' || h->quote == '\'') {
+					if(c == h->quote) {
+						h->quote = 0;
+					}
+				} else if(c == '>') {
+					h->state = FMIME_HTML_TEXT;
+				} else if(c == '=') {
+					h->quote = '=';
+				} else if(h->quote == '=' && (c == '"' || c == '\'')) {
+					h->quote = c;
+				} else if(c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+					h->quote = 0;
+				}
+				break;
+			case FMIME_HTML_BANG:
+				if(c == '-' && h->n < 2) {
+					if(++h->n == 2) {
+						h->state = FMIME_HTML_COMMENT;
+						h->n = 0;
+					}
+				} else {
+					// doctype and the like
+					h->state = FMIME_HTML_TAG;
+					h->quote = 0;
+					i--;
+				}
+				break;
+			case FMIME_HTML_COMMENT:
+				if(c == '>' && h->n >= 2) {
+					h->state = FMIME_HTML_TEXT;
+				} else {
+					h->n = c == '-' ? h->n + 1 : 0;
+				}
+				break;
+			case FMIME_HTML_ENTITY:
+				if(c == ';') {
+					h->state = FMIME_HTML_TEXT;
+					if(!_fmime_html_entity(h, out)) {
+						_fmime_html_literal(h, out, "&", 1);
+						_fmime_html_put(h, out, ';');
+					}
+				} else if((isalnum((unsigned char)c) || (c == '#' && !h->n)) &&
+						h->n < sizeof(h->buf) - 1) {
+					h->buf[h->n++] = c;
+				} else {
+					h->state = FMIME_HTML_TEXT;
+					_fmime_html_literal(h, out, "&", 1);
+					i--;
+				}
+				break;
+		}
+	}
+	return h->done;
+}
+
+// End of the input, an entity without its ';' is text
+static void _fmime_html_finish(struct _fmime_html *h, GString *out)
+{
+	if(h->state == FMIME_HTML_ENTITY) {
+		_fmime_html_literal(h, out, "&", 1);
+	} else if(h->state == FMIME_HTML_LT && !h->skip) {
+		_fmime_html_put(h, out, '<');
+	}
+	h->state = FMIME_HTML_TEXT;
+}
+
+// Cuts the UTF-8 text appended to out since from once it holds max
+// characters. Returns 1 if it did.
+static int _fmime_utf8_clip(GString *out, size_t from, size_t *chars, size_t max)
+{
+	size_t i;
+
+	for(i=from;i<out->len;i++) {
+		if((out->str[i] & 0xc0) != 0x80 && (*chars)++ == max) {
+			g_string_truncate(out, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Transfer decodes and converts a text body to UTF-8 in one pass, through
+// a window on the stack. Text that should be UTF-8 but isn't, and unknown
+// charsets, get their invalid bytes taken as windows-1252, so the result
+// is always valid UTF-8. With strip, text/html comes out as plain text.
+// Decoding stops after max characters, unless max is 0.
+// The text is appended to out, or with a sink handed to it a window at a
+// time and out reused, so memory doesn't grow with the body. A non zero
+// return from the sink stops it. Returns -1 if it isn't text, else what
+// the sink returned.
+static int _fmime_text_stream(const char *ct, int cte, const char *body, size_t blen,
+		int strip, size_t max, GString *out, int (*sink)(const char *, size_t, void *), void *data)
+{
+	const guint16 *high = NULL;
+	iconv_t cd = (iconv_t)-1;
+	struct _fmime_tdec d;
+	struct _fmime_html html;
+	fmime_slice_t cs = { NULL, 0 };
+	char *decoded = NULL;
+	char buf[FMIME_TEXT_WINDOW + 8];
+	// max characters take at least max bytes, don't decode a whole window
+	// for a short preview
+	size_t step = max && max < FMIME_TEXT_WINDOW ? max : FMIME_TEXT_WINDOW;
+	size_t carry = 0, chars = 0;
+	GString *dst, *tmp = NULL;
+	int kind, stop = 0, ret = 0;
+
+	if(ct) {
+		fmime_slice_t type, subtype;
+		if(_fmime_split_ctype(ct, &type, &subtype)) {
+			if(!_fmime_slice_eq(&type, "text", 4)) {
+				return -1;
+			}
+			if(strip && _fmime_slice_eq(&subtype, "html", 4)) {
+				memset(&html, 0, sizeof(html));
+				html.max = max;
+				tmp = g_string_sized_new(step * 2);
+			}
+		}
+		fmime_header_get_param(ct, "charset", &cs, &decoded);
+	}
+	kind = _fmime_charset_lookup(cs.ptr, cs.len, &high);
+	if(kind == FMIME_CS_ICONV && (cd = _fmime_iconv_get(cs.ptr, cs.len)) == (iconv_t)-1) {
+		kind = FMIME_CS_UTF8;
+	}
+	g_free(decoded);
+
+	_fmime_tdec_init(&d, cte, body, blen);
+	dst = tmp ? tmp : out;
+	for(;;) {
+		size_t got = _fmime_tdec_read(&d, buf + carry, step);
+		size_t n = carry + got, used, from = dst->len;
+		int last = got < step;
+
+		switch(kind) {
+			case FMIME_CS_TABLE:
+				_fmime_table_append(dst, high, buf, n);
+				used = n;
+				break;
+			case FMIME_CS_ICONV:
+				used = _fmime_iconv_step(dst, cd, buf, n, last);
+				if(last) {
+					_fmime_iconv_flush(dst, cd);
+				}
+				break;
+			default:
+				used = _fmime_utf8_append(dst, buf, n, last);
+				break;
+		}
+		if(tmp) {
+			stop = _fmime_html_feed(&html, out, tmp->str, tmp->len);
+			g_string_truncate(tmp, 0);
+		} else if(max) {
+			stop = _fmime_utf8_clip(out, from, &chars, max);
+		}
+		if(sink && out->len) {
+			ret = sink(out->str, out->len, data);
+			g_string_truncate(out, 0);
+		}
+		if(last || stop || ret) {
+			break;
+		}
+		// a character cut by the window, at most a few bytes
+		carry = n - used;
+		memmove(buf, buf + used, carry);
+	}
+	if(kind == FMIME_CS_ICONV && (stop || ret)) {
+		// the converter is shared, put it back in its initial state
+		iconv(cd, NULL, NULL, NULL, NULL);
+	}
+	if(tmp) {
+		if(!ret) {
+			_fmime_html_finish(&html, out);
+			if(sink && out->len) {
+				ret = sink(out->str, out->len, data);
+				g_string_truncate(out, 0);
+			}
+		}
+		g_string_free(tmp, TRUE);
+	}
+	return ret;
+}
+
+static char *_fmime_text_convert(const char *ct, int cte, const char *body, size_t blen,
+		int strip, size_t max, size_t *len)
+{
+	GString *out = g_string_sized_new(max && max < blen ? max : blen + 1);
+
+	if(_fmime_text_stream(ct, cte, body, blen, strip, max, out, NULL, NULL) < 0) {
+		g_string_free(out, TRUE);
+		return NULL;
+	}
+	if(len) {
+		*len = out->len;
+	}
+	return g_string_free(out, FALSE);
+}
+
+static char *_fmime_text_utf8(const fmime_headers_t *headers, const char *body, size_t blen,
+		int strip, size_t max, size_t *len)
+{
+	const char *cte = _fmime_headers_value(headers, "Content-Transfer-Encoding");
+
+	return _fmime_text_convert(_fmime_headers_value(headers, "Content-Type"),
+			cte ? _fmime_cte_lookup(cte, strlen(cte)) : FMIME_CTE_IDENTITY, body, blen, strip, max, len);
+}
+
+char *fmime_part_get_text_utf8(fmime_part_t *part, size_t *len)
+{
+	return _fmime_text_utf8(part->headers, part->begin + part->body_off, part->len - part->body_off, 0, 0, len);
+}
+
+char *fmime_get_text_utf8(fmime_message_t *msg, size_t *len)
+{
+	if(msg->root) {
+		return NULL;
+	}
+	return _fmime_text_utf8(msg->headers, msg->begin + msg->body_off, msg->len - msg->body_off, 0, 0, len);
+}
+
+#define FMIME_PLAINTEXT_MAX_DEPTH 8
+
+static int _fmime_blank(const char *p, size_t len)
+{
+	size_t i;
+
+	for(i=0;i<len;i++) {
+		if(!isspace((unsigned char)p[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// How good a text is as the one of a multipart/alternative, the first of
+// the highest rank wins: a plain text that isn't blank, then any other
+// text, then a blank plain one, only there for show. Shared by
+// fmime_get_plaintext and the summary preview.
+#define FMIME_ALT_BEST 2
+static int _fmime_alt_rank(int plain, const char *body, size_t len)
+{
+	if(!plain) {
+		return 1;
+	}
+	return _fmime_blank(body, len) ? 0 : FMIME_ALT_BEST;
+}
+
+// The part with the text of part: itself if it's text, the best ranked
+// text of a multipart/alternative, the first child with text of other
+// multiparts
+static fmime_part_t *_fmime_part_text(fmime_part_t *part, int depth)
+{
+	fmime_part_t **children, *best = NULL;
+	int i, count, rank, best_rank = -1;
+
+	if(fmime_part_is_type(part, "text", "*")) {
+		return part;
+	}
+	if(!fmime_part_is_type(part, "multipart", "*") || depth >= FMIME_PLAINTEXT_MAX_DEPTH) {
+		return NULL;
+	}
+	children = fmime_part_children(part, &count);
+	if(fmime_part_is_type(part, "multipart", "alternative")) {
+		for(i=0;i<count && best_rank < FMIME_ALT_BEST;i++) {
+			fmime_part_t *t = _fmime_part_text(children[i], depth + 1);
+			if(!t) {
+				continue;
+			}
+			rank = _fmime_alt_rank(fmime_part_is_type(t, "text", "plain"), t->begin + t->body_off, t->len - t->body_off);
+			if(rank > best_rank) {
+				best = t;
+				best_rank = rank;
+			}
+		}
+		return best;
+	}
+	for(i=0;i<count;i++) {
+		fmime_part_t *t = _fmime_part_text(children[i], depth + 1);
+		if(t) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+char *fmime_part_get_plaintext(fmime_part_t *part, size_t max, size_t *len)
+{
+	if(!(part = _fmime_part_text(part, 0))) {
+		return NULL;
+	}
+	return _fmime_text_utf8(part->headers, part->begin + part->body_off, part->len - part->body_off, 1, max, len);
+}
+
+char *fmime_get_plaintext(fmime_message_t *msg, size_t max, size_t *len)
+{
+	if(msg->root) {
+		return fmime_part_get_plaintext(msg->root, max, len);
+	}
+	return _fmime_text_utf8(msg->headers, msg->begin + msg->body_off, msg->len - msg->body_off, 1, max, len);
+}
+
+// Word characters of the tokenizer's ascii fast path, case folded, 0 for
+// separators
+static const char _fmime_tok_ascii[128] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 0, 0, 0, 0, 0, 0,
+	0, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+	'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', 0, 0, 0, 0, 0,
+	0, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+	'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', 0, 0, 0, 0, 0,
+};
+
+// fmime_tokenize state. A word cut by a window is carried to the next.
+struct _fmime_tokenizer {
+	fmime_token_t tok;
+	fmime_token_cb cb;
+	void *data;
+	int ret;        // what cb returned to stop
+	size_t pos;     // text before the window
+	size_t n;       // bytes of the word so far
+	int in;         // inside a word
+	int skip;       // the word outgrew FMIME_TOKEN_MAX
+	GString *text;  // reused for every window
+	char word[FMIME_TOKEN_MAX];
+};
+
+// A separator, hands the word read so far to the callback
+static int _fmime_tok_end(struct _fmime_tokenizer *t)
+{
+	if(t->in && !t->skip) {
+		t->tok.word = t->word;
+		t->tok.len = t->n;
+		if((t->ret = t->cb(&t->tok, t->data))) {
+			return 1;
+		}
+		t->tok.position++;
+	}
+	t->in = t->skip = 0;
+	t->n = 0;
+	return 0;
+}
+
+static void _fmime_tok_start(struct _fmime_tokenizer *t, size_t off)
+{
+	if(!t->in) {
+		t->in = 1;
+		t->tok.offset = t->pos + off;
+	}
+}
+
+// Sink of _fmime_text_stream, splits UTF-8 text in words of letters,
+// digits and their combining marks
+static int _fmime_tok_feed(const char *text, size_t len, void *data)
+{
+	struct _fmime_tokenizer *t = data;
+	const unsigned char *p = (const unsigned char *)text;
+	size_t i = 0;
+
+	while(i < len) {
+		if(p[i] < 0x80) {
+			char f;
+			if(!(f = _fmime_tok_ascii[p[i]])) {
+				if(t->in && _fmime_tok_end(t)) {
+					return 1;
+				}
+				i++;
+				continue;
+			}
+			_fmime_tok_start(t, i);
+			// the run of ascii word characters
+			do {
+				if(t->n < sizeof(t->word)) {
+					t->word[t->n++] = f;
+				} else {
+					t->skip = 1;
+				}
+			} while(++i < len && p[i] < 0x80 && (f = _fmime_tok_ascii[p[i]]));
+		} else {
+			// windows end on a character, so the sequence is whole
+			gunichar c = g_utf8_get_char(text + i);
+			int n = _fmime_utf8_seq(p + i, len - i);
+
+			if(g_unichar_isalnum(c) || (t->in && g_unichar_ismark(c))) {
+				char u[6];
+				int l = g_unichar_to_utf8(g_unichar_tolower(c), u);
+
+				_fmime_tok_start(t, i);
+				if(t->n + l <= sizeof(t->word)) {
+					memcpy(t->word + t->n, u, l);
+					t->n += l;
+				} else {
+					t->skip = 1;
+				}
+			} else if(t->in && _fmime_tok_end(t)) {
+				return 1;
+			}
+			i += n > 0 ? n : 1;
+		}
+	}
+	t->pos += len;
+	return 0;
+}
+
+// Streams one text body through the tokenizer
+static int _fmime_tokenize_text(struct _fmime_tokenizer *t, fmime_part_t *part,
+		const fmime_headers_t *headers, const char *body, size_t blen)
+{
+	const char *cte = _fmime_headers_value(headers, "Content-Transfer-Encoding");
+
+	t->tok.part = part;
+	t->tok.position = 0;
+	t->pos = 0;
+	if(_fmime_text_stream(_fmime_headers_value(headers, "Content-Type"),
+			cte ? _fmime_cte_lookup(cte, strlen(cte)) : FMIME_CTE_IDENTITY,
+			body, blen, 1, 0, t->text, _fmime_tok_feed, t) > 0) {
+		return 1;
+	}
+	// the text may end in a word
+	return _fmime_tok_end(t);
+}
+
+// The text parts under part, only the chosen one of an alternative
+static int _fmime_tokenize_part(struct _fmime_tokenizer *t, fmime_part_t *part, int depth)
+{
+	fmime_part_t **children;
+	int i, count;
+
+	if(fmime_part_is_type(part, "multipart", "alternative")) {
+		part = _fmime_part_text(part, depth);
+	}
+	if(!part) {
+		return 0;
+	}
+	if(fmime_part_is_type(part, "text", "*")) {
+		return _fmime_tokenize_text(t, part, part->headers, part->begin + part->body_off, part->len - part->body_off);
+	}
+	if(!fmime_part_is_type(part, "multipart", "*") || depth >= FMIME_PLAINTEXT_MAX_DEPTH) {
+		return 0;
+	}
+	children = fmime_part_children(part, &count);
+	for(i=0;i<count;i++) {
+		if(_fmime_tokenize_part(t, children[i], depth + 1)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void _fmime_tokenizer_init(struct _fmime_tokenizer *t, fmime_token_cb cb, void *data)
+{
+	memset(t, 0, sizeof(*t));
+	t->cb = cb;
+	t->data = data;
+	// a window of text takes up to 3 bytes of UTF-8 a byte
+	t->text = g_string_sized_new(FMIME_TEXT_WINDOW * 3);
+}
+
+int fmime_part_tokenize(fmime_part_t *part, fmime_token_cb cb, void *data)
+{
+	struct _fmime_tokenizer t;
+
+	_fmime_tokenizer_init(&t, cb, data);
+	_fmime_tokenize_part(&t, part, 0);
+	g_string_free(t.text, TRUE);
+	return t.ret;
+}
+
+int fmime_tokenize(fmime_message_t *msg, fmime_token_cb cb, void *data)
+{
+	struct _fmime_tokenizer t;
+
+	_fmime_tokenizer_init(&t, cb, data);
+	if(msg->root) {
+		_fmime_tokenize_part(&t, msg->root, 0);
+	} else {
+		_fmime_tokenize_text(&t, NULL, msg->headers, msg->begin + msg->body_off, msg->len - msg->body_off);
+	}
+	g_string_free(t.text, TRUE);
+	return t.ret;
+}
+
+// Appends text to out, dropping the line breaks of folded headers.
+// Raw 8 bit text that is not UTF-8 is taken as windows-1252.
+static void _fmime_append_unfolded(GString *out, const char *in, size_t len)
+{
+	size_t i, start = out->len;
+	int eight_bit = 0;
+
+	for(i=0;i<len;i++) {
+		if(in[i] != '\r' && in[i] != '\n') {
+			g_string_append_c(out, in[i]);
+			eight_bit |= in[i] & 0x80;
+		}
+	}
+	if(eight_bit && !g_utf8_validate(out->str + start, out->len - start, NULL)) {
+		char *raw = g_strndup(out->str + start, out->len - start);
+		size_t raw_len = out->len - start;
+		g_string_truncate(out, start);
+		_fmime_table_append(out, _fmime_cs_cp1252, raw, raw_len);
+		g_free(raw);
+	}
+}
+
+// Decodes the RFC 2047 encoded words in s, appending UTF-8 to out. Adjacent
+// words sharing a charset are converted together, so multibyte characters
+// split across words survive, and the whitespace between them is dropped.
+static void _fmime_decode_words(GString *out, const char *s, size_t len)
+{
+	const char *p = s;
+	const char *end = s + len;
+	const char *lit = s;
+	const char *pcs = NULL;
+	size_t pcs_len = 0;
+	GString *pending = NULL;
+
+	while(p < end) {
+		const char *w, *cs, *q, *text, *te;
+		size_t cs_len;
+		const char *l;
+
+		if(!(w = memmem(p, end - p, "=?", 2))) {
+			break;
+		}
+		cs = w + 2;
+		if(!(q = memchr(cs, '?', end - cs)) || q + 2 >= end || q[2] != '?' ||
+				!strchr("BbQq", q[1]) || q == cs) {
+			p = w + 2;
+			continue;
+		}
+		text = q + 3;
+		if(!(te = memmem(text, end - text, "?=", 2))) {
+			break;
+		}
+
+		// linear white space between two encoded words is not displayed
+		for(l=lit;l<w && isspace((unsigned char)*l);l++) {
+			// do nothing
+		}
+		if(!pending || l != w) {
+			if(pending) {
+				_fmime_append_utf8(out, pcs, pcs_len, pending->str, pending->len);
+				g_string_truncate(pending, 0);
+			}
+			_fmime_append_unfolded(out, lit, w - lit);
+		}
+
+		// RFC 2231 allows a language after the charset: =?us-ascii*en?Q?..?=
+		for(cs_len=0;cs + cs_len < q && cs[cs_len] != '*';cs_len++) {
+			// do nothing
+		}
+		if(pending && pending->len && (cs_len != pcs_len || g_ascii_strncasecmp(cs, pcs, cs_len))) {
+			_fmime_append_utf8(out, pcs, pcs_len, pending->str, pending->len);
+			g_string_truncate(pending, 0);
+		}
+		if(!pending) {
+			pending = g_string_sized_new(te - text);
+		}
+		pcs = cs;
+		pcs_len = cs_len;
+		if(q[1] == 'B' || q[1] == 'b') {
+			_fmime_b64_decode(pending, text, te - text, G_MAXSIZE);
+		} else {
+			_fmime_q_decode(pending, text, te - text);
+		}
+		p = lit = te + 2;
+	}
+
+	if(pending) {
+		_fmime_append_utf8(out, pcs, pcs_len, pending->str, pending->len);
+		g_string_free(pending, TRUE);
+	}
+	_fmime_append_unfolded(out, lit, end - lit);
+}
+
+#define FMIME_PARAM_MAX_SECTIONS 64
+
+struct _fmime_param_value {
+	const char *ptr;
+	size_t len;
+	int escaped;  // quoted-string with backslashes or line breaks
+	int extended; // RFC 2231 `*` value: charset'language'%XX
+};
+
+struct _fmime_param {
+	struct _fmime_param_value plain;
+	struct _fmime_param_value ext;
+	struct _fmime_param_value sect[FMIME_PARAM_MAX_SECTIONS];
+	int found;
+	int nsect;
+	guint64 sect_mask;
+};
+
+// Skips white space and (comments)
+static const char *_fmime_skip_cfws(const char *p)
+{
+	int depth = 0;
+
+	for(;*p;p++) {
+		if(depth) {
+			if(*p == '\\' && p[1]) {
+				p++;
+			} else if(*p == '(') {
+				depth++;
+			} else if(*p == ')') {
+				depth--;
+			}
+		} else if(*p == '(') {
+			depth++;
+		} else if(!isspace((unsigned char)*p)) {
+			break;
+		}
+	}
+	return p;
+}
+
+// Reads the `; attribute=value` after p in a structured header. Returns
+// where to go on from, NULL once there are no more. val->ptr is NULL for
+// an attribute without a value.
+static const char *_fmime_param_next(const char *p, fmime_slice_t *attr, struct _fmime_param_value *val)
+{
+	const char *v;
+
+	// the first ';' ends the type or disposition itself
+	if(!p || !(p = strchr(p, ';'))) {
+		return NULL;
+	}
+	memset(val, 0, sizeof(*val));
+	p = _fmime_skip_cfws(p + 1);
+	attr->ptr = p;
+	while(*p && *p != '=' && *p != ';' && !isspace((unsigned char)*p)) {
+		p++;
+	}
+	attr->len = p - attr->ptr;
+	p = _fmime_skip_cfws(p);
+	if(*p != '=') {
+		return p;
+	}
+	p = _fmime_skip_cfws(p + 1);
+	if(*p == '"') {
+		v = ++p;
+		for(;*p && *p != '"';p++) {
+			if(*p == '\\' && p[1]) {
+				p++;
+				val->escaped = 1;
+			} else if(*p == '\r' || *p == '\n') {
+				val->escaped = 1;
+			}
+		}
+		val->len = p - v;
+		if(*p) {
+			p++;
+		}
+	} else {
+		v = p;
+		while(*p && *p != ';' && !isspace((unsigned char)*p)) {
+			p++;
+		}
+		val->len = p - v;
+	}
+	val->ptr = v;
+	return p;
+}
+
+// Walks the `; attribute=value` list of a structured header once and
+// collects every form of parameter `name`: plain, RFC 2231 extended and
+// numbered continuations (name*0, name*1*, ...).
+static void _fmime_param_collect(const char *p, const char *name, struct _fmime_param *param)
+{
+	size_t nlen = strlen(name);
+	fmime_slice_t attr;
+	struct _fmime_param_value v;
+
+	param->found = 0;
+	param->nsect = 0;
+	param->sect_mask = 0;
+
+	while((p = _fmime_param_next(p, &attr, &v))) {
+		const char *attr_end = attr.ptr + attr.len;
+		const char *rest;
+		struct _fmime_param_value *dst = NULL;
+		int extended;
+
+		if(!v.ptr || attr.len < nlen || g_ascii_strncasecmp(attr.ptr, name, nlen)) {
+			continue;
+		}
+		rest = attr.ptr + nlen;
+		if(rest == attr_end) {
+			dst = &param->plain;
+			extended = 0;
+		} else if(*rest == '*' && rest + 1 == attr_end) {
+			dst = &param->ext;
+			extended = 1;
+		} else if(*rest == '*' && isdigit((unsigned char)rest[1])) {
+			int n = 0;
+			for(rest++;rest < attr_end && isdigit((unsigned char)*rest);rest++) {
+				n = n * 10 + (*rest - '0');
+				if(n >= FMIME_PARAM_MAX_SECTIONS) {
+					break;
+				}
+			}
+			if(n >= FMIME_PARAM_MAX_SECTIONS || (rest != attr_end && !(*rest == '*' && rest + 1 == attr_end))) {
+				continue;
+			}
+			dst = &param->sect[n];
+			extended = rest != attr_end;
+			param->sect_mask |= G_GUINT64_CONSTANT(1) << n;
+			if(n >= param->nsect) {
+				param->nsect = n + 1;
+			}
+		} else {
+			continue;
+		}
+		*dst = v;
+		dst->extended = extended;
+		param->found |= (dst == &param->plain) ? 1 : (dst == &param->ext) ? 2 : 4;
+	}
+}
+
+// Appends a parameter value to out, unquoting and %XX decoding it as needed
+static void _fmime_param_append(GString *out, const struct _fmime_param_value *v, const char *p)
+{
+	const char *end = v->ptr + v->len;
+
+	for(;p<end;p++) {
+		int h, l;
+		if(v->escaped && *p == '\\' && p + 1 < end) {
+			g_string_append_c(out, *++p);
+		} else if(*p == '\r' || *p == '\n') {
+			continue;
+		} else if(v->extended && *p == '%' && p + 2 < end &&
+				(h = _fmime_hexval(p[1])) >= 0 && (l = _fmime_hexval(p[2])) >= 0) {
+			g_string_append_c(out, (char)(h << 4 | l));
+			p += 2;
+		} else {
+			g_string_append_c(out, *p);
+		}
+	}
+}
+
+int fmime_header_get_param(const char *value, const char *name, fmime_slice_t *out, char **decoded)
+{
+	struct _fmime_param param;
+	GString *buf;
+
+	*decoded = NULL;
+	if(!value || !name) {
+		return 0;
+	}
+	_fmime_param_collect(value, name, &param);
+
+	if((param.found & 2) || (param.sect_mask & 1)) {
+		// RFC 2231: charset'language'value, sections concatenated in order
+		const struct _fmime_param_value *first = (param.sect_mask & 1) ? &param.sect[0] : &param.ext;
+		const char *data = first->ptr;
+		const char *cs = NULL;
+		size_t cs_len = 0;
+		GString *raw;
+		int n;
+
+		if(first->extended) {
+			const char *q1 = memchr(first->ptr, '\'', first->len);
+			const char *q2 = q1 ? memchr(q1 + 1, '\'', first->len - (q1 + 1 - first->ptr)) : NULL;
+			if(q2) {
+				cs = first->ptr;
+				cs_len = q1 - first->ptr;
+				data = q2 + 1;
+			}
+		}
+
+		raw = g_string_sized_new(first->len);
+		_fmime_param_append(raw, first, data);
+		if(first == &param.sect[0]) {
+			for(n=1;n<param.nsect && (param.sect_mask & (G_GUINT64_CONSTANT(1) << n));n++) {
+				_fmime_param_append(raw, &param.sect[n], param.sect[n].ptr);
+			}
+		}
+		buf = g_string_sized_new(raw->len);
+		_fmime_append_utf8(buf, cs, cs_len, raw->str, raw->len);
+		g_string_free(raw, TRUE);
+		goto done;
+	}
+
+	if(!(param.found & 1)) {
+		return 0;
+	}
+	if(!param.plain.escaped && !memmem(param.plain.ptr, param.plain.len, "=?", 2)) {
+		out->ptr = param.plain.ptr;
+		out->len = param.plain.len;
+		return 1;
+	}
+	buf = g_string_sized_new(param.plain.len);
+	if(param.plain.escaped) {
+		GString *raw = g_string_sized_new(param.plain.len);
+		_fmime_param_append(raw, &param.plain, param.plain.ptr);
+		_fmime_decode_words(buf, raw->str, raw->len);
+		g_string_free(raw, TRUE);
+	} else {
+		// encoded words are not allowed inside parameters, but everybody uses them
+		_fmime_decode_words(buf, param.plain.ptr, param.plain.len);
+	}
+
+done:
+	out->len = buf->len;
+	*decoded = g_string_free(buf, FALSE);
+	out->ptr = *decoded;
+	return 1;
+}
+
+const char *fmime_get_header_decoded(fmime_message_t *msg, const char *header)
+{
+	struct _fmime_hfield *f;
+	const char *raw;
+	const unsigned char *p;
+	GString *out;
+
+	if(!header || !(f = _fmime_headers_find(msg->headers, header, strlen(header)))) {
+		return NULL;
+	}
+	raw = f->first->data;
+	// most headers are plain ascii on a single line, nothing to do
+	for(p=(const unsigned char *)raw;*p;p++) {
+		if((*p & 0x80) || *p == '\n' || *p == '\r' || (*p == '=' && p[1] == '?')) {
+			break;
+		}
+	}
+	if(!*p) {
+		return raw;
+	}
+
+	if(!f->decoded) {
+		out = g_string_sized_new(strlen(raw));
+		_fmime_decode_words(out, raw, strlen(raw));
+		f->decoded = _fmime_arena_strndup(msg->headers->arena, out->str, out->len);
+		g_string_free(out, TRUE);
+	}
+	return f->decoded;
+}
+
+int fmime_part_get_filename_slice(fmime_part_t *part, fmime_slice_t *out)
+{
+	if(!(part->_cached & FMIME_CACHED_FILENAME)) {
+		const struct {
+			const char *header;
+			const char *param;
+		} lookups[] = {
+			{ "Content-Disposition", "filename" },
+			{ "Content-Type", "name" },
+			// not valid, but seen in the wild
+			{ "Content-Disposition", "name" },
+			{ "Content-Type", "filename" },
+		};
+		char *decoded;
+		int i;
+
+		part->_filename.ptr = NULL;
+		part->_filename.len = 0;
+		for(i=0;i<G_N_ELEMENTS(lookups);i++) {
+			const char *h = fmime_part_get_header(part, lookups[i].header);
+			if(h && fmime_header_get_param(h, lookups[i].param, &part->_filename, &decoded)) {
+				if(part->_filename.len && decoded) {
+					// keep it with the message
+					part->_filename.ptr = _fmime_arena_strndup(part->headers->arena, decoded, part->_filename.len);
+				}
+				g_free(decoded);
+				if(part->_filename.len) {
+					break;
+				}
+				part->_filename.ptr = NULL;
+			}
+		}
+		part->_cached |= FMIME_CACHED_FILENAME;
+	}
+
+	*out = part->_filename;
+	return out->ptr != NULL;
+}
+
+char *fmime_part_get_filename(fmime_part_t *part)
+{
+	fmime_slice_t fname;
+	char *ret = NULL;
+
+	if(fmime_part_get_filename_slice(part, &fname)) {
+		ret = g_strndup(fname.ptr, fname.len);
+	}
+
+#ifndef NDEBUG
+	if(ret) {
+		D(fprintf(stderr, "*** filename: %s\n", ret));
+	}
+#endif
+	return ret;
+}
+
+// RFC 5322 date-time, including the obsolete syntax (2 digit years,
+// alphabetic zones, comments) and the asctime() layout some MTAs still use.
+
+struct _fmime_dcur {
+	const char *p;
+	const char *end;
+};
+
+// Skips white space, commas and (comments)
+static void _fmime_date_skip(struct _fmime_dcur *c)
+{
+	int depth = 0;
+
+	for(;c->p < c->end;c->p++) {
+		char ch = *c->p;
+		if(depth) {
+			if(ch == '\\' && c->p + 1 < c->end) {
+				c->p++;
+			} else if(ch == '(') {
+				depth++;
+			} else if(ch == ')') {
+				depth--;
+			}
+		} else if(ch == '(') {
+			depth++;
+		} else if(!isspace((unsigned char)ch) && ch != ',') {
+			break;
+		}
+	}
+}
+
+// Reads up to max digits, returns how many were read
+static int _fmime_date_num(struct _fmime_dcur *c, int *val, int max)
+{
+	int n;
+
+	for(n=0,*val=0;n < max && c->p < c->end && isdigit((unsigned char)*c->p);n++, c->p++) {
+		*val = *val * 10 + (*c->p - '0');
+	}
+	return n;
+}
+
+// Reads a run of letters, returns its length
+static int _fmime_date_word(struct _fmime_dcur *c, const char **word)
+{
+	*word = c->p;
+	while(c->p < c->end && isalpha((unsigned char)*c->p)) {
+		c->p++;
+	}
+	return c->p - *word;
+}
+
+// Three lowercased letters packed in an int, for quick name matching
+#define FMIME_DATE_KEY(a, b, c) (((a) << 16) | ((b) << 8) | (c))
+
+static int _fmime_date_key(const char *w)
+{
+	return FMIME_DATE_KEY(w[0] | 0x20, w[1] | 0x20, w[2] | 0x20);
+}
+
+// Index of the word in names, matched on the full name or a prefix of 3
+// up to `prefix` letters, -1 if it's neither ("Novem" isn't a month)
+static int _fmime_date_name(const char *w, int len, const char * const *names, int count, int prefix)
+{
+	int i, key;
+
+	if(len < 3) {
+		return -1;
+	}
+	key = _fmime_date_key(w);
+	for(i=0;i<count;i++) {
+		if(_fmime_date_key(names[i]) == key) {
+			return (len <= prefix || len == strlen(names[i])) && !g_ascii_strncasecmp(w, names[i], len) ? i : -1;
+		}
+	}
+	return -1;
+}
+
+static int _fmime_date_month(const char *w, int len)
+{
+	static const char * const months[] = {
+		"january", "february", "march", "april", "may", "june",
+		"july", "august", "september", "october", "november", "december",
+	};
+	// "Sept" is common enough
+	int i = _fmime_date_name(w, len, months, 12, 4);
+
+	return i < 0 ? -1 : i + 1;
+}
+
+static int _fmime_date_is_weekday(const char *w, int len)
+{
+	static const char * const days[] = {
+		"monday", "tuesday", "wednesday", "thursday", "friday", "saturday", "sunday",
+	};
+
+	return _fmime_date_name(w, len, days, 7, 3) >= 0;
+}
+
+static int _fmime_date_mdays(int year, int month)
+{
+	static const int mdays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	if(month == 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)) {
+		return 29;
+	}
+	return mdays[month - 1];
+}
+
+// Obsolete zone names, in minutes east of UTC. Military letters and
+// anything unknown are taken as UTC, RFC 5322 4.3 says they can't be trusted.
+static int _fmime_date_zone(const char *w, int len)
+{
+	static const struct {
+		const char *name;
+		int offset;
+	} zones[] = {
+		{ "UT", 0 }, { "UTC", 0 }, { "GMT", 0 },
+		{ "EST", -5 * 60 }, { "EDT", -4 * 60 },
+		{ "CST", -6 * 60 }, { "CDT", -5 * 60 },
+		{ "MST", -7 * 60 }, { "MDT", -6 * 60 },
+		{ "PST", -8 * 60 }, { "PDT", -7 * 60 },
+		{ "BST", 60 }, { "CET", 60 }, { "CEST", 2 * 60 },
+		{ "EET", 2 * 60 }, { "EEST", 3 * 60 },
+		{ "BRT", -3 * 60 }, { "BRST", -2 * 60 },
+		{ "JST", 9 * 60 },
+	};
+	int i;
+
+	for(i=0;i<G_N_ELEMENTS(zones);i++) {
+		if(len == strlen(zones[i].name) && !g_ascii_strncasecmp(w, zones[i].name, len)) {
+			return zones[i].offset;
+		}
+	}
+	return 0;
+}
+
+// Days since 1970-01-01 of a proleptic gregorian date
+static gint64 _fmime_days_from_civil(int y, int m, int d)
+{
+	gint64 era;
+	int yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+int fmime_parse_date(const char *s, size_t len, gint64 *epoch)
+{
+	struct _fmime_dcur c = { s, s + len };
+	const char *w;
+	int wlen, n;
+	int day, month, year = 0, hour, min, sec = 0;
+	int ydigits = 4, zone = 0;
+	int asctime_layout = 0;
+
+	_fmime_date_skip(&c);
+	wlen = _fmime_date_word(&c, &w);
+	if(wlen && _fmime_date_is_weekday(w, wlen)) {
+		_fmime_date_skip(&c);
+		wlen = _fmime_date_word(&c, &w);
+	}
+	if(wlen) {
+		// Wed Nov 10 11:57:45 2004
+		if((month = _fmime_date_month(w, wlen)) < 0) {
+			return -1;
+		}
+		asctime_layout = 1;
+		_fmime_date_skip(&c);
+		if(!_fmime_date_num(&c, &day, 2)) {
+			return -1;
+		}
+	} else {
+		// 10 Nov 2004, 10-Nov-2004
+		if(!_fmime_date_num(&c, &day, 2)) {
+			return -1;
+		}
+		_fmime_date_skip(&c);
+		if(c.p < c.end && *c.p == '-') {
+			c.p++;
+		}
+		wlen = _fmime_date_word(&c, &w);
+		if((month = _fmime_date_month(w, wlen)) < 0) {
+			return -1;
+		}
+		_fmime_date_skip(&c);
+		if(c.p < c.end && *c.p == '-') {
+			c.p++;
+		}
+		if((ydigits = _fmime_date_num(&c, &year, 4)) < 2) {
+			return -1;
+		}
+	}
+
+	_fmime_date_skip(&c);
+	if(_fmime_date_num(&c, &hour, 2) < 1 || c.p >= c.end || *c.p != ':') {
+		return -1;
+	}
+	c.p++;
+	if(_fmime_date_num(&c, &min, 2) != 2) {
+		return -1;
+	}
+	if(c.p < c.end && *c.p == ':') {
+		c.p++;
+		if(_fmime_date_num(&c, &sec, 2) != 2) {
+			return -1;
+		}
+	}
+
+	if(asctime_layout) {
+		_fmime_date_skip(&c);
+		if((ydigits = _fmime_date_num(&c, &year, 4)) < 2) {
+			return -1;
+		}
+	}
+
+	_fmime_date_skip(&c);
+	if(c.p < c.end && (*c.p == '+' || *c.p == '-')) {
+		int sign = *c.p++ == '-' ? -1 : 1;
+		int hhmm;
+		if(_fmime_date_num(&c, &hhmm, 4) == 4) {
+			if(hhmm % 100 > 59) {
+				return -1;
+			}
+			zone = sign * ((hhmm / 100) * 60 + hhmm % 100);
+		}
+	} else if((wlen = _fmime_date_word(&c, &w))) {
+		zone = _fmime_date_zone(w, wlen);
+	}
+
+	// RFC 5322 4.3
+	if(ydigits == 2) {
+		year += year < 50 ? 2000 : 1900;
+	} else if(ydigits == 3) {
+		year += 1900;
+	}
+	if(day < 1 || day > _fmime_date_mdays(year, month) || hour > 23 || min > 59 || sec > 60) {
+		return -1;
+	}
+	if(sec == 60) {
+		sec = 59;
+	}
+
+	n = hour * 3600 + min * 60 + sec;
+	*epoch = _fmime_days_from_civil(year, month, day) * 86400 + n - zone * 60;
+	return 0;
+}
+
+// The timestamp of a Received trace field follows its first ';' outside
+// comments: "(from userid 0; v3)" or a "(UTC; local)" after the date
+// don't count. NULL if there's none.
+static const char *_fmime_received_semi(const char *p, size_t len)
+{
+	const char *end = p + len;
+	int depth = 0;
+
+	for(;p < end;p++) {
+		if(*p == '\\' && depth && p + 1 < end) {
+			p++;
+		} else if(*p == '(') {
+			depth++;
+		} else if(*p == ')' && depth) {
+			depth--;
+		} else if(*p == ';' && !depth) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static int _fmime_received_date(const char *value, size_t len, gint64 *epoch)
+{
+	const char *semi = _fmime_received_semi(value, len);
+
+	if(!semi) {
+		return -1;
+	}
+	return fmime_parse_date(semi + 1, len - (semi + 1 - value), epoch);
+}
+
+int fmime_get_arrival_date(fmime_message_t *msg, gint64 *epoch)
+{
+	const char *r = fmime_get_header(msg, "Received");
+
+	if(!r) {
+		return -1;
+	}
+	return _fmime_received_date(r, strlen(r), epoch);
+}
+
+int fmime_get_date(fmime_message_t *msg, gint64 *epoch)
+{
+	const char *d = fmime_get_header(msg, "Date");
+
+	if(d && !fmime_parse_date(d, strlen(d), epoch)) {
+		return 0;
+	}
+	return fmime_get_arrival_date(msg, epoch);
+}
+
+// Looks for the relay address in a comment of the from clause: the
+// bracketed one of "(host [1.2.3.4])" or a bare "(1.2.3.4)". The name
+// given in HELO/EHLO is claimed by the client and ignored.
+static int _fmime_hop_ip(const char *p, size_t len, fmime_slice_t *ip)
+{
+	const char *end = p + len;
+	const char *s;
+	int dots;
+
+	if(len >= 4 && (!g_ascii_strncasecmp(p, "HELO", 4) || !g_ascii_strncasecmp(p, "EHLO", 4))) {
+		return 0;
+	}
+	for(s=p;s < end && *s != '[';s++) {
+		// do nothing
+	}
+	if(s < end) {
+		for(p=++s;p < end && *p != ']';p++) {
+			// do nothing
+		}
+		if(p - s > 5 && !g_ascii_strncasecmp(s, "IPv6:", 5)) {
+			s += 5;
+		}
+		ip->ptr = s;
+		ip->len = p - s;
+		return ip->len > 0;
+	}
+	for(s=p;s < end;s++) {
+		if(!isdigit((unsigned char)*s) || (s > p && (isalnum((unsigned char)s[-1]) || s[-1] == '.'))) {
+			continue;
+		}
+		for(p=s,dots=0;p < end && (isdigit((unsigned char)*p) || *p == '.');p++) {
+			dots += *p == '.';
+		}
+		if(dots == 3 && (p == end || !isalnum((unsigned char)*p))) {
+			ip->ptr = s;
+			ip->len = p - s;
+			return 1;
+		}
+		s = p;
+	}
+	return 0;
+}
+
+#define FMIME_HOP_NONE 0
+#define FMIME_HOP_FROM 1
+#define FMIME_HOP_BY   2
+#define FMIME_HOP_VIA  3
+#define FMIME_HOP_WITH 4
+#define FMIME_HOP_ID   5
+#define FMIME_HOP_FOR  6
+
+static int _fmime_hop_clause(const char *w, size_t len)
+{
+	static const char *clauses[] = { "from", "by", "via", "with", "id", "for" };
+	int i;
+
+	for(i=0;i<(int)G_N_ELEMENTS(clauses);i++) {
+		if(strlen(clauses[i]) == len && !g_ascii_strncasecmp(w, clauses[i], len)) {
+			return i + 1;
+		}
+	}
+	return FMIME_HOP_NONE;
+}
+
+int fmime_parse_received(const char *value, size_t len, fmime_hop_t *hop)
+{
+	const char *p = value;
+	const char *semi = _fmime_received_semi(value, len);
+	const char *end = semi ? semi : value + len;
+	const char *s;
+	fmime_slice_t *slot = NULL;
+	int clause = FMIME_HOP_NONE;
+	int depth;
+
+	memset(hop, 0, sizeof(*hop));
+	// the clauses, up to the date
+	while(p < end) {
+		if(isspace((unsigned char)*p)) {
+			p++;
+			continue;
+		}
+		if(*p == '(') {
+			for(s=++p,depth=1;p < end;p++) {
+				if(*p == '\\' && p + 1 < end) {
+					p++;
+				} else if(*p == '(') {
+					depth++;
+				} else if(*p == ')' && !--depth) {
+					break;
+				}
+			}
+			if(clause == FMIME_HOP_FROM && !hop->from_ip.ptr) {
+				_fmime_hop_ip(s, p - s, &hop->from_ip);
+			}
+			p += p < end;
+			continue;
+		}
+		for(s=p;p < end && !isspace((unsigned char)*p) && *p != '(';p++) {
+			// do nothing
+		}
+		if(slot) {
+			// clause value
+			if(clause == FMIME_HOP_FOR && p - s >= 2 && *s == '<' && p[-1] == '>') {
+				s++;
+				p--;
+				slot->ptr = s;
+				slot->len = p++ - s;
+			} else {
+				slot->ptr = s;
+				slot->len = p - s;
+			}
+			if(clause == FMIME_HOP_FROM && *s == '[') {
+				_fmime_hop_ip(s, p - s, &hop->from_ip);
+			}
+			slot = NULL;
+			continue;
+		}
+		switch((clause = _fmime_hop_clause(s, p - s))) {
+			case FMIME_HOP_FROM: slot = &hop->from; break;
+			case FMIME_HOP_BY:   slot = &hop->by; break;
+			case FMIME_HOP_WITH: slot = &hop->with; break;
+			case FMIME_HOP_ID:   slot = &hop->id; break;
+			case FMIME_HOP_FOR:  slot = &hop->rcpt; break;
+			default: break;
+		}
+	}
+	if(!semi) {
+		return -1;
+	}
+	if(!_fmime_received_date(value, len, &hop->timestamp)) {
+		hop->flags |= FMIME_HOP_HAS_DATE;
+	}
+	return 0;
+}
+
+int fmime_get_hops(fmime_message_t *msg, fmime_hop_t *out, int max)
+{
+	const GList *l;
+	int n = 0;
+
+	for(l=fmime_get_headers(msg, "Received");l;l=l->next) {
+		if(n < max) {
+			fmime_parse_received(l->data, strlen(l->data), &out[n]);
+		}
+		n++;
+	}
+	return n;
+}
+
+static int _fmime_hline_is(const struct _fmime_hline *h, const char *name, size_t len)
+{
+	return h->name_len == len && !g_ascii_strncasecmp(h->name, name, len);
+}
+
+// Copies UTF-8 text into a fixed buffer, never splitting a character.
+// With collapse, runs of white space become a single space.
+static void _fmime_copy_bounded(char *dst, size_t size, const char *src, size_t len, int collapse)
+{
+	size_t i, n = 0;
+	int space = 1;
+
+	for(i=0;i<len;) {
+		unsigned char c = src[i];
+		size_t clen = c < 0x80 ? 1 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+
+		if(collapse && isspace(c)) {
+			if(!space && n + 1 < size) {
+				dst[n++] = ' ';
+			}
+			space = 1;
+			i++;
+			continue;
+		}
+		if(n + clen >= size || i + clen > len) {
+			break;
+		}
+		memcpy(dst + n, src + i, clen);
+		n += clen;
+		i += clen;
+		space = 0;
+	}
+	if(collapse && n && dst[n-1] == ' ') {
+		n--;
+	}
+	dst[n] = '\0';
+}
+
+// Copies a header slice nul terminated into buf, or into a new allocation
+// returned in *heap when it doesn't fit.
+static const char *_fmime_slice_cstr(const fmime_slice_t *s, char *buf, size_t size, char **heap)
+{
+	*heap = NULL;
+	if(s->len < size) {
+		memcpy(buf, s->ptr, s->len);
+		buf[s->len] = '\0';
+		return buf;
+	}
+	return *heap = g_strndup(s->ptr, s->len);
+}
+
+#define FMIME_SUMMARY_MAX_DEPTH 8
+
+// A text part found by _fmime_summary_text, in the raw message
+struct _fmime_summary_text {
+	const char *body;
+	size_t len;
+	fmime_slice_t ctype;
+	fmime_slice_t cte;
+	int plain;
+};
+
+// Finds the text part under a body the way fmime_get_plaintext picks it,
+// without decoding anything. Returns 1 once a text part was found.
+static int _fmime_summary_text(struct _fmime_summary_text *t, const char *body, size_t len,
+		const fmime_slice_t *ctype, const fmime_slice_t *cte, int flags, int depth)
+{
+	char tmp[512];
+	char *heap;
+	const char *ct = "text/plain";
+	fmime_slice_t type, subtype, param;
+	char *decoded = NULL;
+	int ret = 0;
+
+	if(ctype->ptr) {
+		ct = _fmime_slice_cstr(ctype, tmp, sizeof(tmp), &heap);
+	} else {
+		heap = NULL;
+	}
+	if(!_fmime_split_ctype(ct, &type, &subtype)) {
+		type.ptr = "text";
+		type.len = 4;
+		subtype.ptr = "plain";
+		subtype.len = 5;
+	}
+
+	if(_fmime_slice_eq(&type, "text", 4)) {
+		t->body = body;
+		t->len = len;
+		t->ctype = *ctype;
+		t->cte = *cte;
+		t->plain = _fmime_slice_eq(&subtype, "plain", 5);
+		ret = 1;
+	} else if(_fmime_slice_eq(&type, "multipart", 9) && depth < FMIME_SUMMARY_MAX_DEPTH &&
+			fmime_header_get_param(ct, "boundary", &param, &decoded) &&
+			param.len && param.len + 2 < sizeof(tmp)) {
+		char delim[sizeof(tmp)];
+		size_t dlen = param.len + 2;
+		const char *p = body;
+		const char *end = body + len;
+		const char *q, *next, *start = NULL;
+		int close = 0;
+		int recover = flags & FMIME_SUMMARY_RECOVER;
+		int alt = _fmime_slice_eq(&subtype, "alternative", 11);
+		int rank, best_rank = -1;
+		struct _fmime_summary_text c;
+
+		delim[0] = delim[1] = '-';
+		memcpy(delim + 2, param.ptr, param.len);
+
+		// the parts as _fmime_parse_multipart splits them, up to the
+		// first text part, or the best one of an alternative
+		while(best_rank < (alt ? FMIME_ALT_BEST : 0)) {
+			if(!(q = _fmime_next_delimiter(body, p, end, delim, dlen, recover, &next, &close))) {
+				if(!start || !recover) {
+					break;
+				}
+				// no close delimiter, the last part runs to the end
+				q = end;
+				close = 1;
+			}
+			if(start) {
+				struct _fmime_hline h;
+				fmime_slice_t pctype = { NULL, 0 };
+				fmime_slice_t pcte = { NULL, 0 };
+				size_t off, plen = q - start, pbody = 0;
+
+				// the line break before the delimiter belongs to it
+				if(q != end && plen && start[plen-1] == '\n') {
+					plen--;
+					if(plen && start[plen-1] == '\r') {
+						plen--;
+					}
+				}
+				for(off=0;(off = _fmime_next_header(start, plen, off, &h, &pbody));) {
+					if(_fmime_hline_is(&h, "Content-Type", 12)) {
+						pctype.ptr = h.value;
+						pctype.len = h.value_len;
+					} else if(_fmime_hline_is(&h, "Content-Transfer-Encoding", 25)) {
+						pcte.ptr = h.value;
+						pcte.len = h.value_len;
+					}
+				}
+				if(_fmime_summary_text(&c, start + pbody, plen - pbody, &pctype, &pcte, flags, depth + 1) &&
+						(rank = alt ? _fmime_alt_rank(c.plain, c.body, c.len) : 0) > best_rank) {
+					*t = c;
+					best_rank = rank;
+				}
+			}
+			if(close) {
+				break;
+			}
+			start = p = next;
+		}
+		ret = best_rank >= 0;
+	}
+
+	g_free(decoded);
+	g_free(heap);
+	return ret;
+}
+
+// Decodes the start of the text part under a body into the preview.
+// Returns 1 once a text part was found.
+static int _fmime_summary_preview(fmime_summary_t *sum, const char *body, size_t len,
+		const fmime_slice_t *ctype, const fmime_slice_t *cte, int flags)
+{
+	struct _fmime_summary_text t;
+	char tmp[512];
+	char *heap = NULL;
+	const char *ct = "text/plain";
+	char *text;
+	size_t n = 0;
+
+	if(!_fmime_summary_text(&t, body, len, ctype, cte, flags, 0)) {
+		return 0;
+	}
+	if(t.ctype.ptr) {
+		ct = _fmime_slice_cstr(&t.ctype, tmp, sizeof(tmp), &heap);
+	}
+	// decode a bit more than needed, white space gets collapsed
+	text = _fmime_text_convert(ct, t.cte.ptr ? _fmime_cte_lookup(t.cte.ptr, t.cte.len) : FMIME_CTE_IDENTITY,
+			t.body, t.len, 1, FMIME_SUMMARY_PREVIEW_MAX * 2, &n);
+	_fmime_copy_bounded(sum->preview, sizeof(sum->preview), text, n, 1);
+	g_free(text);
+	g_free(heap);
+	return 1;
+}
+
+int fmime_summarize(const char *buf, size_t len, fmime_summary_t *sum, int flags)
+{
+	struct _fmime_hline h;
+	fmime_slice_t ctype = { NULL, 0 };
+	fmime_slice_t cte = { NULL, 0 };
+	size_t off, body = len;
+
+	memset(sum, 0, sizeof(*sum));
+	sum->size = len;
+
+	for(off=0;(off = _fmime_next_header(buf, len, off, &h, &body));) {
+		fmime_slice_t *dst = NULL;
+
+		// dispatch on the first letter, most headers are of no interest
+		switch(g_ascii_tolower(h.name[0])) {
+			case 'c':
+				if(_fmime_hline_is(&h, "Cc", 2)) {
+					dst = &sum->cc;
+				} else if(_fmime_hline_is(&h, "Content-Type", 12)) {
+					dst = &ctype;
+				} else if(_fmime_hline_is(&h, "Content-Transfer-Encoding", 25)) {
+					dst = &cte;
+				}
+				break;
+			case 'd':
+				if(_fmime_hline_is(&h, "Date", 4)) {
+					dst = &sum->date;
+				}
+				break;
+			case 'f':
+				if(_fmime_hline_is(&h, "From", 4)) {
+					dst = &sum->from;
+				}
+				break;
+			case 'm':
+				if(_fmime_hline_is(&h, "Message-Id", 10)) {
+					dst = &sum->message_id;
+				}
+				break;
+			case 'r':
+				if(_fmime_hline_is(&h, "Reply-To", 8)) {
+					dst = &sum->reply_to;
+				} else if(_fmime_hline_is(&h, "Received", 8)) {
+					dst = &sum->received;
+				}
+				break;
+			case 's':
+				if(_fmime_hline_is(&h, "Subject", 7)) {
+					dst = &sum->subject;
+				} else if(_fmime_hline_is(&h, "Status", 6)) {
+					dst = &sum->status;
+				}
+				break;
+			case 't':
+				if(_fmime_hline_is(&h, "To", 2)) {
+					dst = &sum->to;
+				}
+				break;
+		}
+		// the first occurrence wins, like fmime_get_header
+		if(dst && !dst->ptr) {
+			dst->ptr = h.value;
+			dst->len = h.value_len;
+		}
+	}
+	sum->body_offset = body;
+
+	if((sum->date.ptr && !fmime_parse_date(sum->date.ptr, sum->date.len, &sum->timestamp)) ||
+			(sum->received.ptr && !_fmime_received_date(sum->received.ptr, sum->received.len, &sum->timestamp))) {
+		sum->flags |= FMIME_SUMMARY_HAS_DATE;
+	} else {
+		sum->timestamp = 0;
+	}
+
+	if(sum->status.ptr) {
+		if(memchr(sum->status.ptr, 'R', sum->status.len)) {
+			sum->flags |= FMIME_SUMMARY_SEEN;
+		}
+		if(memchr(sum->status.ptr, 'O', sum->status.len)) {
+			sum->flags |= FMIME_SUMMARY_OLD;
+		}
+	}
+	if(ctype.len >= 10 && !g_ascii_strncasecmp(ctype.ptr, "multipart/", 10)) {
+		sum->flags |= FMIME_SUMMARY_MULTIPART;
+	}
+
+	if((flags & FMIME_SUMMARY_SUBJECT) && sum->subject.ptr) {
+		size_t i;
+		for(i=0;i<sum->subject.len;i++) {
+			char c = sum->subject.ptr[i];
+			if((c & 0x80) || c == '\n' || c == '\r' || (c == '=' && i + 1 < sum->subject.len && sum->subject.ptr[i+1] == '?')) {
+				break;
+			}
+		}
+		if(i == sum->subject.len) {
+			_fmime_copy_bounded(sum->subject_utf8, sizeof(sum->subject_utf8), sum->subject.ptr, sum->subject.len, 0);
+		} else {
+			GString *out = g_string_sized_new(sum->subject.len);
+			_fmime_decode_words(out, sum->subject.ptr, sum->subject.len);
+			_fmime_copy_bounded(sum->subject_utf8, sizeof(sum->subject_utf8), out->str, out->len, 0);
+			g_string_free(out, TRUE);
+		}
+	}
+
+	if((flags & FMIME_SUMMARY_PREVIEW) &&
+			_fmime_summary_preview(sum, buf + body, len - body, &ctype, &cte, flags)) {
+		sum->flags |= FMIME_SUMMARY_HAS_PREVIEW;
+	}
+	return 0;
+}
+
+// A slice of the batch handled by one worker. Strings go to a private pool,
+// rebased into the shared one when all workers are done.
+struct _fmime_batch_chunk {
+	const char * const *bufs;
+	const size_t *lens;
+	const char * const *paths;
+	size_t first;
+	size_t count;
+	fmime_summary_columns_t *cols;
+	GString *pool;
+};
+
+static void _fmime_batch_one(struct _fmime_batch_chunk *c, size_t i, const char *buf, size_t len)
+{
+	fmime_summary_columns_t *cols = c->cols;
+	fmime_summary_t sum;
+
+	fmime_summarize(buf, len, &sum, FMIME_SUMMARY_SUBJECT);
+	cols->size[i] = len;
+	cols->date[i] = sum.timestamp;
+	cols->flags[i] = sum.flags;
+
+	cols->subject[i] = c->pool->len;
+	g_string_append_len(c->pool, sum.subject_utf8, strlen(sum.subject_utf8) + 1);
+
+	cols->from[i] = c->pool->len;
+	if(sum.from.ptr) {
+		_fmime_decode_words(c->pool, sum.from.ptr, sum.from.len);
+	}
+	g_string_append_c(c->pool, '\0');
+}
+
+static void _fmime_batch_worker(gpointer data, gpointer user_data)
+{
+	struct _fmime_batch_chunk *c = data;
+	fmime_buffer_t buf = { NULL, 0 };
+	size_t i;
+
+	for(i=c->first;i<c->first + c->count;i++) {
+		size_t len;
+
+		if(!c->paths) {
+			_fmime_batch_one(c, i, c->bufs[i], c->lens[i]);
+		} else if(!_fmime_read_file(c->paths[i], &buf, &len)) {
+			_fmime_batch_one(c, i, buf.data, len);
+		} else {
+			c->cols->subject[i] = c->cols->from[i] = c->pool->len;
+			g_string_append_c(c->pool, '\0');
+			c->cols->size[i] = 0;
+			c->cols->date[i] = 0;
+			c->cols->flags[i] = FMIME_SUMMARY_ERROR;
+		}
+	}
+	fmime_buffer_free(&buf);
+}
+
+static fmime_summary_columns_t *_fmime_summarize_batch(const char * const *bufs, const size_t *lens,
+		const char * const *paths, size_t n, int threads)
+{
+	fmime_summary_columns_t *cols;
+	struct _fmime_batch_chunk *chunks;
+	GThreadPool *pool;
+	size_t i, nchunks, per, total = 0;
+
+	if(threads <= 0) {
+		threads = g_get_num_processors();
+	}
+	// a few chunks per thread so a slow one doesn't hold up the rest
+	nchunks = MIN(n, (size_t)threads * 4);
+	nchunks = MAX(nchunks, 1);
+	per = (n + nchunks - 1) / nchunks;
+
+	cols = g_malloc0(sizeof(fmime_summary_columns_t));
+	cols->count = n;
+	cols->subject = g_new(guint32, n);
+	cols->from = g_new(guint32, n);
+	cols->size = g_new(gint64, n);
+	cols->date = g_new(gint64, n);
+	cols->flags = g_new(guint32, n);
+
+	chunks = g_new0(struct _fmime_batch_chunk, nchunks);
+	pool = g_thread_pool_new(_fmime_batch_worker, NULL, threads, TRUE, NULL);
+	for(i=0;i<nchunks;i++) {
+		struct _fmime_batch_chunk *c = &chunks[i];
+		c->bufs = bufs;
+		c->lens = lens;
+		c->paths = paths;
+		c->first = MIN(i * per, n);
+		c->count = MIN(per, n - c->first);
+		c->cols = cols;
+		c->pool = g_string_sized_new(c->count * 64);
+		if(pool) {
+			g_thread_pool_push(pool, c, NULL);
+		} else {
+			_fmime_batch_worker(c, NULL);
+		}
+	}
+	if(pool) {
+		// waits for the queued chunks
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+
+	for(i=0;i<nchunks;i++) {
+		total += chunks[i].pool->len;
+	}
+	if(total > G_MAXUINT32) {
+		for(i=0;i<nchunks;i++) {
+			g_string_free(chunks[i].pool, TRUE);
+		}
+		g_free(chunks);
+		fmime_summary_columns_free(cols);
+		return NULL;
+	}
+
+	cols->pool = g_malloc(MAX(total, 1));
+	for(i=0,total=0;i<nchunks;i++) {
+		struct _fmime_batch_chunk *c = &chunks[i];
+		size_t j;
+
+		memcpy(cols->pool + total, c->pool->str, c->pool->len);
+		for(j=c->first;j<c->first + c->count;j++) {
+			cols->subject[j] += total;
+			cols->from[j] += total;
+		}
+		total += c->pool->len;
+		g_string_free(c->pool, TRUE);
+	}
+	cols->pool_len = total;
+	g_free(chunks);
+	return cols;
+}
+
+fmime_summary_columns_t *fmime_summarize_batch(const char * const *bufs, const size_t *lens, size_t n, int threads)
+{
+	return _fmime_summarize_batch(bufs, lens, NULL, n, threads);
+}
+
+fmime_summary_columns_t *fmime_summarize_files(const char * const *paths, size_t n, int threads)
+{
+	return _fmime_summarize_batch(NULL, NULL, paths, n, threads);
+}
+
+void fmime_summary_columns_free(fmime_summary_columns_t *cols)
+{
+	if(cols) {
+		g_free(cols->pool);
+		g_free(cols->subject);
+		g_free(cols->from);
+		g_free(cols->size);
+		g_free(cols->date);
+		g_free(cols->flags);
+		g_free(cols);
+	}
+}
+
+// fmime_parse_files: a file on its way from the reader to a parser thread
+struct _fmime_load {
+	size_t idx;
+	char *buf;   // NULL if the file couldn't be read
+	size_t size;
+	size_t len;
+	struct _fmime_load *next;
+};
+
+struct _fmime_loader {
+	const char * const *paths;
+	fmime_file_cb cb;
+	void *data;
+	GMutex lock;
+	GCond cond;
+	int queued; // loaded, waiting for a parser
+};
+
+// Completes a file of l->len bytes whose first read got `got` of them
+// into l->buf, reading the rest from here. A file that can't be read to
+// the end is reported as unreadable rather than parsed truncated.
+static void _fmime_load_rest(struct _fmime_load *l, int fd, size_t got)
+{
+	if(got < l->len && lseek(fd, got, SEEK_SET) == (off_t)got) {
+		got += _fmime_read_all(fd, l->buf + got, l->len - got);
+	}
+	if(got != l->len) {
+		_fmime_io_put(l->buf, l->size);
+		l->buf = NULL;
+		return;
+	}
+	l->buf[l->len] = '\0';
+}
+
+// Parser threads keep a context each, so they stop allocating
+static GPrivate _fmime_load_ctx_key = G_PRIVATE_INIT((GDestroyNotify)fmime_ctx_free);
+
+static void _fmime_load_parse(gpointer data, gpointer user_data)
+{
+	struct _fmime_load *l = data;
+	struct _fmime_loader *ld = user_data;
+	fmime_parser_ctx_t *ctx = g_private_get(&_fmime_load_ctx_key);
+	fmime_message_t *msg = NULL;
+
+	if(l->buf) {
+		if(!ctx) {
+			ctx = fmime_ctx_new();
+			g_private_set(&_fmime_load_ctx_key, ctx);
+		}
+		msg = fmime_ctx_parse_memory(ctx, l->buf, l->len);
+	}
+
+	ld->cb(msg, l->idx, ld->data);
+	if(msg) {
+		fmime_free(msg);
+	}
+	if(l->buf) {
+		_fmime_io_put(l->buf, l->size);
+	}
+	g_free(l);
+
+	g_mutex_lock(&ld->lock);
+	ld->queued--;
+	g_cond_signal(&ld->cond);
+	g_mutex_unlock(&ld->lock);
+}
+
+// Fallback: each parser thread reads its own files
+static void _fmime_load_worker(gpointer data, gpointer user_data)
+{
+	struct _fmime_loader *ld = user_data;
+	struct _fmime_load *l = g_new0(struct _fmime_load, 1);
+	int fd;
+
+	l->idx = GPOINTER_TO_SIZE(data) - 1;
+	if((fd = _fmime_open_file(ld->paths[l->idx], &l->len)) >= 0) {
+		l->buf = _fmime_io_get(l->len + 1, &l->size);
+		_fmime_load_rest(l, fd, _fmime_read_all(fd, l->buf, l->len));
+		close(fd);
+	}
+	g_mutex_lock(&ld->lock);
+	ld->queued++;
+	g_mutex_unlock(&ld->lock);
+	_fmime_load_parse(l, ld);
+}
+
+#ifdef FMIME_URING
+// Parser job of the io_uring reader, a list of loaded files
+static void _fmime_load_parse_list(gpointer data, gpointer user_data)
+{
+	struct _fmime_load *l, *next;
+
+	for(l=data;l;l=next) {
+		next = l->next;
+		_fmime_load_parse(l, user_data);
+	}
+}
+
+// Hands the loaded files to the parsers in one job, a wakeup per file
+// costs as much as parsing a small one. Waits while the parsers are
+// behind so the reader doesn't pile up buffers.
+static void _fmime_load_push(struct _fmime_loader *ld, GThreadPool *pool, struct _fmime_load **batch, int *count)
+{
+	if(!*count) {
+		return;
+	}
+	g_mutex_lock(&ld->lock);
+	while(ld->queued >= FMIME_LOAD_QUEUE) {
+		g_cond_wait(&ld->cond, &ld->lock);
+	}
+	ld->queued += *count;
+	g_mutex_unlock(&ld->lock);
+
+	if(pool) {
+		g_thread_pool_push(pool, *batch, NULL);
+	} else {
+		_fmime_load_parse_list(*batch, ld);
+	}
+	*batch = NULL;
+	*count = 0;
+}
+
+// Just enough of io_uring for the loader, without liburing: one thread
+// submits and reaps
+struct _fmime_uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries;
+	unsigned to_submit;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+static int _fmime_uring_init(struct _fmime_uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	if((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+		return -1;
+	}
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->sq_len = r->cq_len = MAX(r->sq_len, r->cq_len);
+	}
+	r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_ring == MAP_FAILED) {
+		close(r->fd);
+		return -1;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else if((r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		munmap(r->sq_ring, r->sq_len);
+		close(r->fd);
+		return -1;
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if((r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		if(r->cq_ring != r->sq_ring) {
+			munmap(r->cq_ring, r->cq_len);
+		}
+		munmap(r->sq_ring, r->sq_len);
+		close(r->fd);
+		return -1;
+	}
+	sq = r->sq_ring;
+	cq = r->cq_ring;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->sq_entries = p.sq_entries;
+	return 0;
+}
+
+static void _fmime_uring_exit(struct _fmime_uring *r)
+{
+	munmap(r->sqes, r->sqes_len);
+	if(r->cq_ring != r->sq_ring) {
+		munmap(r->cq_ring, r->cq_len);
+	}
+	munmap(r->sq_ring, r->sq_len);
+	close(r->fd);
+}
+
+// The loader needs IORING_OP_OPENAT, READ and CLOSE, from linux 5.6. The
+// ring itself came in 5.1: there every open would fail with EINVAL, so
+// the ops are probed first. Kernels without the probe don't have them.
+static int _fmime_uring_probe(struct _fmime_uring *r)
+{
+	static const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+	struct io_uring_probe *p = g_malloc0(sizeof(*p) + 256 * sizeof(struct io_uring_probe_op));
+	int i, ret = 0;
+
+	if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, p, 256) < 0) {
+		ret = -1;
+	}
+	for(i=0;!ret && i<G_N_ELEMENTS(ops);i++) {
+		if(ops[i] > p->last_op || !(p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			ret = -1;
+		}
+	}
+	g_free(p);
+	return ret;
+}
+
+// Next free submission entry, zeroed, NULL if the queue is full
+static struct io_uring_sqe *_fmime_uring_sqe(struct _fmime_uring *r)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned idx;
+
+	if(tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		return NULL;
+	}
+	idx = tail & *r->sq_mask;
+	memset(&r->sqes[idx], 0, sizeof(struct io_uring_sqe));
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+	return &r->sqes[idx];
+}
+
+// Submits what's queued and waits for at least one completion
+static int _fmime_uring_enter(struct _fmime_uring *r)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	} while(ret < 0 && errno == EINTR);
+	if(ret < 0) {
+		return -1;
+	}
+	r->to_submit -= MIN((unsigned)ret, r->to_submit);
+	return 0;
+}
+
+// user_data of the loader ops: the slot, and what it was doing
+#define FMIME_URING_OPEN  (1ULL << 32)
+#define FMIME_URING_READ  (2ULL << 32)
+#define FMIME_URING_CLOSE (3ULL << 32)
+
+// Keeps FMIME_URING_DEPTH files in flight, each one going through openat,
+// read and close in the ring, and passes them to the parser pool as the
+// reads complete. Returns -1 if io_uring, or the ops the loader needs,
+// can't be used, before anything was read.
+static int _fmime_load_uring(struct _fmime_loader *ld, GThreadPool *pool, size_t n)
+{
+	struct _fmime_uring r;
+	struct _fmime_load *slots[FMIME_URING_DEPTH];
+	struct _fmime_load *batch = NULL;
+	int fds[FMIME_URING_DEPTH];
+	int free_slots[FMIME_URING_DEPTH];
+	int nfree, nbatch = 0, active = 0, closing = 0;
+	size_t next = 0;
+	int s;
+
+	// room for an open or read, and a close, per slot
+	if(_fmime_uring_init(&r, FMIME_URING_DEPTH * 2)) {
+		return -1;
+	}
+	if(_fmime_uring_probe(&r)) {
+		_fmime_uring_exit(&r);
+		return -1;
+	}
+	for(nfree=0;nfree<FMIME_URING_DEPTH;nfree++) {
+		free_slots[nfree] = FMIME_URING_DEPTH - 1 - nfree;
+		slots[nfree] = NULL;
+	}
+
+	while(next < n || active || closing) {
+		struct io_uring_sqe *sqe;
+		unsigned head, tail;
+
+		for(;nfree && next < n && (sqe = _fmime_uring_sqe(&r));next++) {
+			s = free_slots[--nfree];
+
+			slots[s] = g_new0(struct _fmime_load, 1);
+			slots[s]->idx = next;
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (guint64)(gsize)ld->paths[next];
+			sqe->open_flags = O_RDONLY;
+			sqe->user_data = FMIME_URING_OPEN | s;
+			active++;
+		}
+		if(_fmime_uring_enter(&r)) {
+			// can't happen with a sane ring; don't leave files behind
+			break;
+		}
+
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for(;head != tail;head++) {
+			struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+			guint64 op = cqe->user_data & ~0xffffffffULL;
+			struct _fmime_load *l;
+
+			s = cqe->user_data & 0xffffffff;
+			l = slots[s];
+
+			if(op == FMIME_URING_CLOSE) {
+				closing--;
+				continue;
+			}
+			if(op == FMIME_URING_OPEN && cqe->res >= 0) {
+				fds[s] = cqe->res;
+				if(!_fmime_file_size(fds[s], &l->len)) {
+					l->buf = _fmime_io_get(l->len + 1, &l->size);
+					if((sqe = _fmime_uring_sqe(&r))) {
+						sqe->opcode = IORING_OP_READ;
+						sqe->fd = fds[s];
+						sqe->addr = (guint64)(gsize)l->buf;
+						// a short read is completed by _fmime_load_rest
+						sqe->len = MIN(l->len, 1U << 30);
+						sqe->off = 0;
+						sqe->user_data = FMIME_URING_READ | s;
+						continue;
+					}
+					// no room in the ring, read it here
+					_fmime_load_rest(l, fds[s], _fmime_read_all(fds[s], l->buf, l->len));
+				}
+				close(fds[s]);
+			} else if(op == FMIME_URING_READ) {
+				if(cqe->res >= 0) {
+					_fmime_load_rest(l, fds[s], cqe->res);
+				} else {
+					_fmime_io_put(l->buf, l->size);
+					l->buf = NULL;
+				}
+				if((sqe = _fmime_uring_sqe(&r))) {
+					sqe->opcode = IORING_OP_CLOSE;
+					sqe->fd = fds[s];
+					sqe->user_data = FMIME_URING_CLOSE | s;
+					closing++;
+				} else {
+					close(fds[s]);
+				}
+			}
+			l->next = batch;
+			batch = l;
+			if(++nbatch == FMIME_LOAD_BATCH) {
+				_fmime_load_push(ld, pool, &batch, &nbatch);
+			}
+			slots[s] = NULL;
+			free_slots[nfree++] = s;
+			active--;
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+		_fmime_load_push(ld, pool, &batch, &nbatch);
+	}
+	_fmime_uring_exit(&r);
+
+	// only after a failed io_uring_enter: the files still in the ring are
+	// reported as unreadable, and their buffers leaked as the kernel may
+	// still be writing to them
+	for(s=0;s<FMIME_URING_DEPTH;s++) {
+		if(slots[s]) {
+			slots[s]->buf = NULL;
+			slots[s]->next = batch;
+			batch = slots[s];
+			nbatch++;
+		}
+	}
+	for(;next < n;next++) {
+		struct _fmime_load *l = g_new0(struct _fmime_load, 1);
+		l->idx = next;
+		l->next = batch;
+		batch = l;
+		nbatch++;
+	}
+	_fmime_load_push(ld, pool, &batch, &nbatch);
+	return 0;
+}
+#endif
+
+void fmime_parse_files(const char * const *paths, size_t n, int threads, fmime_file_cb cb, void *data)
+{
+	struct _fmime_loader ld;
+	GThreadPool *pool;
+	size_t i;
+
+	if(threads <= 0) {
+		threads = g_get_num_processors();
+	}
+	ld.paths = paths;
+	ld.cb = cb;
+	ld.data = data;
+	ld.queued = 0;
+	g_mutex_init(&ld.lock);
+	g_cond_init(&ld.cond);
+
+#ifdef FMIME_URING
+	pool = g_thread_pool_new(_fmime_load_parse_list, &ld, threads, TRUE, NULL);
+	if(!_fmime_load_uring(&ld, pool, n)) {
+		n = 0;
+	}
+	if(pool) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+#endif
+	pool = n ? g_thread_pool_new(_fmime_load_worker, &ld, threads, TRUE, NULL) : NULL;
+	for(i=0;i<n;i++) {
+		if(pool) {
+			g_thread_pool_push(pool, GSIZE_TO_POINTER(i + 1), NULL);
+		} else {
+			_fmime_load_worker(GSIZE_TO_POINTER(i + 1), &ld);
+		}
+	}
+	if(pool) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+
+	g_cond_clear(&ld.cond);
+	g_mutex_clear(&ld.lock);
+}
+
+#define FMIME_ATOK_END     0
+#define FMIME_ATOK_WORD    1 // atom, dot-atom, quoted-string or domain literal
+#define FMIME_ATOK_SPECIAL 2 // one of <>@,:;
+#define FMIME_ATOK_COMMENT 3 // ptr/len exclude the parentheses
+
+struct _fmime_atok {
+	int type;
+	const char *ptr;
+	size_t len;
+};
+
+// Skips a quoted run ending in `close`, honoring backslash escapes
+static const char *_fmime_addr_skip_quoted(const char *p, const char *end, char close)
+{
+	for(;p < end && *p != close;p++) {
+		if(*p == '\\' && p + 1 < end) {
+			p++;
+		}
+	}
+	return p;
+}
+
+// Address lexer, returns where the next token starts
+static const char *_fmime_addr_token(const char *p, const char *end, struct _fmime_atok *t)
+{
+	const char *s;
+
+	while(p < end && isspace((unsigned char)*p)) {
+		p++;
+	}
+	if(p == end) {
+		t->type = FMIME_ATOK_END;
+		return p;
+	}
+	s = p;
+	switch(*p) {
+		case '(': {
+			int depth = 1;
+			for(p++;p < end && depth;p++) {
+				if(*p == '\\' && p + 1 < end) {
+					p++;
+				} else if(*p == '(') {
+					depth++;
+				} else if(*p == ')') {
+					depth--;
+				}
+			}
+			t->type = FMIME_ATOK_COMMENT;
+			t->ptr = s + 1;
+			t->len = (p - s) - (depth ? 1 : 2);
+			return p;
+		}
+		case '"':
+		case '[':
+			p = _fmime_addr_skip_quoted(p + 1, end, *p == '"' ? '"' : ']');
+			p = p < end ? p + 1 : p;
+			break;
+		case '<':
+		case '>':
+		case '@':
+		case ',':
+		case ':':
+		case ';':
+			t->type = FMIME_ATOK_SPECIAL;
+			t->ptr = p;
+			t->len = 1;
+			return p + 1;
+		default:
+			while(p < end && !isspace((unsigned char)*p) && !strchr("<>@,:;()\"[", *p)) {
+				p++;
+			}
+			break;
+	}
+	t->type = FMIME_ATOK_WORD;
+	t->ptr = s;
+	t->len = p - s;
+	return p;
+}
+
+// The mailbox being assembled by fmime_parse_addresses
+struct _fmime_mbox {
+	const char *span;     // words outside <>, a display name or a bare addr-spec
+	const char *span_end;
+	int span_words;
+	const char *addr;     // addr-spec inside <>
+	const char *addr_end;
+	const char *at;       // last @ of the addr-spec
+	const char *comment;
+	size_t comment_len;
+	int angle;            // 1 inside <>, 2 after it
+};
+
+static void _fmime_slice_set(fmime_slice_t *s, const char *from, const char *to)
+{
+	s->ptr = from;
+	s->len = to - from;
+}
+
+// Completes a mailbox into out[*n] if it has an address, returns 1 if so
+static int _fmime_mbox_emit(struct _fmime_mbox *m, const fmime_slice_t *group, fmime_address_t *out, int max, int *n)
+{
+	const char *addr = m->angle ? m->addr : m->span;
+	const char *addr_end = m->angle ? m->addr_end : m->span_end;
+	fmime_address_t a;
+
+	if(!addr || addr == addr_end) {
+		memset(m, 0, sizeof(*m));
+		return 0;
+	}
+	memset(&a, 0, sizeof(a));
+	if(m->angle && m->span) {
+		_fmime_slice_set(&a.display, m->span, m->span_end);
+		// a lone quoted-string, drop the quotes
+		if(m->span_words == 1 && a.display.len >= 2 && a.display.ptr[0] == '"' && a.display.ptr[a.display.len-1] == '"') {
+			a.display.ptr++;
+			a.display.len -= 2;
+		}
+	} else if(m->comment) {
+		// old style: user@host (Full Name)
+		a.display.ptr = m->comment;
+		a.display.len = m->comment_len;
+	}
+	if(m->at && m->at > addr && m->at < addr_end) {
+		_fmime_slice_set(&a.local, addr, m->at);
+		_fmime_slice_set(&a.domain, m->at + 1, addr_end);
+	} else {
+		_fmime_slice_set(&a.local, addr, addr_end);
+	}
+	a.group = *group;
+
+	if(*n < max) {
+		out[*n] = a;
+	}
+	(*n)++;
+	memset(m, 0, sizeof(*m));
+	return 1;
+}
+
+int fmime_parse_addresses(const char *value, size_t len, fmime_address_t *out, int max)
+{
+	const char *p = value;
+	const char *end = value + len;
+	struct _fmime_mbox m;
+	fmime_slice_t group = { NULL, 0 };
+	struct _fmime_atok t;
+	int n = 0;
+
+	memset(&m, 0, sizeof(m));
+	for(;;) {
+		p = _fmime_addr_token(p, end, &t);
+		if(t.type == FMIME_ATOK_END) {
+			break;
+		}
+		if(t.type == FMIME_ATOK_COMMENT) {
+			if(!m.comment) {
+				m.comment = t.ptr;
+				m.comment_len = t.len;
+			}
+			continue;
+		}
+
+		if(m.angle == 1) {
+			// inside <>: addr-spec, or an obsolete route <@a,@b:user@host>
+			if(t.type == FMIME_ATOK_SPECIAL && *t.ptr == '>') {
+				m.angle = 2;
+			} else if(t.type == FMIME_ATOK_SPECIAL && *t.ptr == ':') {
+				m.addr = m.addr_end = NULL;
+				m.at = NULL;
+			} else if(t.type == FMIME_ATOK_SPECIAL && *t.ptr == ',' && !m.at) {
+				// route separator
+			} else {
+				if(!m.addr) {
+					m.addr = t.ptr;
+				}
+				m.addr_end = t.ptr + t.len;
+				if(t.type == FMIME_ATOK_SPECIAL && *t.ptr == '@') {
+					m.at = t.ptr;
+				}
+			}
+			continue;
+		}
+
+		if(t.type == FMIME_ATOK_SPECIAL) {
+			switch(*t.ptr) {
+				case '<':
+					m.angle = 1;
+					continue;
+				case ',':
+					_fmime_mbox_emit(&m, &group, out, max, &n);
+					continue;
+				case ':':
+					if(!group.ptr && !m.at && m.angle != 2) {
+						// group: display-name ":" [mailbox-list] ";"
+						if(m.span) {
+							_fmime_slice_set(&group, m.span, m.span_end);
+						} else {
+							group.ptr = t.ptr;
+							group.len = 0;
+						}
+						memset(&m, 0, sizeof(m));
+					}
+					continue;
+				case ';':
+					_fmime_mbox_emit(&m, &group, out, max, &n);
+					group.ptr = NULL;
+					group.len = 0;
+					continue;
+				case '@':
+					m.at = t.ptr;
+					break;
+				default:
+					// stray '>'
+					continue;
+			}
+		}
+		if(m.angle == 2) {
+			// garbage after the angle-addr
+			continue;
+		}
+		if(!m.span) {
+			m.span = t.ptr;
+		}
+		m.span_end = t.ptr + t.len;
+		m.span_words++;
+	}
+	_fmime_mbox_emit(&m, &group, out, max, &n);
+	return n;
+}
+
+int fmime_get_addresses(fmime_message_t *msg, const char *header, fmime_address_t *out, int max)
+{
+	const char *v = fmime_get_header(msg, header);
+
+	if(!v) {
+		return 0;
+	}
+	return fmime_parse_addresses(v, strlen(v), out, max);
+}
+
+// IMAP section-spec after the numbers
+#define FMIME_SECTION_BODY   0
+#define FMIME_SECTION_MIME   1
+#define FMIME_SECTION_HEADER 2
+#define FMIME_SECTION_TEXT   3
+
+// The message in a message/rfc822 part of msg, parsed on the first call
+// and freed with msg
+static fmime_message_t *_fmime_part_message(fmime_message_t *msg, fmime_part_t *part)
+{
+	if(!part->_message) {
+		fmime_parser_ctx_t *ctx = fmime_ctx_new();
+
+		// parsed the way msg was
+		ctx->standalone = 1;
+		ctx->flags = msg->_ctx->flags;
+		part->_message = _fmime_parse_memory(ctx, part->begin + part->body_off, part->len - part->body_off);
+		msg->_ctx->nested = g_list_prepend(msg->_ctx->nested, part->_message);
+	}
+	return part->_message;
+}
+
+// Walks the numbers of section, then reads the suffix into *spec. *out is
+// the last part, NULL if there's no number. Returns 0 if it's invalid.
+static int _fmime_section(fmime_message_t *msg, const char *section, fmime_part_t **out, int *spec)
+{
+	fmime_part_t *part = NULL, *body;
+	const char *p = section;
+	int levels = 0;
+
+	*out = NULL;
+	// one step down per number, the children are an array
+	while(isdigit((unsigned char)*p)) {
+		fmime_part_t **kids;
+		int count, n = 0;
+
+		if(part && fmime_part_is_type(part, "message", "rfc822")) {
+			// the numbers go on in the encapsulated message
+			if(++levels > FMIME_MAX_DEPTH) {
+				return 0;
+			}
+			msg = _fmime_part_message(msg, part);
+			part = NULL;
+		}
+		if(part) {
+			kids = part->children;
+			count = part->nchildren;
+		} else if(msg->root) {
+			kids = msg->root->children;
+			count = msg->root->nchildren;
+		} else {
+			body = _fmime_message_body(msg);
+			kids = &body;
+			count = 1;
+		}
+		if(*p == '0') {
+			// no leading zeros, and parts count from 1
+			return 0;
+		}
+		for(;isdigit((unsigned char)*p);p++) {
+			n = n * 10 + (*p - '0');
+			if(n > count) {
+				return 0;
+			}
+		}
+		part = kids[n - 1];
+		if(*p != '.') {
+			break;
+		}
+		p++;
+	}
+
+	*spec = FMIME_SECTION_BODY;
+	if(!*p) {
+		// "" and "1." aren't sections
+		*out = part;
+		return part && p[-1] != '.';
+	}
+	if(part && p[-1] != '.') {
+		return 0;
+	}
+	if(part && !g_ascii_strcasecmp(p, "MIME")) {
+		*spec = FMIME_SECTION_MIME;
+	} else if(!g_ascii_strcasecmp(p, "HEADER")) {
+		*spec = FMIME_SECTION_HEADER;
+	} else if(!g_ascii_strcasecmp(p, "TEXT")) {
+		*spec = FMIME_SECTION_TEXT;
+	} else {
+		return 0;
+	}
+	if(part && *spec != FMIME_SECTION_MIME) {
+		// header and text of the encapsulated message
+		if(!fmime_part_is_type(part, "message", "rfc822") || ++levels > FMIME_MAX_DEPTH) {
+			return 0;
+		}
+		_fmime_part_message(msg, part);
+	}
+	*out = part;
+	return 1;
+}
+
+fmime_part_t *fmime_part_by_section(fmime_message_t *msg, const char *section)
+{
+	fmime_part_t *part;
+	int spec;
+
+	if(!section || !_fmime_section(msg, section, &part, &spec)) {
+		return NULL;
+	}
+	return part;
+}
+
+int fmime_get_section(fmime_message_t *msg, const char *section, fmime_slice_t *out)
+{
+	fmime_part_t *part;
+	int spec;
+
+	if(!*section) {
+		out->ptr = msg->begin;
+		out->len = msg->len;
+		return 1;
+	}
+	if(!_fmime_section(msg, section, &part, &spec)) {
+		return 0;
+	}
+	if(part && spec != FMIME_SECTION_MIME) {
+		if(spec == FMIME_SECTION_BODY) {
+			out->ptr = part->begin + part->body_off;
+			out->len = part->len - part->body_off;
+			return 1;
+		}
+		msg = part->_message;
+		part = NULL;
+	}
+	if(part) {
+		out->ptr = part->begin;
+		out->len = part->body_off;
+	} else if(spec == FMIME_SECTION_HEADER) {
+		out->ptr = msg->begin;
+		out->len = msg->body_off;
+	} else {
+		out->ptr = msg->begin + msg->body_off;
+		out->len = msg->len - msg->body_off;
+	}
+	return 1;
+}
+
+// IMAP string: quoted, or a literal when it has 8 bit bytes. Folding line
+// breaks are dropped, NULL is NIL.
+static void _fmime_imap_string(GString *out, const char *s, size_t len)
+{
+	size_t i, n = 0;
+	int literal = 0;
+
+	if(!s) {
+		g_string_append(out, "NIL");
+		return;
+	}
+	for(i=0;i<len;i++) {
+		if(s[i] == '\r' || s[i] == '\n') {
+			continue;
+		}
+		if(s[i] & 0x80) {
+			literal = 1;
+		}
+		n++;
+	}
+	if(literal) {
+		g_string_append_printf(out, "{%zu}\r\n", n);
+	} else {
+		g_string_append_c(out, '"');
+	}
+	for(i=0;i<len;i++) {
+		if(s[i] == '\r' || s[i] == '\n') {
+			continue;
+		}
+		if(!literal && (s[i] == '"' || s[i] == '\\')) {
+			g_string_append_c(out, '\\');
+		}
+		g_string_append_c(out, s[i]);
+	}
+	if(!literal) {
+		g_string_append_c(out, '"');
+	}
+}
+
+static void _fmime_imap_cstring(GString *out, const char *s)
+{
+	_fmime_imap_string(out, s, s ? strlen(s) : 0);
+}
+
+// First word of a header value, like the transfer encoding
+static void _fmime_imap_token(GString *out, const char *value, const char *def)
+{
+	const char *t, *e;
+
+	if(!value) {
+		_fmime_imap_cstring(out, def);
+		return;
+	}
+	for(t=value;*t && isspace((unsigned char)*t);t++) {
+		// do nothing
+	}
+	for(e=t;*e && *e != ';' && *e != '(' && !isspace((unsigned char)*e);e++) {
+		// do nothing
+	}
+	if(e == t) {
+		_fmime_imap_cstring(out, def);
+	} else {
+		_fmime_imap_string(out, t, e - t);
+	}
+}
+
+// ("attribute" "value" ...) as they are in the header, RFC 2231 ones
+// included, quotes removed. def, or NIL, when there are none.
+static void _fmime_imap_params(GString *out, const char *value, const char *def)
+{
+	const char *p = value;
+	fmime_slice_t attr;
+	struct _fmime_param_value v;
+	GString *tmp = NULL;
+	int n = 0;
+
+	while((p = _fmime_param_next(p, &attr, &v))) {
+		if(!v.ptr || !attr.len) {
+			continue;
+		}
+		g_string_append(out, n++ ? " " : "(");
+		_fmime_imap_string(out, attr.ptr, attr.len);
+		g_string_append_c(out, ' ');
+		if(v.escaped) {
+			if(!tmp) {
+				tmp = g_string_sized_new(v.len);
+			}
+			g_string_truncate(tmp, 0);
+			_fmime_param_append(tmp, &v, v.ptr);
+			_fmime_imap_string(out, tmp->str, tmp->len);
+		} else {
+			_fmime_imap_string(out, v.ptr, v.len);
+		}
+	}
+	if(n) {
+		g_string_append_c(out, ')');
+	} else {
+		g_string_append(out, def ? def : "NIL");
+	}
+	if(tmp) {
+		g_string_free(tmp, TRUE);
+	}
+}
+
+static void _fmime_imap_disposition(GString *out, const char *value)
+{
+	if(!value) {
+		g_string_append(out, "NIL");
+		return;
+	}
+	g_string_append_c(out, '(');
+	_fmime_imap_token(out, value, "attachment");
+	g_string_append_c(out, ' ');
+	_fmime_imap_params(out, value, NULL);
+	g_string_append_c(out, ')');
+}
+
+// A single language is a string, a comma separated list a list
+static void _fmime_imap_language(GString *out, const char *value)
+{
+	const char *p, *t, *e;
+	int n = 0;
+
+	if(!value) {
+		g_string_append(out, "NIL");
+		return;
+	}
+	if(!strchr(value, ',')) {
+		_fmime_imap_token(out, value, NULL);
+		return;
+	}
+	for(p=value;*p;) {
+		for(t=p;*t && (*t == ',' || isspace((unsigned char)*t));t++) {
+			// do nothing
+		}
+		for(e=t;*e && *e != ',' && !isspace((unsigned char)*e);e++) {
+			// do nothing
+		}
+		if(e > t) {
+			g_string_append(out, n++ ? " " : "(");
+			_fmime_imap_string(out, t, e - t);
+		}
+		p = e;
+	}
+	g_string_append(out, n ? ")" : "NIL");
+}
+
+static void _fmime_imap_addresses(GString *out, const char *value)
+{
+	fmime_address_t stack[32], *a = stack;
+	fmime_slice_t group = { NULL, 0 };
+	size_t len = value ? strlen(value) : 0;
+	int i, n;
+
+	if(!value || (n = fmime_parse_addresses(value, len, a, G_N_ELEMENTS(stack))) <= 0) {
+		g_string_append(out, "NIL");
+		return;
+	}
+	if(n > (int)G_N_ELEMENTS(stack)) {
+		a = g_new(fmime_address_t, n);
+		fmime_parse_addresses(value, len, a, n);
+	}
+	g_string_append_c(out, '(');
+	for(i=0;i<n;i++) {
+		if(a[i].group.ptr != group.ptr) {
+			if(group.ptr) {
+				g_string_append(out, "(NIL NIL NIL NIL)");
+			}
+			if(a[i].group.ptr) {
+				g_string_append(out, "(NIL NIL ");
+				_fmime_imap_string(out, a[i].group.ptr, a[i].group.len);
+				g_string_append(out, " NIL)");
+			}
+			group = a[i].group;
+		}
+		g_string_append_c(out, '(');
+		_fmime_imap_string(out, a[i].display.ptr, a[i].display.len);
+		g_string_append(out, " NIL ");
+		_fmime_imap_string(out, a[i].local.ptr, a[i].local.len);
+		g_string_append_c(out, ' ');
+		_fmime_imap_string(out, a[i].domain.ptr, a[i].domain.len);
+		g_string_append_c(out, ')');
+	}
+	if(group.ptr) {
+		g_string_append(out, "(NIL NIL NIL NIL)");
+	}
+	g_string_append_c(out, ')');
+	if(a != stack) {
+		g_free(a);
+	}
+}
+
+// Sender and Reply-To default to From, as RFC 3501 asks
+static void _fmime_imap_envelope(GString *out, const fmime_headers_t *headers)
+{
+	const char *from = _fmime_headers_value(headers, "From");
+	const char *sender = _fmime_headers_value(headers, "Sender");
+	const char *reply_to = _fmime_headers_value(headers, "Reply-To");
+
+	g_string_append_c(out, '(');
+	_fmime_imap_cstring(out, _fmime_headers_value(headers, "Date"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_cstring(out, _fmime_headers_value(headers, "Subject"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_addresses(out, from);
+	g_string_append_c(out, ' ');
+	_fmime_imap_addresses(out, sender ? sender : from);
+	g_string_append_c(out, ' ');
+	_fmime_imap_addresses(out, reply_to ? reply_to : from);
+	g_string_append_c(out, ' ');
+	_fmime_imap_addresses(out, _fmime_headers_value(headers, "To"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_addresses(out, _fmime_headers_value(headers, "Cc"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_addresses(out, _fmime_headers_value(headers, "Bcc"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_cstring(out, _fmime_headers_value(headers, "In-Reply-To"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_cstring(out, _fmime_headers_value(headers, "Message-ID"));
+	g_string_append_c(out, ')');
+}
+
+// body-fld-md5, body-fld-dsp, body-fld-lang and body-fld-loc; a multipart
+// has no md5
+static void _fmime_imap_extension(GString *out, const fmime_headers_t *headers, int md5)
+{
+	if(md5) {
+		g_string_append_c(out, ' ');
+		_fmime_imap_cstring(out, _fmime_headers_value(headers, "Content-MD5"));
+	}
+	g_string_append_c(out, ' ');
+	_fmime_imap_disposition(out, _fmime_headers_value(headers, "Content-Disposition"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_language(out, _fmime_headers_value(headers, "Content-Language"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_cstring(out, _fmime_headers_value(headers, "Content-Location"));
+}
+
+static void _fmime_imap_body(GString *out, fmime_message_t *msg, int depth);
+
+// A non multipart body. part is NULL for the body of a single part
+// message, it's only there to cache the line count.
+static void _fmime_imap_leaf(GString *out, const fmime_headers_t *headers, const char *body, size_t len,
+		fmime_part_t *part, int depth)
+{
+	const char *ct = _fmime_headers_value(headers, "Content-Type");
+	fmime_slice_t type, subtype;
+	int text, rfc822;
+
+	if(!ct || !_fmime_split_ctype(ct, &type, &subtype)) {
+		ct = NULL;
+		type.ptr = "text";
+		type.len = 4;
+		subtype.ptr = "plain";
+		subtype.len = 5;
+	}
+	text = _fmime_slice_eq(&type, "text", 4);
+	// deeper ones are a basic body, like multiparts are leaves there
+	rfc822 = _fmime_slice_eq(&type, "message", 7) && _fmime_slice_eq(&subtype, "rfc822", 6) &&
+		depth < FMIME_MAX_DEPTH;
+
+	g_string_append_c(out, '(');
+	_fmime_imap_string(out, type.ptr, type.len);
+	g_string_append_c(out, ' ');
+	_fmime_imap_string(out, subtype.ptr, subtype.len);
+	g_string_append_c(out, ' ');
+	_fmime_imap_params(out, ct, text ? "(\"charset\" \"us-ascii\")" : NULL);
+	g_string_append_c(out, ' ');
+	_fmime_imap_cstring(out, _fmime_headers_value(headers, "Content-ID"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_cstring(out, _fmime_headers_value(headers, "Content-Description"));
+	g_string_append_c(out, ' ');
+	_fmime_imap_token(out, _fmime_headers_value(headers, "Content-Transfer-Encoding"), "7bit");
+	g_string_append_printf(out, " %zu", len);
+	if(rfc822) {
+		// the encapsulated message is only parsed here
+		fmime_parser_ctx_t *ctx = fmime_ctx_new();
+		fmime_message_t *msg = fmime_ctx_parse_memory(ctx, body, len);
+
+		g_string_append_c(out, ' ');
+		_fmime_imap_envelope(out, msg->headers);
+		g_string_append_c(out, ' ');
+		_fmime_imap_body(out, msg, depth + 1);
+		fmime_ctx_free(ctx);
+	}
+	if(text || rfc822) {
+		size_t lines, size;
+
+		if(part) {
+			lines = fmime_part_get_lines(part);
+		} else {
+			_fmime_count_body(body, len, FMIME_CTE_IDENTITY, &lines, &size);
+		}
+		g_string_append_printf(out, " %zu", lines);
+	}
+	_fmime_imap_extension(out, headers, 1);
+	g_string_append_c(out, ')');
+}
+
+static void _fmime_imap_part(GString *out, fmime_part_t *part, int depth)
+{
+	fmime_slice_t type, subtype;
+	int i;
+
+	fmime_part_get_content_type(part, &type, &subtype);
+	if(!_fmime_slice_eq(&type, "multipart", 9)) {
+		_fmime_imap_leaf(out, part->headers, part->begin + part->body_off, part->len - part->body_off, part, depth);
+		return;
+	}
+	g_string_append_c(out, '(');
+	for(i=0;i<part->nchildren;i++) {
+		_fmime_imap_part(out, part->children[i], depth);
+	}
+	if(!part->nchildren) {
+		// the grammar wants at least one, an empty text part stands in
+		_fmime_imap_leaf(out, NULL, "", 0, NULL, depth);
+	}
+	g_string_append_c(out, ' ');
+	_fmime_imap_string(out, subtype.ptr, subtype.len);
+	g_string_append_c(out, ' ');
+	_fmime_imap_params(out, fmime_part_get_header(part, "Content-Type"), NULL);
+	_fmime_imap_extension(out, part->headers, 0);
+	g_string_append_c(out, ')');
+}
+
+static void _fmime_imap_body(GString *out, fmime_message_t *msg, int depth)
+{
+	if(msg->root) {
+		_fmime_imap_part(out, msg->root, depth);
+	} else {
+		_fmime_imap_leaf(out, msg->headers, msg->begin + msg->body_off, msg->len - msg->body_off, NULL, depth);
+	}
+}
+
+const char *fmime_get_envelope(fmime_message_t *msg)
+{
+	if(!msg->_envelope) {
+		GString *out = g_string_sized_new(512);
+
+		_fmime_imap_envelope(out, msg->headers);
+		msg->_envelope = _fmime_arena_strndup(&msg->_ctx->arena, out->str, out->len);
+		g_string_free(out, TRUE);
+	}
+	return msg->_envelope;
+}
+
+const char *fmime_get_bodystructure(fmime_message_t *msg)
+{
+	if(!msg->_bodystructure) {
+		GString *out = g_string_sized_new(512);
+
+		_fmime_imap_body(out, msg, 0);
+		msg->_bodystructure = _fmime_arena_strndup(&msg->_ctx->arena, out->str, out->len);
+		g_string_free(out, TRUE);
+	}
+	return msg->_bodystructure;
+}
+
+// One Aho-Corasick automaton of fmime_rules_t, for the rules of a header
+// name, plus the ones for any header
+struct _fmime_ac {
+	char *name;         // NULL for the headers without rules of their own
+	guint hash;
+	int nstates;
+	gint32 *next;       // nstates * nclasses, a full DFA, 0 is the root
+	int *out_off;       // rules matched on entering a state
+	int *out_len;
+	int *out;
+	int nfirst;         // prefilter start bytes, 0 when there are too many
+	guint8 first[FMIME_RULES_PREFILTER];
+};
+
+struct fmime_rules {
+	int count;
+	int alloc;
+	char **headers;     // NULL for any header
+	char **patterns;    // lower case
+	int compiled;
+	guint8 class[256];  // case folded byte classes, 0 for bytes in no pattern
+	int nclasses;
+	struct _fmime_ac *ac;
+	int nac;
+	struct _fmime_ac *any;
+};
+
+fmime_rules_t *fmime_rules_new(void)
+{
+	return g_new0(fmime_rules_t, 1);
+}
+
+int fmime_rules_add(fmime_rules_t *rules, const char *header, const char *pattern)
+{
+	if(rules->compiled || !pattern || !*pattern) {
+		return -1;
+	}
+	if(rules->count == rules->alloc) {
+		rules->alloc = rules->alloc ? rules->alloc * 2 : 16;
+		rules->headers = g_renew(char *, rules->headers, rules->alloc);
+		rules->patterns = g_renew(char *, rules->patterns, rules->alloc);
+	}
+	rules->headers[rules->count] = header && strcmp(header, "*") ? g_strdup(header) : NULL;
+	rules->patterns[rules->count] = g_ascii_strdown(pattern, -1);
+	return rules->count++;
+}
+
+// Whether rule i applies to the automaton for header name, NULL for any
+static int _fmime_rule_in(const fmime_rules_t *rules, int i, const char *name)
+{
+	return !rules->headers[i] || (name && !g_ascii_strcasecmp(rules->headers[i], name));
+}
+
+// Adds a state to the trie, with no transitions yet
+static int _fmime_ac_state(struct _fmime_ac *ac, int nclasses, int *alloc, int **own)
+{
+	if(ac->nstates == *alloc) {
+		*alloc *= 2;
+		ac->next = g_renew(gint32, ac->next, *alloc * nclasses);
+		*own = g_renew(int, *own, *alloc);
+	}
+	memset(ac->next + ac->nstates * nclasses, 0xff, nclasses * sizeof(gint32));
+	(*own)[ac->nstates] = -1;
+	return ac->nstates++;
+}
+
+// Builds the trie of the rules for name, then turns it into a DFA in
+// breadth first order, each state getting the outputs of its fail state
+static void _fmime_ac_build(const fmime_rules_t *rules, struct _fmime_ac *ac, const char *name)
+{
+	int nc = rules->nclasses, alloc = 64, i, k, c, head, tail;
+	int *own, *link, *fail, *queue;
+	GArray *out;
+	guint8 seen[256];
+
+	ac->name = name ? g_strdup(name) : NULL;
+	ac->hash = name ? _fmime_hname_hash(name, strlen(name)) : 0;
+	ac->next = g_new(gint32, alloc * nc);
+	own = g_new(int, alloc);
+	_fmime_ac_state(ac, nc, &alloc, &own);
+	memset(seen, 0, sizeof(seen));
+
+	// own is the last rule ending in a state, link chains the others
+	link = g_new(int, rules->count);
+	for(i=0;i<rules->count;i++) {
+		const guint8 *p = (const guint8 *)rules->patterns[i];
+		int s = 0;
+
+		if(!_fmime_rule_in(rules, i, name)) {
+			continue;
+		}
+		seen[*p] = 1;
+		for(;*p;p++) {
+			int t = ac->next[s * nc + rules->class[*p]];
+			if(t < 0) {
+				t = _fmime_ac_state(ac, nc, &alloc, &own);
+				ac->next[s * nc + rules->class[*p]] = t;
+			}
+			s = t;
+		}
+		link[i] = own[s];
+		own[s] = i;
+	}
+	// _fmime_ac_scan reads a fold as a space
+	if(seen[' ']) {
+		seen['\r'] = seen['\n'] = 1;
+	}
+
+	fail = g_new0(int, ac->nstates);
+	queue = g_new(int, ac->nstates);
+	ac->out_off = g_new(int, ac->nstates);
+	ac->out_len = g_new0(int, ac->nstates);
+	out = g_array_new(FALSE, FALSE, sizeof(int));
+	head = tail = 0;
+	queue[tail++] = 0;
+	while(head < tail) {
+		int s = queue[head++], r;
+
+		ac->out_off[s] = out->len;
+		for(r=own[s];r >= 0;r=link[r]) {
+			g_array_append_val(out, r);
+		}
+		// the fail state is shallower, its outputs are complete
+		for(k=0;s && k<ac->out_len[fail[s]];k++) {
+			r = g_array_index(out, int, ac->out_off[fail[s]] + k);
+			g_array_append_val(out, r);
+		}
+		ac->out_len[s] = out->len - ac->out_off[s];
+
+		for(c=0;c<nc;c++) {
+			gint32 *t = &ac->next[s * nc + c];
+			if(*t > 0) {
+				fail[*t] = s ? ac->next[fail[s] * nc + c] : 0;
+				queue[tail++] = *t;
+			} else if(*t < 0) {
+				*t = s ? ac->next[fail[s] * nc + c] : 0;
+			}
+		}
+	}
+	ac->out = (int *)g_array_free(out, FALSE);
+	g_free(fail);
+	g_free(queue);
+	g_free(link);
+	g_free(own);
+
+	// few distinct first bytes, the root can skip ahead with SSE2
+	for(c=0;c<256;c++) {
+		if(seen[c]) {
+			if(ac->nfirst == FMIME_RULES_PREFILTER) {
+				ac->nfirst = 0;
+				break;
+			}
+			ac->first[ac->nfirst++] = c;
+		}
+	}
+}
+
+int fmime_rules_compile(fmime_rules_t *rules)
+{
+	int i, j, any = 0;
+
+	if(rules->compiled) {
+		return -1;
+	}
+	rules->compiled = 1;
+
+	// one class per distinct byte of the patterns, upper case with lower
+	rules->nclasses = 1;
+	for(i=0;i<rules->count;i++) {
+		const guint8 *p;
+		for(p=(const guint8 *)rules->patterns[i];*p;p++) {
+			if(!rules->class[*p]) {
+				rules->class[*p] = rules->nclasses++;
+				rules->class[(guint8)g_ascii_toupper(*p)] = rules->class[*p];
+			}
+		}
+		any |= !rules->headers[i];
+	}
+
+	// an automaton per header name, with the rules for any header in each
+	rules->ac = g_new0(struct _fmime_ac, rules->count + 1);
+	for(i=0;i<rules->count;i++) {
+		if(!rules->headers[i]) {
+			continue;
+		}
+		for(j=0;j<rules->nac && g_ascii_strcasecmp(rules->ac[j].name, rules->headers[i]);j++) {
+			// do nothing
+		}
+		if(j == rules->nac) {
+			_fmime_ac_build(rules, &rules->ac[rules->nac++], rules->headers[i]);
+		}
+	}
+	if(any) {
+		rules->any = &rules->ac[rules->nac];
+		_fmime_ac_build(rules, rules->any, NULL);
+	}
+	return 0;
+}
+
+int fmime_rules_words(const fmime_rules_t *rules)
+{
+	return (rules->count + 63) / 64;
+}
+
+// Index of the first byte at or after i that starts a pattern, or len
+static size_t _fmime_ac_skip(const struct _fmime_ac *ac, const guint8 *s, size_t i, size_t len)
+{
+	int k;
+
+#ifdef __SSE2__
+	const __m128i lower = _mm_set1_epi8(0x20);
+
+	for(;i + 16 <= len;i+=16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		// or'ing 0x20 folds letters, only compare letters that way
+		__m128i vl = _mm_or_si128(v, lower);
+		__m128i hit = _mm_setzero_si128();
+		int mask;
+
+		for(k=0;k<ac->nfirst;k++) {
+			guint8 f = ac->first[k];
+			__m128i p = _mm_set1_epi8(f);
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(f >= 'a' && f <= 'z' ? vl : v, p));
+		}
+		if((mask = _mm_movemask_epi8(hit))) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for(;i<len;i++) {
+		for(k=0;k<ac->nfirst;k++) {
+			if(g_ascii_tolower(s[i]) == ac->first[k]) {
+				return i;
+			}
+		}
+	}
+	return len;
+}
+
+static void _fmime_ac_scan(const fmime_rules_t *rules, const struct _fmime_ac *ac, const char *value,
+		guint64 *matched)
+{
+	const guint8 *s = (const guint8 *)value;
+	size_t i, len = strlen(value);
+	gint32 state = 0;
+	int k;
+
+	for(i=0;i<len;i++) {
+		guint8 c;
+
+		if(!state && ac->nfirst && (i = _fmime_ac_skip(ac, s, i, len)) == len) {
+			break;
+		}
+		if((c = s[i]) == '\r' || c == '\n') {
+			// unfolded (RFC 5322 2.2.3), the line break and the white
+			// space after it are a single space
+			while(i + 1 < len && (s[i+1] == '\r' || s[i+1] == '\n' || s[i+1] == ' ' || s[i+1] == '\t')) {
+				i++;
+			}
+			c = ' ';
+		}
+		state = ac->next[state * rules->nclasses + rules->class[c]];
+		for(k=0;k<ac->out_len[state];k++) {
+			int r = ac->out[ac->out_off[state] + k];
+			matched[r / 64] |= G_GUINT64_CONSTANT(1) << (r % 64);
+		}
+	}
+}
+
+int fmime_rules_match(const fmime_rules_t *rules, fmime_message_t *msg, guint64 *matched)
+{
+	const fmime_headers_t *headers = msg->headers;
+	int words = fmime_rules_words(rules);
+	int i, j, n = 0;
+
+	if(!rules->compiled) {
+		return -1;
+	}
+	memset(matched, 0, words * sizeof(guint64));
+	for(i=0;headers && i<headers->count;i++) {
+		const struct _fmime_hfield *f = &headers->fields[i];
+		const struct _fmime_ac *ac = rules->any;
+		const GList *l;
+
+		for(j=0;j<rules->nac;j++) {
+			if(rules->ac[j].hash == f->hash && !g_ascii_strcasecmp(rules->ac[j].name, f->name)) {
+				ac = &rules->ac[j];
+				break;
+			}
+		}
+		for(l=ac ? f->first : NULL;l;l=l->next) {
+			_fmime_ac_scan(rules, ac, l->data, matched);
+		}
+	}
+	for(i=0;i<words;i++) {
+		n += __builtin_popcountll(matched[i]);
+	}
+	return n;
+}
+
+void fmime_rules_free(fmime_rules_t *rules)
+{
+	int i;
+
+	if(!rules) {
+		return;
+	}
+	for(i=0;i<rules->nac + (rules->any != NULL);i++) {
+		struct _fmime_ac *ac = &rules->ac[i];
+		g_free(ac->name);
+		g_free(ac->next);
+		g_free(ac->out_off);
+		g_free(ac->out_len);
+		g_free(ac->out);
+	}
+	g_free(rules->ac);
+	for(i=0;i<rules->count;i++) {
+		g_free(rules->headers[i]);
+		g_free(rules->patterns[i]);
+	}
+	g_free(rules->headers);
+	g_free(rules->patterns);
+	g_free(rules);
+}
+
+// A change recorded by fmime_edit_t: the original bytes [off, end) are
+// dropped and len bytes of the pool inserted in their place
+struct _fmime_edit_op {
+	size_t off;
+	size_t end;
+	size_t ins;
+	size_t len;
+	int rank;  // order of ops at the same offset
+};
+
+// A header line added by fmime_edit_t, in the pool
+struct _fmime_edit_hdr {
+	char *name;
+	size_t off;
+	size_t len;
+	int where;  // FMIME_EDIT_*
+};
+
+#define FMIME_EDIT_TOP     0
+#define FMIME_EDIT_BOTTOM  1
+#define FMIME_EDIT_REPLACE 2
+#define FMIME_EDIT_REMOVE  3
+
+struct fmime_edit {
+	fmime_message_t *msg;
+	const char *eol;
+	GString *pool;
+	GArray *headers;  // struct _fmime_edit_hdr, in call order
+	GArray *parts;    // removed part indices
+	GArray *iov;
+};
+
+fmime_edit_t *fmime_edit_new(fmime_message_t *msg)
+{
+	fmime_edit_t *edit = g_new0(fmime_edit_t, 1);
+	const char *nl = memchr(msg->begin, '\n', msg->len);
+
+	edit->msg = msg;
+	// new lines end like the ones already there
+	edit->eol = nl && nl > msg->begin && nl[-1] == '\r' ? "\r\n" : "\n";
+	// starts with a line break, for a header whose last line has none
+	edit->pool = g_string_new(edit->eol);
+	edit->headers = g_array_new(FALSE, FALSE, sizeof(struct _fmime_edit_hdr));
+	edit->parts = g_array_new(FALSE, FALSE, sizeof(int));
+	edit->iov = g_array_new(FALSE, FALSE, sizeof(struct iovec));
+	return edit;
+}
+
+static void _fmime_edit_header(fmime_edit_t *edit, const char *name, const char *value, int where)
+{
+	struct _fmime_edit_hdr h;
+	guint i;
+
+	// a removal or replacement also drops the lines added before it
+	if(where >= FMIME_EDIT_REPLACE) {
+		for(i=0;i<edit->headers->len;i++) {
+			struct _fmime_edit_hdr *o = &g_array_index(edit->headers, struct _fmime_edit_hdr, i);
+			if(o->where != FMIME_EDIT_REMOVE && !g_ascii_strcasecmp(o->name, name)) {
+				o->where = FMIME_EDIT_REMOVE;
+			}
+		}
+	}
+	h.name = g_strdup(name);
+	h.where = where;
+	h.off = edit->pool->len;
+	if(value) {
+		g_string_append_printf(edit->pool, "%s: %s%s", name, value, edit->eol);
+	}
+	h.len = edit->pool->len - h.off;
+	g_array_append_val(edit->headers, h);
+}
+
+void fmime_edit_prepend_header(fmime_edit_t *edit, const char *name, const char *value)
+{
+	_fmime_edit_header(edit, name, value, FMIME_EDIT_TOP);
+}
+
+void fmime_edit_append_header(fmime_edit_t *edit, const char *name, const char *value)
+{
+	_fmime_edit_header(edit, name, value, FMIME_EDIT_BOTTOM);
+}
+
+void fmime_edit_replace_header(fmime_edit_t *edit, const char *name, const char *value)
+{
+	_fmime_edit_header(edit, name, value, FMIME_EDIT_REPLACE);
+}
+
+void fmime_edit_remove_header(fmime_edit_t *edit, const char *name)
+{
+	_fmime_edit_header(edit, name, NULL, FMIME_EDIT_REMOVE);
+}
+
+int fmime_edit_remove_part(fmime_edit_t *edit, fmime_part_t *part)
+{
+	fmime_message_t *msg = edit->msg;
+
+	if(part < msg->parts || part >= msg->parts + msg->nparts || part->parent < 0) {
+		return -1;
+	}
+	g_array_append_val(edit->parts, part->index);
+	return 0;
+}
+
+static void _fmime_edit_op(GArray *ops, size_t off, size_t end, size_t ins, size_t len, int rank)
+{
+	struct _fmime_edit_op op = { off, end, ins, len, rank };
+
+	g_array_append_val(ops, op);
+}
+
+static int _fmime_edit_op_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct _fmime_edit_op *x = a, *y = b;
+
+	if(x->off != y->off) {
+		return x->off < y->off ? -1 : 1;
+	}
+	return x->rank - y->rank;
+}
+
+// Index of the last removal or replacement of the header name, or -1
+static int _fmime_edit_last(const fmime_edit_t *edit, const char *name, size_t len)
+{
+	int i;
+
+	for(i=edit->headers->len-1;i >= 0;i--) {
+		const struct _fmime_edit_hdr *h = &g_array_index(edit->headers, struct _fmime_edit_hdr, i);
+		if(h->where >= FMIME_EDIT_REPLACE && !g_ascii_strncasecmp(h->name, name, len) && !h->name[len]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// The bytes a removed part takes: from its delimiter line to the one of
+// the next part, so the line break before that stays with it
+static void _fmime_edit_part_span(const fmime_message_t *msg, const fmime_part_t *part, size_t *off, size_t *end)
+{
+	const char *b = msg->begin, *p = part->begin, *e = part->begin + part->len;
+
+	// back over the line break ending the delimiter, then over the line
+	for(p--;p > b && p[-1] != '\n';p--) {
+		// do nothing
+	}
+	if(e < b + msg->len && *e == '\r') {
+		e++;
+	}
+	if(e < b + msg->len && *e == '\n') {
+		e++;
+	}
+	*off = p - b;
+	*end = e - b;
+}
+
+static void _fmime_edit_iov(GArray *iov, const char *base, size_t len)
+{
+	struct iovec *last = iov->len ? &g_array_index(iov, struct iovec, iov->len - 1) : NULL;
+	struct iovec v;
+
+	if(!len) {
+		return;
+	}
+	if(last && (const char *)last->iov_base + last->iov_len == base) {
+		last->iov_len += len;
+		return;
+	}
+	v.iov_base = (void *)base;
+	v.iov_len = len;
+	g_array_append_val(iov, v);
+}
+
+const struct iovec *fmime_edit_iovec(fmime_edit_t *edit, int *count, size_t *size)
+{
+	const fmime_message_t *msg = edit->msg;
+	const char *buf = msg->begin;
+	GArray *ops = g_array_new(FALSE, FALSE, sizeof(struct _fmime_edit_op));
+	struct _fmime_hline h;
+	size_t off, next, body = msg->len, top = msg->len, bottom, cur, total = 0;
+	// replacements already put in place of the original field
+	char *done = g_new0(char, edit->headers->len + 1);
+	guint i;
+	int e, kept = 0, open;
+
+	// the fields of the original header, each changed one is dropped and
+	// a replacement goes in place of its first occurrence
+	for(off=0;(next = _fmime_next_header(buf, msg->len, off, &h, &body));off=next) {
+		const struct _fmime_edit_hdr *r;
+		size_t start = h.name - buf;
+
+		if(top == msg->len) {
+			top = start;
+		}
+		if((kept = (e = _fmime_edit_last(edit, h.name, h.name_len)) < 0)) {
+			continue;
+		}
+		r = &g_array_index(edit->headers, struct _fmime_edit_hdr, e);
+		if(r->where == FMIME_EDIT_REPLACE && !done[e]) {
+			_fmime_edit_op(ops, start, next, r->off, r->len, 0);
+			done[e] = 1;
+		} else {
+			_fmime_edit_op(ops, start, next, 0, 0, 0);
+		}
+	}
+
+	// the end of the header, before the empty line if there's one
+	bottom = body;
+	if(bottom && buf[bottom-1] == '\n' && (bottom == 1 || buf[bottom-2] == '\n')) {
+		bottom--;
+	} else if(bottom > 1 && buf[bottom-1] == '\n' && buf[bottom-2] == '\r' && (bottom == 2 || buf[bottom-3] == '\n')) {
+		bottom -= 2;
+	}
+	if(top > bottom) {
+		top = bottom;
+	}
+	// a message that is only a header may end without a line break, the
+	// lines appended after its last field need one
+	open = kept && bottom == msg->len && buf[bottom-1] != '\n';
+
+	// prepended lines go above the earlier ones, appended ones below,
+	// replacements for missing headers with them
+	for(i=0;i<edit->headers->len;i++) {
+		const struct _fmime_edit_hdr *a = &g_array_index(edit->headers, struct _fmime_edit_hdr, i);
+
+		if(a->where == FMIME_EDIT_TOP) {
+			_fmime_edit_op(ops, top, top, a->off, a->len, -(int)i - 1);
+		} else if(a->where == FMIME_EDIT_BOTTOM || (a->where == FMIME_EDIT_REPLACE && !done[i])) {
+			if(open) {
+				_fmime_edit_op(ops, bottom, bottom, 0, strlen(edit->eol), 0);
+				open = 0;
+			}
+			_fmime_edit_op(ops, bottom, bottom, a->off, a->len, i + 1);
+		}
+	}
+	g_free(done);
+
+	for(i=0;i<edit->parts->len;i++) {
+		_fmime_edit_part_span(msg, &msg->parts[g_array_index(edit->parts, int, i)], &off, &next);
+		_fmime_edit_op(ops, off, next, 0, 0, 0);
+	}
+
+	g_array_sort(ops, _fmime_edit_op_cmp);
+	g_array_set_size(edit->iov, 0);
+	for(i=0,cur=0;i<ops->len;i++) {
+		const struct _fmime_edit_op *op = &g_array_index(ops, struct _fmime_edit_op, i);
+
+		if(op->off > cur) {
+			_fmime_edit_iov(edit->iov, buf + cur, op->off - cur);
+			total += op->off - cur;
+			cur = op->off;
+		}
+		_fmime_edit_iov(edit->iov, edit->pool->str + op->ins, op->len);
+		total += op->len;
+		if(op->end > cur) {
+			cur = op->end;
+		}
+	}
+	_fmime_edit_iov(edit->iov, buf + cur, msg->len - cur);
+	total += msg->len - cur;
+	g_array_free(ops, TRUE);
+
+	if(count) {
+		*count = edit->iov->len;
+	}
+	if(size) {
+		*size = total;
+	}
+	return (const struct iovec *)edit->iov->data;
+}
+
+gssize fmime_edit_write(fmime_edit_t *edit, int fd)
+{
+	struct iovec *iov;
+	size_t size;
+	int count, i = 0;
+
+	fmime_edit_iovec(edit, &count, &size);
+	iov = (struct iovec *)edit->iov->data;
+	while(i < count) {
+		ssize_t r = writev(fd, iov + i, MIN(count - i, IOV_MAX));
+
+		if(r < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		for(;i < count && (size_t)r >= iov[i].iov_len;r-=iov[i++].iov_len) {
+			// do nothing
+		}
+		if(i < count) {
+			// a vector written in part
+			iov[i].iov_base = (char *)iov[i].iov_base + r;
+			iov[i].iov_len -= r;
+		}
+	}
+	return size;
+}
+
+void fmime_edit_free(fmime_edit_t *edit)
+{
+	guint i;
+
+	if(!edit) {
+		return;
+	}
+	for(i=0;i<edit->headers->len;i++) {
+		g_free(g_array_index(edit->headers, struct _fmime_edit_hdr, i).name);
 	}
-	return boundary;
+	g_array_free(edit->headers, TRUE);
+	g_array_free(edit->parts, TRUE);
+	g_array_free(edit->iov, TRUE);
+	g_string_free(edit->pool, TRUE);
+	g_free(edit);
 }
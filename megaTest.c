@@ -25,11 +25,7 @@
 // bodyPrev ??? (disabled?)
 int CONF_INLINE_MAX_KBYTES=1024;
 
-int part_recurser(fmime_part_t *part, int level);
-
-int hasAttach(fmime_message_t *mmsg);
-
-int _hasAttach(fmime_part_t *part);
+void print_parts(fmime_message_t *msg);
 
 int main(int argc, char **argv)
 {
@@ -38,6 +34,10 @@ int main(int argc, char **argv)
 	const char *dir = "testmsgs/";
 	DIR *d;
 	struct dirent *dent;
+	fmime_attach_policy_t policy = {
+		1024 * CONF_INLINE_MAX_KBYTES,
+		NULL
+	};
 
 	if(argc == 2) {
 		dir = argv[1];
@@ -85,11 +85,10 @@ int main(int argc, char **argv)
 		fflush(NULL);
 
 		/*if(msg->root) {
-			part_recurser(msg->root, 0);
+			print_parts(msg);
 		}*/
-		printf("Has attach: %s\n", (hasAttach(msg)?"Yes":"No"));
-		if(msg->root)
-			part_recurser(msg->root, 0);
+		printf("Has attach: %s\n", (fmime_message_has_attachment(msg, &policy)?"Yes":"No"));
+		print_parts(msg);
 		fmime_free(msg);
 	};
 	closedir(d);
@@ -98,74 +97,16 @@ int main(int argc, char **argv)
 	return 0;
 }
 
-int part_recurser(fmime_part_t *part, int level)
+// The parts are stored in document order, so the tree prints in one pass
+void print_parts(fmime_message_t *msg)
 {
-	char pre[] = 
+	const char pre[] =
 	"--------------------------------------------------------------------------------";
-	if(level > (sizeof(pre) - 1)) {
-		level = sizeof(pre) - 1;
-	}
-	pre[level] = '\0';
-	printf("%s%s\n", pre, fmime_part_get_header(part, "Content-Type"));
-	if(part->children) {
-		GList *p;
-		for(p = part->children;p;p=g_list_next(p)) {
-			part_recurser(p->data, level+1);
-		}
-	}
-	return 0;
-}
-
-int hasAttach(fmime_message_t *mmsg)
-{
-	GList *root;
-	int ret = 0;
-
-	if(mmsg->root) {
-		root = mmsg->root->children;
-		for(;root;root = g_list_next(root)) {
-			if((ret = _hasAttach((fmime_part_t *)root->data))) {
-				break;
-			}
-		}
-	}
+	int i, n;
+	fmime_part_t *parts = fmime_message_parts(msg, &n);
 
-	return ret;
-}
-
-int _hasAttach(fmime_part_t *part)
-{
-	int ret = 0;
-
-	// size over CONF_INLINE_MAX_KBYTES
-	if(part->len > 1024 * CONF_INLINE_MAX_KBYTES) {
-		fprintf(stderr, "size > %li\n", 1024l * CONF_INLINE_MAX_KBYTES);
-		ret = 1;
-	} else if(fmime_part_is_type(part, "text", "*") || fmime_part_is_type(part, "message", "*")) {
-		// Type is text/*, message/*
-		char *filename;
-		if(fmime_part_is_disposition(part, "attachment")) {
-			fprintf(stderr, "disposition = attachment\n");
-			// is marked as attachment
-			ret = 1;
-		} else if((filename = fmime_part_get_filename(part))) {
-			fprintf(stderr, "has filename\n");
-			// has a filename
-			g_free(filename);
-			ret = 1;
-		}
-	} else {
-		if(!fmime_part_is_type(part, "multipart", "*")) {
-			fprintf(stderr, "content-type != text/* and content-type != multipart/* ret = 1\n");
-			ret = 1;
-		}
+	for(i=0;i<n;i++) {
+		int level = MIN(parts[i].depth, (int)sizeof(pre) - 1);
+		printf("%.*s%s\n", level, pre, fmime_part_get_header(&parts[i], "Content-Type"));
 	}
-	if(!ret && part->children) {
-		GList *child;
-		for(child = part->children; !ret && child; child = g_list_next(child)) {
-			ret = _hasAttach((fmime_part_t *)child->data);
-		}
-	}
-	return ret;
 }
-
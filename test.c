@@ -5,9 +5,111 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 extern char rfc[];
 
+// Pass/fail checks, run once before the demo output. main exits with 1
+// if one of them failed.
+static int failed;
+
+#define CHECK(cond) check(!!(cond), #cond, __LINE__)
+
+static void check(int ok, const char *what, int line)
+{
+	if(!ok) {
+		fprintf(stderr, "FAIL test.c:%d: %s\n", line, what);
+		failed++;
+	}
+}
+
+static int slice_is(fmime_slice_t s, const char *str)
+{
+	return s.ptr && s.len == strlen(str) && !memcmp(s.ptr, str, s.len);
+}
+
+static int part_body_is(fmime_part_t *part, const char *str)
+{
+	fmime_slice_t s;
+
+	if(!part) {
+		return 0;
+	}
+	s.ptr = part->begin + part->body_off;
+	s.len = part->len - part->body_off;
+	return slice_is(s, str);
+}
+
+static void check_sections(void)
+{
+	const char *nested =
+		"Content-Type: multipart/mixed; boundary=b\n"
+		"\n"
+		"--b\n"
+		"Content-Type: text/plain\n"
+		"\n"
+		"one\n"
+		"--b\n"
+		"Content-Type: message/rfc822\n"
+		"\n"
+		"Subject: inner\n"
+		"Content-Type: multipart/alternative; boundary=c\n"
+		"\n"
+		"--c\n"
+		"\n"
+		"plain\n"
+		"--c\n"
+		"Content-Type: text/html\n"
+		"\n"
+		"html\n"
+		"--c--\n"
+		"--b--\n";
+	const char *single =
+		"Subject: pdf\n"
+		"Content-Type: application/pdf\n"
+		"Content-Transfer-Encoding: base64\n"
+		"\n"
+		"aGVsbG8gd29ybGQ=\n";
+	const char *bad[] = { "", "0", "01", "1.", ".1", "3", "1.1", "2.3", "1MIME", "MIME", "1.TEXT", "2.BODY", NULL };
+	fmime_message_t *msg;
+	fmime_part_t *part;
+	fmime_slice_t s;
+	char out[16];
+	int i;
+
+	msg = fmime_parse_memory(nested, strlen(nested));
+	CHECK(part_body_is(fmime_part_by_section(msg, "1"), "one"));
+	CHECK(part_body_is(fmime_part_by_section(msg, "2.1"), "plain"));
+	CHECK(part_body_is(fmime_part_by_section(msg, "2.2"), "html"));
+	CHECK(fmime_part_by_section(msg, "2.2.MIME") == fmime_part_by_section(msg, "2.2"));
+	CHECK(fmime_part_by_section(msg, "2.text") == fmime_part_by_section(msg, "2"));
+	for(i=0;bad[i];i++) {
+		if(fmime_part_by_section(msg, bad[i])) {
+			fprintf(stderr, "FAIL section \"%s\" found\n", bad[i]);
+			failed++;
+		}
+	}
+	CHECK(fmime_get_section(msg, "2.2.MIME", &s) && slice_is(s, "Content-Type: text/html\n\n"));
+	CHECK(fmime_get_section(msg, "2.HEADER", &s) && s.len > 15 && !memcmp(s.ptr, "Subject: inner\n", 15) &&
+		s.ptr[s.len - 2] == '\n' && s.ptr[s.len - 1] == '\n');
+	CHECK(fmime_get_section(msg, "2.TEXT", &s) && s.len > 3 && !memcmp(s.ptr, "--c\n", 4));
+	CHECK(fmime_get_section(msg, "", &s) && s.len == strlen(nested));
+	CHECK(!fmime_get_section(msg, "1.HEADER", &s));
+	CHECK(strstr(fmime_get_bodystructure(msg), "\"alternative\""));
+	fmime_free(msg);
+
+	// the body of a single part message is section 1
+	msg = fmime_parse_memory(single, strlen(single));
+	part = fmime_part_by_section(msg, "1");
+	CHECK(part && fmime_part_is_type(part, "application", "pdf"));
+	CHECK(part && fmime_part_decode_range(part, 6, 5, out) == 5 && !memcmp(out, "world", 5));
+	CHECK(!fmime_part_by_section(msg, "2"));
+	CHECK(fmime_get_section(msg, "TEXT", &s) && slice_is(s, "aGVsbG8gd29ybGQ=\n"));
+	CHECK(fmime_get_section(msg, "1", &s) && slice_is(s, "aGVsbG8gd29ybGQ=\n"));
+	fmime_free(msg);
+}
+
 // v31a needs:
 // status - simple header
 // size - save len
@@ -20,25 +122,1303 @@ extern char rfc[];
 // tag
 // popAccount
 // bodyPrev ??? (disabled?)
+// The preview comes from the part the parser finds, a longer boundary
+// sharing the prefix isn't a delimiter
+static void check_summary(void)
+{
+	const char *longer =
+		"Content-Type: multipart/mixed; boundary=b\n"
+		"\n"
+		"--b\n"
+		"Content-Type: application/octet-stream\n"
+		"\n"
+		"--bx\n"
+		"Content-Type: text/plain\n"
+		"\n"
+		"FAKE\n"
+		"--b\n"
+		"Content-Type: text/plain\n"
+		"\n"
+		"REAL\n"
+		"--b--\n";
+	// the preview picks the alternative fmime_get_plaintext does
+	const char *alts[][2] = {
+		{ "--a\nContent-Type: text/plain\n\n \n--a\nContent-Type: text/html\n\n<p>Hi</p>\n--a--\n", "Hi" },
+		{ "--a\nContent-Type: text/html\n\n<i>H</i>\n--a\nContent-Type: text/plain\n\nP\n--a--\n", "P" },
+		{ "--a\n\n\n--a\nContent-Type: multipart/related; boundary=r\n\n--r\nContent-Type: text/html\n\n<b>Rel</b>\n"
+			"--r\nContent-Type: image/png\n\nx\n--r--\n--a--\n", "Rel" },
+		{ "--a\nContent-Type: text/enriched\n\nE\n--a\nContent-Type: text/html\n\n<p>H</p>\n--a--\n", "E" },
+	};
+	fmime_message_t *msg;
+	fmime_summary_t summary;
+	char *text;
+	size_t i;
+
+	fmime_summarize(longer, strlen(longer), &summary, FMIME_SUMMARY_PREVIEW);
+	CHECK(!strcmp(summary.preview, "REAL"));
+	msg = fmime_parse_memory(longer, strlen(longer));
+	text = fmime_get_plaintext(msg, 0, NULL);
+	CHECK(text && !strcmp(text, summary.preview));
+	g_free(text);
+	fmime_free(msg);
+
+	for(i=0;i<sizeof(alts)/sizeof(alts[0]);i++) {
+		char *raw = g_strconcat("Content-Type: multipart/alternative; boundary=a\n\n", alts[i][0], NULL);
+
+		fmime_summarize(raw, strlen(raw), &summary, FMIME_SUMMARY_PREVIEW);
+		CHECK(!strcmp(summary.preview, alts[i][1]));
+		msg = fmime_parse_memory(raw, strlen(raw));
+		text = fmime_get_plaintext(msg, 0, NULL);
+		CHECK(text && !strcmp(text, alts[i][1]));
+		g_free(text);
+		fmime_free(msg);
+		g_free(raw);
+	}
+}
+
+static void check_dates(void)
+{
+	const char *bad[] = {
+		"1 Novem 2022 10:00:00 +0000",
+		"1 Septe 2022 10:00:00 +0000",
+		"1 Septem 2022 10:00:00 +0000",
+		"31 Feb 2022 10:00:00 +0000",
+		"29 Feb 2023 10:00:00 +0000",
+		"1 Nov 2022 10:00:00 -9999",
+		"Tues, 1 Nov 2022 10:00:00 +0000",
+		NULL
+	};
+	const char *received = "by mx (Postfix, from userid 0; v3); Tue, 1 Nov 2022 10:00:00 +0000 (UTC; local)";
+	char *raw = g_strdup_printf("Received: %s\nSubject: no date\n\nbody\n", received);
+	fmime_message_t *msg;
+	fmime_summary_t summary;
+	fmime_hop_t hop;
+	gint64 t;
+	int i;
+
+	CHECK(!fmime_parse_date("Tue, 1 Nov 2022 10:00:00 +0000", 30, &t) && t == 1667296800);
+	CHECK(!fmime_parse_date("Tuesday, 1 November 2022 12:00 +0200", 36, &t) && t == 1667296800);
+	CHECK(!fmime_parse_date("Tue Nov  1 10:00:00 2022", 24, &t) && t == 1667296800);
+	CHECK(!fmime_parse_date("29 Feb 2024 00:00:00 GMT", 24, &t) && t == 1709164800);
+	CHECK(!fmime_parse_date("1 Sept 2022 10:00:00 +0000", 26, &t) && t == 1662026400);
+	CHECK(!fmime_parse_date("1 sep 2022 10:00:00 +0000", 25, &t) && t == 1662026400);
+	for(i=0;bad[i];i++) {
+		if(!fmime_parse_date(bad[i], strlen(bad[i]), &t)) {
+			fprintf(stderr, "FAIL date \"%s\" parsed\n", bad[i]);
+			failed++;
+		}
+	}
+
+	// the ';' in the comments isn't the one before the date
+	CHECK(!fmime_parse_received(received, strlen(received), &hop));
+	CHECK((hop.flags & FMIME_HOP_HAS_DATE) && hop.timestamp == 1667296800);
+	CHECK(slice_is(hop.by, "mx"));
+	msg = fmime_parse_memory(raw, strlen(raw));
+	CHECK(!fmime_get_arrival_date(msg, &t) && t == 1667296800);
+	CHECK(!fmime_get_date(msg, &t) && t == 1667296800);
+	fmime_free(msg);
+	fmime_summarize(raw, strlen(raw), &summary, 0);
+	CHECK((summary.flags & FMIME_SUMMARY_HAS_DATE) && summary.timestamp == 1667296800);
+	g_free(raw);
+}
+
+// The mbox From_ line and names that aren't field names aren't headers
+static void check_headers(void)
+{
+	const char *mbox =
+		"From sender@x Tue Nov  1 10:00:00 2022\n"
+		"Subject: s\n"
+		"Bad Name: v\n"
+		" Indented: v\n"
+		"X-Spaced : v2\n"
+		"\n"
+		"body\n";
+	fmime_message_t *msg = fmime_parse_memory(mbox, strlen(mbox));
+	fmime_rules_t *rules = fmime_rules_new();
+	fmime_edit_t *edit;
+	const struct iovec *iov;
+	guint64 matched;
+	size_t size;
+	int count;
+
+	CHECK(!fmime_get_header(msg, "From sender@x Tue Nov  1 10"));
+	CHECK(!fmime_get_header(msg, "From"));
+	CHECK(!fmime_get_header(msg, "Bad Name"));
+	CHECK(!fmime_get_header(msg, " Indented") && !fmime_get_header(msg, "Indented"));
+	CHECK(fmime_get_header(msg, "X-Spaced") && !strcmp(fmime_get_header(msg, "X-Spaced"), "v2"));
+	CHECK(fmime_get_header(msg, "Subject") && !strcmp(fmime_get_header(msg, "Subject"), "s"));
+
+	fmime_rules_add(rules, NULL, "00:00 2022");
+	fmime_rules_compile(rules);
+	CHECK(fmime_rules_match(rules, msg, &matched) == 0);
+	fmime_rules_free(rules);
+
+	// prepended headers go below the From_ line
+	edit = fmime_edit_new(msg);
+	fmime_edit_prepend_header(edit, "Received", "r");
+	iov = fmime_edit_iovec(edit, &count, &size);
+	CHECK(count >= 2 && iov[0].iov_len == 39 && !memcmp(iov[0].iov_base, mbox, 39));
+	CHECK(count >= 2 && iov[1].iov_len == 12 && !memcmp(iov[1].iov_base, "Received: r\n", 12));
+	fmime_edit_free(edit);
+	fmime_free(msg);
+}
+
+// A single part message is classified like a part
+static void check_attachments(void)
+{
+	const char *pdf =
+		"Subject: a\n"
+		"Content-Type: application/pdf\n"
+		"Content-Disposition: attachment; filename=a.pdf\n"
+		"\n"
+		"%PDF\n";
+	const char *text = "Subject: t\n\nhello\n";
+	fmime_message_t *msg;
+
+	msg = fmime_parse_memory(pdf, strlen(pdf));
+	CHECK(fmime_message_has_attachment(msg, NULL));
+	fmime_free(msg);
+	msg = fmime_parse_memory(text, strlen(text));
+	CHECK(!fmime_message_has_attachment(msg, NULL));
+	fmime_free(msg);
+}
+
+// Only regular files read to the end are summarized
+static void check_files(void)
+{
+	const char *paths[] = { "testmsgs/rfc.txt", "testmsgs", "testmsgs/missing" };
+	fmime_summary_columns_t *cols = fmime_summarize_files(paths, 3, 1);
+
+	CHECK(cols && !(cols->flags[0] & FMIME_SUMMARY_ERROR) && cols->size[0] > 0);
+	CHECK(cols && cols->flags[1] == FMIME_SUMMARY_ERROR);
+	CHECK(cols && cols->flags[2] == FMIME_SUMMARY_ERROR);
+	fmime_summary_columns_free(cols);
+	CHECK(!fmime_parse_file("testmsgs"));
+}
+
+// fmime_parse_files callback: the length of each message, -1 for NULL
+static void load_cb(fmime_message_t *msg, size_t idx, void *data)
+{
+	gssize *lens = data;
+
+	lens[idx] = msg ? (gssize)msg->len : -1;
+	if(msg && msg->len > 100000) {
+		lens[idx] = slice_is((fmime_slice_t){ msg->begin + msg->len - 4, 4 }, "end\n") &&
+			!strcmp(fmime_get_header(msg, "Subject"), "big") ? (gssize)msg->len : -2;
+	}
+}
+
+// Files bigger than the pooled buffers are read whole, the ones that
+// can't be read give NULL
+static void check_load(void)
+{
+	char big[] = "/tmp/fmime-testXXXXXX";
+	const char *paths[40];
+	gssize lens[40];
+	GString *s = g_string_new("Subject: big\n\n");
+	int fd, i, bad = 0;
+
+	while(s->len < 200000) {
+		g_string_append(s, "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\n");
+	}
+	g_string_append(s, "end\n");
+	fd = mkstemp(big);
+	CHECK(fd >= 0 && write(fd, s->str, s->len) == (gssize)s->len);
+	for(i=0;i<40;i++) {
+		paths[i] = i % 4 == 0 ? big : i % 4 == 1 ? "testmsgs/rfc.txt" : i % 4 == 2 ? "testmsgs" : "testmsgs/missing";
+		lens[i] = 0;
+	}
+	fmime_parse_files(paths, 40, 4, load_cb, lens);
+	for(i=0;i<40;i++) {
+		bad |= i % 4 == 0 ? lens[i] != (gssize)s->len : i % 4 == 1 ? lens[i] <= 0 : lens[i] != -1;
+	}
+	CHECK(!bad);
+	if(fd >= 0) {
+		close(fd);
+		unlink(big);
+	}
+	g_string_free(s, TRUE);
+}
+
+// Deterministic, so a failure can be replayed
+static guint32 rnd_state = 12345;
+
+static guint32 rnd(guint32 n)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return (rnd_state >> 16) % n;
+}
+
+// A header value unfolded, a line break and the white space after it
+// as one space
+static char *unfold(const char *v)
+{
+	GString *s = g_string_new("");
+
+	for(;*v;v++) {
+		if(*v == '\r' || *v == '\n') {
+			while(v[1] == '\r' || v[1] == '\n' || v[1] == ' ' || v[1] == '\t') {
+				v++;
+			}
+			g_string_append_c(s, ' ');
+		} else {
+			g_string_append_c(s, *v);
+		}
+	}
+	return g_string_free(s, FALSE);
+}
+
+// The automata against strcasestr over the unfolded values, on random
+// rules and messages
+static void check_rules(void)
+{
+	static const char *names[] = { "Subject", "X-A", "To" };
+	static const char *rule_names[] = { NULL, "subject", "X-A", "TO" };
+	static const char *folds[] = { "\n ", "\r\n\t", "\n  \t" };
+	const char *folded = "Subject: x\nX-Folded: one\n two\nX-Crlf: three\r\n\tfour\r\n\r\nbody\r\n";
+	fmime_rules_t *rules;
+	fmime_message_t *msg;
+	guint64 matched;
+	int round, i, j, bad = 0;
+
+	rules = fmime_rules_new();
+	fmime_rules_add(rules, "X-Folded", "one two");
+	fmime_rules_add(rules, NULL, "three four");
+	fmime_rules_add(rules, NULL, "x\nx");
+	fmime_rules_compile(rules);
+	msg = fmime_parse_memory(folded, strlen(folded));
+	CHECK(fmime_rules_match(rules, msg, &matched) == 2 && matched == 3);
+	fmime_free(msg);
+	fmime_rules_free(rules);
+
+	for(round=0;round<300 && !bad;round++) {
+		GString *raw = g_string_new("");
+		char *patterns[24];
+		const char *headers[24];
+		int nrules = 1 + rnd(24), count;
+
+		for(i=0;i<3;i++) {
+			for(j=rnd(3);j>0;j--) {
+				int k, len = 1 + rnd(40);
+
+				g_string_append_printf(raw, "%s: ", names[i]);
+				for(k=0;k<len;k++) {
+					if(k && k < len - 1 && !rnd(8)) {
+						g_string_append(raw, folds[rnd(3)]);
+					}
+					g_string_append_c(raw, "abAB  c"[rnd(7)]);
+				}
+				g_string_append(raw, "\n");
+			}
+		}
+		g_string_append(raw, "\nbody\n");
+
+		rules = fmime_rules_new();
+		for(i=0;i<nrules;i++) {
+			int k, len = 1 + rnd(5);
+
+			patterns[i] = g_malloc(len + 1);
+			for(k=0;k<len;k++) {
+				patterns[i][k] = "abAB c"[rnd(6)];
+			}
+			patterns[i][len] = '\0';
+			headers[i] = rule_names[rnd(4)];
+			fmime_rules_add(rules, headers[i], patterns[i]);
+		}
+		fmime_rules_compile(rules);
+		msg = fmime_parse_memory(raw->str, raw->len);
+		count = fmime_rules_match(rules, msg, &matched);
+
+		for(i=0;i<nrules;i++) {
+			int expect = 0;
+
+			for(j=0;j<3 && !expect;j++) {
+				const GList *l;
+
+				if(headers[i] && g_ascii_strcasecmp(headers[i], names[j])) {
+					continue;
+				}
+				for(l=fmime_get_headers(msg, names[j]);l && !expect;l=l->next) {
+					char *v = unfold(l->data);
+					expect = strcasestr(v, patterns[i]) != NULL;
+					g_free(v);
+				}
+			}
+			if(expect != !!(matched & (G_GUINT64_CONSTANT(1) << i))) {
+				fprintf(stderr, "FAIL rule %s \"%s\" %s in:\n%s", headers[i] ? headers[i] : "*",
+						patterns[i], expect ? "missed" : "matched", raw->str);
+				bad = 1;
+			}
+			count -= expect;
+			g_free(patterns[i]);
+		}
+		if(!bad && count) {
+			fprintf(stderr, "FAIL rules match count off by %d\n", count);
+			bad = 1;
+		}
+		fmime_free(msg);
+		fmime_rules_free(rules);
+		g_string_free(raw, TRUE);
+	}
+	failed += bad;
+}
+
+// Rule numbers past 64 go to the next bitset word, stale bits are
+// cleared, and the calls out of order fail
+static void check_rules_api(void)
+{
+	const char *raw = "Subject: rule 70 here\nX-Other: rule 5\n\nbody\n";
+	fmime_rules_t *rules = fmime_rules_new();
+	fmime_message_t *msg = fmime_parse_memory(raw, strlen(raw));
+	guint64 matched[3];
+	char pattern[32];
+	int i;
+
+	CHECK(fmime_rules_add(rules, "Subject", "") == -1);
+	CHECK(fmime_rules_match(rules, msg, matched) == -1);
+	for(i=0;i<130;i++) {
+		snprintf(pattern, sizeof(pattern), "rule %d ", i);
+		CHECK(fmime_rules_add(rules, i == 5 ? "*" : "Subject", pattern) == i);
+	}
+	CHECK(!fmime_rules_compile(rules) && fmime_rules_compile(rules) == -1);
+	CHECK(fmime_rules_add(rules, NULL, "late") == -1);
+	CHECK(fmime_rules_words(rules) == 3);
+
+	matched[0] = matched[1] = matched[2] = ~G_GUINT64_CONSTANT(0);
+	// "rule 5" ends the X-Other value, the pattern wants a space after it
+	CHECK(fmime_rules_match(rules, msg, matched) == 1);
+	CHECK(!matched[0] && matched[1] == G_GUINT64_CONSTANT(1) << (70 - 64) && !matched[2]);
+	fmime_free(msg);
+
+	// rule 7 is for the Subject only
+	raw = "Subject: RULE 129 and rule 0 ok\nX-Other: rule 5 ok rule 7 ok\n\nbody\n";
+	msg = fmime_parse_memory(raw, strlen(raw));
+	CHECK(fmime_rules_match(rules, msg, matched) == 3);
+	CHECK(matched[0] == ((G_GUINT64_CONSTANT(1) << 5) | 1) && !matched[1] && matched[2] == 2);
+	fmime_free(msg);
+	fmime_rules_free(rules);
+}
+
+static int addr_is(const fmime_address_t *a, const char *display, const char *local, const char *domain, const char *group)
+{
+	return (display ? slice_is(a->display, display) : !a->display.ptr) &&
+		slice_is(a->local, local) &&
+		(domain ? slice_is(a->domain, domain) : !a->domain.ptr) &&
+		(group ? slice_is(a->group, group) : !a->group.ptr);
+}
+
+static void check_addresses(void)
+{
+	const char *list = "\"Doe, John\" <john@x.com>, jane@y.org (Jane Y), undisclosed-recipients:;, "
+		"grp: a@b, \"c d\"@e.f;";
+	const char *route = "<@relay1,@relay2:user@host>";
+	const char *comments = "a@b (c (nested) d), \"quoted \\\" pair\" <q@r>, , bad";
+	fmime_address_t a[8];
+
+	CHECK(fmime_parse_addresses(list, strlen(list), a, 8) == 4);
+	CHECK(addr_is(&a[0], "Doe, John", "john", "x.com", NULL));
+	CHECK(addr_is(&a[1], "Jane Y", "jane", "y.org", NULL));
+	CHECK(addr_is(&a[2], NULL, "a", "b", "grp"));
+	CHECK(addr_is(&a[3], NULL, "\"c d\"", "e.f", "grp"));
+	// the count goes on past max
+	CHECK(fmime_parse_addresses(list, strlen(list), a, 1) == 4);
+	CHECK(fmime_parse_addresses(route, strlen(route), a, 8) == 1 && addr_is(&a[0], NULL, "user", "host", NULL));
+	CHECK(fmime_parse_addresses(comments, strlen(comments), a, 8) == 3);
+	CHECK(addr_is(&a[0], "c (nested) d", "a", "b", NULL));
+	CHECK(addr_is(&a[1], "quoted \\\" pair", "q", "r", NULL));
+	CHECK(addr_is(&a[2], NULL, "bad", NULL, NULL));
+}
+
+// Clauses of Received values, and the chain newest first
+static void check_hops(void)
+{
+	const char *full = "from mail.example.com (mail.example.com [192.0.2.1]) by mx.example.org\n"
+		" (Postfix) with ESMTPS id ABC123\n for <user@example.org>; Tue, 1 Nov 2022 10:00:00 +0000";
+	const char *helo = "from helo.test ([IPv6:2001:db8::1] helo=x) by relay with SMTP";
+	const char *raw =
+		"Received: by c with LMTP; Tue, 1 Nov 2022 10:00:09 +0000\n"
+		"Received: from b by c; Tue, 1 Nov 2022 10:00:05 +0000\n"
+		"Received: from a by b; Tue, 1 Nov 2022 10:00:00 +0000\n"
+		"\n"
+		"body\n";
+	fmime_hop_t hop, hops[2];
+	fmime_message_t *msg;
+
+	CHECK(!fmime_parse_received(full, strlen(full), &hop));
+	CHECK(slice_is(hop.from, "mail.example.com") && slice_is(hop.from_ip, "192.0.2.1"));
+	CHECK(slice_is(hop.by, "mx.example.org") && slice_is(hop.with, "ESMTPS"));
+	CHECK(slice_is(hop.id, "ABC123") && slice_is(hop.rcpt, "user@example.org"));
+	CHECK((hop.flags & FMIME_HOP_HAS_DATE) && hop.timestamp == 1667296800);
+
+	// no date, the clauses are there anyway
+	CHECK(fmime_parse_received(helo, strlen(helo), &hop) == -1 && !(hop.flags & FMIME_HOP_HAS_DATE));
+	CHECK(slice_is(hop.from, "helo.test") && slice_is(hop.by, "relay") && slice_is(hop.with, "SMTP"));
+	CHECK(slice_is(hop.from_ip, "2001:db8::1") && !hop.id.ptr && !hop.rcpt.ptr);
+
+	msg = fmime_parse_memory(raw, strlen(raw));
+	CHECK(fmime_get_hops(msg, hops, 2) == 3);
+	CHECK(!hops[0].from.ptr && slice_is(hops[0].with, "LMTP") && hops[0].timestamp == 1667296809);
+	CHECK(slice_is(hops[1].from, "b") && hops[1].timestamp - 1667296800 == 5);
+	fmime_free(msg);
+}
+
+// The same message with LF and CRLF line ends gives the same parts, and
+// the line break before a delimiter isn't in the part
+static void check_crlf(void)
+{
+	const char *lf =
+		"Subject: crlf\n"
+		"Content-Type: multipart/mixed; boundary=\"b\"\n"
+		"\n"
+		"preamble\n"
+		"--b\n"
+		"Content-Type: text/plain\n"
+		"\n"
+		"one\n"
+		"\n"
+		"--b \n"
+		"Content-Type: multipart/alternative;\n"
+		" boundary=c\n"
+		"\n"
+		"--c\n"
+		"\n"
+		"two\n"
+		"--c--\n"
+		"--b--\n"
+		"epilogue\n";
+	GString *crlf = g_string_new("");
+	fmime_message_t *m1, *m2;
+	fmime_part_t *p1, *p2;
+	int n1, n2, i;
+
+	for(i=0;lf[i];i++) {
+		if(lf[i] == '\n') {
+			g_string_append_c(crlf, '\r');
+		}
+		g_string_append_c(crlf, lf[i]);
+	}
+	m1 = fmime_parse_memory(lf, strlen(lf));
+	m2 = fmime_parse_memory(crlf->str, crlf->len);
+	p1 = fmime_message_parts(m1, &n1);
+	p2 = fmime_message_parts(m2, &n2);
+	CHECK(n1 == 4 && n2 == 4);
+	for(i=0;i<n1 && i<n2;i++) {
+		const char *b1 = p1[i].begin + p1[i].body_off, *b2 = p2[i].begin + p2[i].body_off;
+		int l1 = p1[i].len - p1[i].body_off, l2 = p2[i].len - p2[i].body_off;
+		char *v1, *v2;
+		int j, k;
+
+		// the bodies are the same once the \r are gone
+		for(j=k=0;j<l1 && k<l2;j++,k++) {
+			if(b2[k] == '\r' && b2[k+1] == '\n') {
+				k++;
+			}
+			if(b1[j] != b2[k]) {
+				break;
+			}
+		}
+		if(j != l1 || k != l2) {
+			fprintf(stderr, "FAIL crlf part %d body differs\n", i);
+			failed++;
+		}
+		CHECK(!l2 || b2[l2-1] != '\r');
+		// values keep their folds, \r included
+		v1 = unfold(fmime_part_get_header(&p1[i], "Content-Type") ? fmime_part_get_header(&p1[i], "Content-Type") : "");
+		v2 = unfold(fmime_part_get_header(&p2[i], "Content-Type") ? fmime_part_get_header(&p2[i], "Content-Type") : "");
+		CHECK(!strcmp(v1, v2));
+		g_free(v1);
+		g_free(v2);
+	}
+	CHECK(part_body_is(&p1[1], "one\n"));
+	CHECK(part_body_is(&p1[3], "two"));
+	CHECK(part_body_is(&p2[1], "one\r\n"));
+	CHECK(part_body_is(&p2[3], "two"));
+	CHECK(!strcmp(fmime_get_header(m2, "Subject"), "crlf"));
+	fmime_free(m1);
+	fmime_free(m2);
+	g_string_free(crlf, TRUE);
+}
+
+// Every io strategy gives the file as it is, read ones NUL terminated
+static void check_file_io(void)
+{
+	const int ios[] = { FMIME_IO_AUTO, FMIME_IO_READ, FMIME_IO_MMAP };
+	char empty[] = "/tmp/fmime-testXXXXXX";
+	fmime_buffer_t buf = { NULL, 0 };
+	fmime_message_t *msg;
+	char *data = NULL;
+	size_t len = 0;
+	FILE *f;
+	int i, fd;
+
+	f = fopen("testmsgs/rfc.txt", "rb");
+	CHECK(f && !fseek(f, 0, SEEK_END) && (len = ftell(f)) > 0 && !fseek(f, 0, SEEK_SET));
+	data = g_malloc(len + 1);
+	CHECK(f && fread(data, 1, len, f) == len);
+	if(f) {
+		fclose(f);
+	}
+	fd = mkstemp(empty);
+	CHECK(fd >= 0);
+
+	for(i=0;i<3;i++) {
+		msg = fmime_parse_file_ex("testmsgs/rfc.txt", ios[i], NULL);
+		CHECK(msg && msg->len == len && !memcmp(msg->begin, data, len));
+		CHECK(msg && fmime_get_header(msg, "Subject"));
+		if(msg) {
+			fmime_free(msg);
+		}
+		msg = fmime_parse_file_ex(empty, ios[i], NULL);
+		CHECK(msg && msg->len == 0);
+		if(msg) {
+			fmime_free(msg);
+		}
+		CHECK(!fmime_parse_file_ex("testmsgs", ios[i], NULL));
+		CHECK(!fmime_parse_file_ex("testmsgs/missing", ios[i], NULL));
+	}
+
+	// the caller's buffer is grown once and reused
+	msg = fmime_parse_file_ex("testmsgs/rfc.txt", FMIME_IO_READ, &buf);
+	CHECK(msg && msg->begin == buf.data && buf.size > len && !buf.data[len]);
+	CHECK(msg && msg->len == len && !memcmp(msg->begin, data, len));
+	if(msg) {
+		fmime_free(msg);
+	}
+	msg = fmime_parse_file_ex(empty, FMIME_IO_READ, &buf);
+	CHECK(msg && msg->begin == buf.data && msg->len == 0 && !buf.data[0]);
+	if(msg) {
+		fmime_free(msg);
+	}
+	fmime_buffer_free(&buf);
+
+	if(fd >= 0) {
+		close(fd);
+		unlink(empty);
+	}
+	g_free(data);
+}
+
+// A context hands out the same storage for each parse, without anything
+// of the previous message left in it
+static void check_ctx(void)
+{
+	const char *small = "X-Small: 1\n\nsmall body\n";
+	fmime_parser_ctx_t *ctx = fmime_ctx_new();
+	fmime_message_t *msg, *first;
+	fmime_part_t *parts;
+	char *text;
+	int n, n2, round;
+
+	first = fmime_ctx_parse_memory(ctx, rfc, strlen(rfc));
+	parts = fmime_message_parts(first, &n);
+	CHECK(n > 2 && fmime_get_header(first, "Subject"));
+	for(round=0;round<3;round++) {
+		msg = fmime_ctx_parse_memory(ctx, small, strlen(small));
+		CHECK(msg == first && !msg->root && !fmime_message_parts(msg, &n2) && !n2);
+		CHECK(!fmime_get_header(msg, "Subject") && !strcmp(fmime_get_header(msg, "X-Small"), "1"));
+		text = fmime_get_plaintext(msg, 0, NULL);
+		CHECK(text && !strcmp(text, "small body\n"));
+		g_free(text);
+
+		// the biggest message seen fits in what's there
+		msg = fmime_ctx_parse_memory(ctx, rfc, strlen(rfc));
+		CHECK(msg == first && fmime_message_parts(msg, &n2) == parts && n2 == n);
+		CHECK(!fmime_get_header(msg, "X-Small") && fmime_get_header(msg, "Subject"));
+	}
+	// freeing it early leaves the context usable
+	fmime_free(msg);
+	msg = fmime_ctx_parse_memory(ctx, small, strlen(small));
+	CHECK(!strcmp(fmime_get_header(msg, "X-Small"), "1"));
+	fmime_ctx_free(ctx);
+}
+
+// The part array is in pre-order and its index links agree with the
+// children arrays
+static void check_tree(void)
+{
+	const char *nested =
+		"Content-Type: multipart/mixed; boundary=a\n"
+		"\n"
+		"--a\n"
+		"Content-Type: multipart/alternative; boundary=b\n"
+		"\n"
+		"--b\n"
+		"\n"
+		"plain\n"
+		"--b\n"
+		"Content-Type: text/html\n"
+		"\n"
+		"html\n"
+		"--b--\n"
+		"--a\n"
+		"Content-Type: image/png\n"
+		"\n"
+		"png\n"
+		"--a--\n";
+	const char *raws[] = { nested, rfc };
+	// parent and depth of each part of nested
+	const int parent[] = { -1, 0, 1, 1, 0 }, depth[] = { 0, 1, 2, 2, 1 };
+	fmime_message_t *msg;
+	fmime_part_t *parts, **children;
+	int r, i, c, k, n, count;
+
+	for(r=0;r<2;r++) {
+		msg = fmime_parse_memory(raws[r], strlen(raws[r]));
+		parts = fmime_message_parts(msg, &n);
+		CHECK(parts && msg->root == &parts[0] && parts[0].parent == -1 && !parts[0].depth);
+		if(!r) {
+			CHECK(n == 5);
+			for(i=0;i<n && i<5;i++) {
+				CHECK(parts[i].parent == parent[i] && parts[i].depth == depth[i]);
+			}
+		}
+		for(i=0;i<n;i++) {
+			fmime_part_t *p = &parts[i];
+			int end = p->next_sibling;
+
+			CHECK(p->index == i);
+			CHECK(!i || (p->parent < i && p->depth == parts[p->parent].depth + 1));
+			children = fmime_part_children(p, &count);
+			CHECK(count == fmime_part_child_count(p) && !fmime_part_child_at(p, count));
+			CHECK(p->first_child == (count ? i + 1 : -1));
+			// the children, linked by next_sibling
+			for(c=p->first_child,k=0;c != -1 && k<count;c=parts[c].next_sibling,k++) {
+				CHECK(children[k] == &parts[c] && fmime_part_child_at(p, k) == &parts[c] && parts[c].parent == i);
+			}
+			CHECK(c == -1 && k == count);
+			// the subtree is the run of deeper parts after it
+			if(end == -1) {
+				for(end=i+1;end<n && parts[end].depth > p->depth;end++) {
+					// do nothing
+				}
+			} else {
+				CHECK(parts[end].parent == p->parent);
+			}
+			for(k=i+1;k<end;k++) {
+				CHECK(parts[k].depth > p->depth);
+			}
+		}
+		fmime_free(msg);
+	}
+}
+
+// Without a close delimiter the last part is dropped, unless FMIME_RECOVER
+static void check_recover(void)
+{
+	const char *open =
+		"Content-Type: multipart/mixed; boundary=b\n"
+		"\n"
+		"--b\n"
+		"\n"
+		"one\n"
+		"--b\n"
+		"Content-Type: text/plain\n"
+		"\n"
+		"two\n";
+	const char *outer =
+		"Content-Type: multipart/mixed; boundary=o\n"
+		"\n"
+		"--o\n"
+		"Content-Type: image/png\n"
+		"\n"
+		"x\n"
+		"--o\n"
+		"Content-Type: message/rfc822\n"
+		"\n";
+	fmime_parser_ctx_t *ctx = fmime_ctx_new();
+	fmime_message_t *msg;
+	fmime_part_t *parts;
+	fmime_summary_t sum;
+	GString *nested;
+	int n;
+
+	msg = fmime_parse_memory(open, strlen(open));
+	parts = fmime_message_parts(msg, &n);
+	CHECK(n == 2 && part_body_is(&parts[1], "one"));
+	fmime_free(msg);
+
+	fmime_ctx_set_flags(ctx, FMIME_RECOVER);
+	msg = fmime_ctx_parse_memory(ctx, open, strlen(open));
+	parts = fmime_message_parts(msg, &n);
+	CHECK(n == 3 && part_body_is(&parts[1], "one") && part_body_is(&parts[2], "two\n"));
+
+	// the other parses don't see it
+	msg = fmime_parse_memory(open, strlen(open));
+	fmime_message_parts(msg, &n);
+	CHECK(n == 2);
+	fmime_free(msg);
+
+	// a nested message is parsed like the one holding it
+	nested = g_string_new(outer);
+	g_string_append(nested, open);
+	msg = fmime_ctx_parse_memory(ctx, nested->str, nested->len);
+	CHECK(fmime_part_by_section(msg, "2.2") && part_body_is(fmime_part_by_section(msg, "2.2"), "two\n"));
+	fmime_ctx_set_flags(ctx, 0);
+	msg = fmime_ctx_parse_memory(ctx, nested->str, nested->len);
+	CHECK(!fmime_part_by_section(msg, "2.2"));
+
+	g_string_free(nested, TRUE);
+
+	// the only text part is the unterminated one
+	nested = g_string_new(outer);
+	g_string_truncate(nested, nested->len - strlen("message/rfc822\n\n"));
+	g_string_append(nested, "text/plain\n\ntail\n");
+	fmime_summarize(nested->str, nested->len, &sum, FMIME_SUMMARY_PREVIEW);
+	CHECK(!(sum.flags & FMIME_SUMMARY_HAS_PREVIEW));
+	fmime_summarize(nested->str, nested->len, &sum, FMIME_SUMMARY_PREVIEW | FMIME_SUMMARY_RECOVER);
+	CHECK((sum.flags & FMIME_SUMMARY_HAS_PREVIEW) && !strcmp(sum.preview, "tail"));
+	g_string_free(nested, TRUE);
+	fmime_ctx_free(ctx);
+}
+
+// Quoted-printable with every byte escaped but the plain ones, and soft
+// line breaks
+static void qp_encode(GString *out, const guchar *p, size_t len, const char *eol)
+{
+	size_t i, col = 0;
+
+	for(i=0;i<len;i++) {
+		if(col >= 70) {
+			g_string_append_printf(out, "=%s", eol);
+			col = 0;
+		}
+		if(p[i] > ' ' && p[i] < 127 && p[i] != '=') {
+			g_string_append_c(out, p[i]);
+			col++;
+		} else {
+			g_string_append_printf(out, "=%02X", p[i]);
+			col += 3;
+		}
+	}
+}
+
+// fmime_part_decode_range windows and the counted size against the whole
+// payload, on random base64 and quoted-printable bodies
+static void check_decode(void)
+{
+	int round, bad = 0;
+
+	for(round=0;round<200 && !bad;round++) {
+		size_t len = rnd(round < 20 ? 8 : 6000), i, lines;
+		guchar *payload = g_malloc(len + 1);
+		const char *eol = rnd(2) ? "\r\n" : "\n";
+		int qp = rnd(2);
+		GString *raw = g_string_new("");
+		GString *body = g_string_new("");
+		fmime_message_t *msg;
+		fmime_part_t *part;
+		char *out;
+		int k;
+
+		for(i=0;i<len;i++) {
+			payload[i] = rnd(4) ? "ab \n"[rnd(4)] : rnd(256);
+		}
+		if(qp) {
+			qp_encode(body, payload, len, eol);
+		} else {
+			char *b64 = g_base64_encode(payload, len);
+			size_t blen = strlen(b64);
+
+			for(i=0;i<blen;i+=76) {
+				g_string_append_len(body, b64 + i, MIN(76, blen - i));
+				g_string_append(body, eol);
+			}
+			g_free(b64);
+		}
+		for(i=lines=0;i<body->len;i++) {
+			lines += body->str[i] == '\n';
+		}
+		lines += body->len && body->str[body->len-1] != '\n';
+
+		g_string_append_printf(raw, "Content-Type: multipart/mixed; boundary=z%s%s--z%s"
+			"Content-Type: application/octet-stream%sContent-Transfer-Encoding: %s%s%s%s%s--z--%s",
+			eol, eol, eol, eol, qp ? "quoted-printable" : "base64", eol, eol, body->str, eol, eol);
+		msg = fmime_parse_memory(raw->str, raw->len);
+		part = fmime_part_by_section(msg, "1");
+
+		if(!part || fmime_part_get_decoded_size(part) != len || fmime_part_get_lines(part) != (int)lines) {
+			fprintf(stderr, "FAIL decode round %d: size %zu lines %zu\n", round, len, lines);
+			bad = 1;
+		}
+		out = g_malloc(len + 16);
+		for(k=0;k<20 && !bad;k++) {
+			size_t off = rnd(len + 4), want = rnd(len + 4 - off + 1);
+			size_t got = fmime_part_decode_range(part, off, want, out);
+			size_t expect = off >= len ? 0 : MIN(want, len - off);
+
+			if(got != expect || memcmp(out, payload + off, expect)) {
+				fprintf(stderr, "FAIL decode round %d %s: [%zu, +%zu) of %zu got %zu\n", round,
+						qp ? "qp" : "base64", off, want, len, got);
+				bad = 1;
+			}
+		}
+		g_free(out);
+		fmime_free(msg);
+		g_string_free(raw, TRUE);
+		g_string_free(body, TRUE);
+		g_free(payload);
+	}
+	failed += bad;
+}
+
+// Only the registered headers are kept, Content-* always
+static void check_header_filter(void)
+{
+	const char *raw =
+		"Received: one\n"
+		"Subject: kept\n"
+		"To: dropped@x\n"
+		"X-Spam: yes\n"
+		"Received: two\n"
+		"Content-Type: multipart/mixed; boundary=b\n"
+		"\n"
+		"--b\n"
+		"Content-Type: text/plain\n"
+		"X-Part: p\n"
+		"\n"
+		"body\n"
+		"--b--\n";
+	const char * const names[] = { "subject", "RECEIVED", "", NULL };
+	fmime_parser_ctx_t *ctx = fmime_ctx_new();
+	fmime_message_t *msg;
+	fmime_part_t *parts;
+	int n;
+
+	fmime_ctx_set_headers(ctx, names, 0);
+	msg = fmime_ctx_parse_memory(ctx, raw, strlen(raw));
+	CHECK(!strcmp(fmime_get_header(msg, "Subject"), "kept"));
+	CHECK(g_list_length((GList *)fmime_get_headers(msg, "Received")) == 2);
+	CHECK(!fmime_get_header(msg, "To") && !fmime_get_header(msg, "X-Spam"));
+	parts = fmime_message_parts(msg, &n);
+	CHECK(n == 2 && fmime_part_is_type(&parts[1], "text", "plain") && part_body_is(&parts[1], "body"));
+	CHECK(!fmime_part_get_header(&parts[1], "X-Part"));
+
+	fmime_ctx_set_headers(ctx, names, FMIME_HEADERS_X);
+	msg = fmime_ctx_parse_memory(ctx, raw, strlen(raw));
+	CHECK(!strcmp(fmime_get_header(msg, "X-Spam"), "yes") && !fmime_get_header(msg, "To"));
+	parts = fmime_message_parts(msg, &n);
+	CHECK(n == 2 && !strcmp(fmime_part_get_header(&parts[1], "X-Part"), "p"));
+
+	fmime_ctx_set_headers(ctx, NULL, 0);
+	msg = fmime_ctx_parse_memory(ctx, raw, strlen(raw));
+	CHECK(!strcmp(fmime_get_header(msg, "To"), "dropped@x"));
+	fmime_ctx_free(ctx);
+}
+
+// Text parts come out as valid UTF-8 whatever their charset and bytes
+static void check_text_utf8(void)
+{
+	const char *cases[][2] = {
+		{ "charset=utf-8\n\ncaf\xc3\xa9 \xe2\x82\xac", "caf\xc3\xa9 \xe2\x82\xac" },
+		// not UTF-8 after all, read as windows-1252
+		{ "charset=utf-8\n\ncaf\xe9 ok", "caf\xc3\xa9 ok" },
+		{ "charset=iso-8859-1\n\ncaf\xe9", "caf\xc3\xa9" },
+		{ "charset=iso-8859-1\nContent-Transfer-Encoding: quoted-printable\n\ncaf=E9=\n!", "caf\xc3\xa9!" },
+		{ "charset=utf-8\nContent-Transfer-Encoding: base64\n\nY2Fmw6k=\n", "caf\xc3\xa9" },
+		{ "charset=windows-1252\n\n\x80\x93", "\xe2\x82\xac\xe2\x80\x9c" },
+		{ "charset=shift_jis\n\n\x82\xa0", "\xe3\x81\x82" },
+		// past the ascii fast path, a sequence cut by the end
+		{ "charset=utf-8\n\n0123456789012345678901234567890123456789012345678901234567890123456789\xc3\xa9 \xc3",
+			"0123456789012345678901234567890123456789012345678901234567890123456789\xc3\xa9 \xc3\x83" },
+	};
+	const char *multi = "Content-Type: multipart/mixed; boundary=b\n\n--b\nContent-Type: image/png\n\nx\n"
+		"--b\nContent-Type: text/plain; charset=iso-8859-1\n\n\xe9t\xe9\n--b--\n";
+	fmime_message_t *msg;
+	fmime_part_t *parts;
+	char *text;
+	size_t i, j, len;
+	int n, round, bad = 0;
+
+	for(i=0;i<sizeof(cases)/sizeof(cases[0]);i++) {
+		char *raw = g_strconcat("Content-Type: text/plain; ", cases[i][0], NULL);
+
+		msg = fmime_parse_memory(raw, strlen(raw));
+		text = fmime_get_text_utf8(msg, &len);
+		if(!text || len != strlen(cases[i][1]) || memcmp(text, cases[i][1], len)) {
+			fprintf(stderr, "FAIL text_utf8 case %zu\n", i);
+			bad++;
+		}
+		g_free(text);
+		fmime_free(msg);
+		g_free(raw);
+	}
+
+	msg = fmime_parse_memory(multi, strlen(multi));
+	parts = fmime_message_parts(msg, &n);
+	CHECK(!fmime_get_text_utf8(msg, NULL));
+	CHECK(n == 3 && !fmime_part_get_text_utf8(&parts[1], NULL));
+	text = fmime_part_get_text_utf8(&parts[2], &len);
+	CHECK(text && len == 5 && !strcmp(text, "\xc3\xa9t\xc3\xa9"));
+	g_free(text);
+	fmime_free(msg);
+
+	// random bytes but NUL, mostly high ones
+	for(round=0;round<100;round++) {
+		GString *raw = g_string_new("Content-Type: text/plain; charset=utf-8\n\n");
+
+		for(j=rnd(300);j>0;j--) {
+			g_string_append_c(raw, rnd(3) ? 0x80 + rnd(128) : 1 + rnd(127));
+		}
+		msg = fmime_parse_memory(raw->str, raw->len);
+		text = fmime_get_text_utf8(msg, &len);
+		if(!text || !g_utf8_validate(text, len, NULL) || strlen(text) != len) {
+			fprintf(stderr, "FAIL text_utf8 round %d\n", round);
+			bad++;
+		}
+		g_free(text);
+		fmime_free(msg);
+		g_string_free(raw, TRUE);
+	}
+	failed += bad;
+}
+
+// Markup, scripts and comments are dropped, entities decoded, blocks
+// end lines and white space collapses
+static void check_plaintext(void)
+{
+	const char *cases[][2] = {
+		{ "<html><head><title>T</title><style>p{color:red}</style></head><body><p>Hello&nbsp;<b>world</b></p>"
+			"<script>alert('x<y')</script><p>a &amp; b &lt; c &#233; &#x20AC; &bogus; &eacute;</p>"
+			"<!-- hidden <p>no</p> -->end</body></html>",
+			"Hello world\na & b < c \xc3\xa9 \xe2\x82\xac &bogus; \xc3\xa9\nend" },
+		{ "<p>one</p><p>two</p>line<br>break<div>d</div>", "one\ntwo\nline\nbreak\nd" },
+		{ "a   b\n\n   c <a href=\"x>y\">link</a>", "a b c link" },
+		{ "<P>Upper</P><SCRIPT>no</SCRIPT >yes", "Upper\nyes" },
+	};
+	const char *mixed = "Content-Type: multipart/mixed; boundary=b\n\n--b\nContent-Type: image/png\n\nx\n"
+		"--b\nContent-Type: text/html\n\n<p>abcdef ghijkl</p>\n--b--\n";
+	const char *cut;
+	fmime_message_t *msg;
+	fmime_part_t *parts;
+	char *text;
+	size_t i, len;
+	int n;
+
+	for(i=0;i<sizeof(cases)/sizeof(cases[0]);i++) {
+		char *raw = g_strconcat("Content-Type: text/html; charset=utf-8\n\n", cases[i][0], NULL);
+
+		msg = fmime_parse_memory(raw, strlen(raw));
+		text = fmime_get_plaintext(msg, 0, &len);
+		if(!text || len != strlen(cases[i][1]) || strcmp(text, cases[i][1])) {
+			fprintf(stderr, "FAIL plaintext case %zu: \"%s\"\n", i, text ? text : "(null)");
+			failed++;
+		}
+		g_free(text);
+		fmime_free(msg);
+		g_free(raw);
+	}
+
+	// the first text part, cut at max characters
+	msg = fmime_parse_memory(mixed, strlen(mixed));
+	parts = fmime_message_parts(msg, &n);
+	CHECK(n == 3 && !fmime_part_get_plaintext(&parts[1], 0, NULL));
+	text = fmime_get_plaintext(msg, 5, &len);
+	CHECK(text && len == 5 && !strcmp(text, "abcde"));
+	g_free(text);
+	text = fmime_part_get_plaintext(&parts[2], 0, NULL);
+	CHECK(text && !strcmp(text, "abcdef ghijkl"));
+	g_free(text);
+	fmime_free(msg);
+
+	// characters, not bytes
+	cut = "Content-Type: text/html; charset=utf-8\n\n&eacute;\xc3\xa9&#233;";
+	msg = fmime_parse_memory(cut, strlen(cut));
+	text = fmime_get_plaintext(msg, 2, &len);
+	CHECK(text && len == 4 && !strcmp(text, "\xc3\xa9\xc3\xa9"));
+	g_free(text);
+	fmime_free(msg);
+}
+
+// fmime_tokenize callback: the words separated by spaces, checked against
+// the plaintext they come from
+struct tokens {
+	GString *words;
+	const char *plain; // of the part being tokenized
+	size_t count;
+	size_t stop;       // stop after that many words, 0 never
+	int bad;
+};
+
+static int token_cb(const fmime_token_t *t, void *data)
+{
+	struct tokens *tk = data;
+
+	if(t->position != tk->count++ || t->len > FMIME_TOKEN_MAX) {
+		tk->bad = 1;
+	}
+	// ascii words are the plaintext case folded
+	if(tk->plain && !(t->word[0] & 0x80) && g_ascii_strncasecmp(tk->plain + t->offset, t->word, t->len)) {
+		tk->bad = 1;
+	}
+	g_string_append_len(tk->words, t->word, t->len);
+	g_string_append_c(tk->words, ' ');
+	return tk->stop && tk->count == tk->stop ? 7 : 0;
+}
+
+// Words of the text fmime_get_plaintext picks, case folded, with their
+// place in it
+static void check_tokens(void)
+{
+	const char *alt =
+		"Content-Type: multipart/alternative; boundary=a\n"
+		"\n"
+		"--a\n"
+		"Content-Type: text/plain; charset=utf-8\n"
+		"\n"
+		"Hello, World! l'\xc3\xa9t\xc3\xa9 2022 \xc3\x89" "COLE Stra\xc3\x9f" "e x_y\n"
+		"--a\n"
+		"Content-Type: text/html\n"
+		"\n"
+		"<p>html only</p>\n"
+		"--a--\n";
+	const char *html = "Content-Type: text/html\n\n<p>A&amp;B <b>bold</b>text</p>";
+	struct tokens tk = { g_string_new(""), NULL, 0, 0, 0 };
+	GString *big = g_string_new("Content-Type: text/plain\n\n");
+	fmime_message_t *msg;
+	char *plain;
+	int i;
+
+	msg = fmime_parse_memory(alt, strlen(alt));
+	tk.plain = plain = fmime_get_plaintext(msg, 0, NULL);
+	CHECK(!fmime_tokenize(msg, token_cb, &tk) && !tk.bad);
+	CHECK(!strcmp(tk.words->str, "hello world l \xc3\xa9t\xc3\xa9 2022 \xc3\xa9" "cole stra\xc3\x9f" "e x y "));
+
+	// the callback stops it
+	g_string_truncate(tk.words, 0);
+	tk.count = 0;
+	tk.stop = 2;
+	CHECK(fmime_tokenize(msg, token_cb, &tk) == 7 && !tk.bad && !strcmp(tk.words->str, "hello world "));
+	g_free(plain);
+	fmime_free(msg);
+
+	g_string_truncate(tk.words, 0);
+	tk.count = tk.stop = 0;
+	msg = fmime_parse_memory(html, strlen(html));
+	tk.plain = plain = fmime_get_plaintext(msg, 0, NULL);
+	CHECK(!fmime_tokenize(msg, token_cb, &tk) && !tk.bad && !strcmp(tk.words->str, "a b boldtext "));
+	g_free(plain);
+	fmime_free(msg);
+
+	// longer than the window, with words too long to keep
+	for(i=0;i<5000;i++) {
+		g_string_append_printf(big, "W%d ", i);
+		if(i % 1000 == 500) {
+			g_string_append(big, "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef0 ");
+		}
+	}
+	g_string_truncate(tk.words, 0);
+	tk.count = 0;
+	msg = fmime_parse_memory(big->str, big->len);
+	tk.plain = plain = fmime_get_plaintext(msg, 0, NULL);
+	CHECK(!fmime_tokenize(msg, token_cb, &tk) && !tk.bad && tk.count == 5000);
+	CHECK(g_str_has_prefix(tk.words->str, "w0 w1 ") && g_str_has_suffix(tk.words->str, " w4999 "));
+	g_free(plain);
+	fmime_free(msg);
+	g_string_free(big, TRUE);
+	g_string_free(tk.words, TRUE);
+}
+
+static char *iov_join(fmime_edit_t *edit, size_t *len)
+{
+	const struct iovec *iov;
+	GString *s = g_string_new("");
+	size_t size;
+	int count, i;
+
+	iov = fmime_edit_iovec(edit, &count, &size);
+	for(i=0;i<count;i++) {
+		g_string_append_len(s, iov[i].iov_base, iov[i].iov_len);
+	}
+	CHECK(s->len == size);
+	*len = s->len;
+	return g_string_free(s, FALSE);
+}
+
+// The rewritten message, byte for byte
+static void check_edit(void)
+{
+	const char *lf =
+		"Received: one\n"
+		"  folded\n"
+		"Subject: old\n"
+		"X-Priority: 3\n"
+		"subject: second\n"
+		"To: x@y\n"
+		"\n"
+		"body\n";
+	const char *lf_edited =
+		"Received: from b by c\n"
+		"Received: from a by b\n"
+		"Received: one\n"
+		"  folded\n"
+		"Subject: new\n"
+		"To: x@y\n"
+		"X-Added: yes\n"
+		"X-New: n1\n"
+		"\n"
+		"body\n";
+	const char *crlf = "Subject: a\r\nTo: b\r\n\r\nbody\r\n";
+	const char *crlf_edited = "Received: r\r\nSubject: a\r\nTo: c\r\n\r\nbody\r\n";
+	// only a header, without a line break at its end
+	const char *bare = "Subject: a\r\nTo: b";
+	const char *bare_edited = "Subject: a\r\nTo: b\r\nX-Added: 1\r\nX-New: 2\r\n";
+	const char *bare_removed = "Subject: a\r\nX-Added: 1\r\n";
+	fmime_message_t *msg, *again;
+	fmime_edit_t *edit;
+	fmime_part_t *parts;
+	char *out, *back;
+	size_t len;
+	int n, n2, i, removed = 0;
+	FILE *f;
+
+	msg = fmime_parse_memory(lf, strlen(lf));
+	edit = fmime_edit_new(msg);
+	out = iov_join(edit, &len);
+	CHECK(len == strlen(lf) && !memcmp(out, lf, len));
+	g_free(out);
+	fmime_edit_prepend_header(edit, "Received", "from a by b");
+	fmime_edit_prepend_header(edit, "Received", "from b by c");
+	fmime_edit_append_header(edit, "X-Added", "yes");
+	fmime_edit_replace_header(edit, "Subject", "new");
+	fmime_edit_replace_header(edit, "X-New", "n1");
+	fmime_edit_remove_header(edit, "x-priority");
+	fmime_edit_append_header(edit, "X-Gone", "z");
+	fmime_edit_remove_header(edit, "X-Gone");
+	out = iov_join(edit, &len);
+	CHECK(len == strlen(lf_edited) && !memcmp(out, lf_edited, len));
+	g_free(out);
+	fmime_edit_free(edit);
+	fmime_free(msg);
+
+	msg = fmime_parse_memory(crlf, strlen(crlf));
+	edit = fmime_edit_new(msg);
+	fmime_edit_prepend_header(edit, "Received", "r");
+	fmime_edit_replace_header(edit, "To", "c");
+	out = iov_join(edit, &len);
+	CHECK(len == strlen(crlf_edited) && !memcmp(out, crlf_edited, len));
+	g_free(out);
+	fmime_edit_free(edit);
+	fmime_free(msg);
+
+	msg = fmime_parse_memory(bare, strlen(bare));
+	edit = fmime_edit_new(msg);
+	out = iov_join(edit, &len);
+	CHECK(len == strlen(bare) && !memcmp(out, bare, len));
+	g_free(out);
+	fmime_edit_append_header(edit, "X-Added", "1");
+	fmime_edit_replace_header(edit, "X-New", "2");
+	out = iov_join(edit, &len);
+	CHECK(len == strlen(bare_edited) && !memcmp(out, bare_edited, len));
+	g_free(out);
+	// the unterminated line is gone, nothing to break
+	fmime_edit_remove_header(edit, "To");
+	fmime_edit_remove_header(edit, "X-New");
+	out = iov_join(edit, &len);
+	CHECK(len == strlen(bare_removed) && !memcmp(out, bare_removed, len));
+	g_free(out);
+	fmime_edit_free(edit);
+	fmime_free(msg);
+
+	// drop the images of the sample, the rest parses the same
+	msg = fmime_parse_memory(rfc, strlen(rfc));
+	edit = fmime_edit_new(msg);
+	parts = fmime_message_parts(msg, &n);
+	CHECK(fmime_edit_remove_part(edit, &parts[0]) == -1);
+	for(i=0;i<n;i++) {
+		if(fmime_part_is_type(&parts[i], "image", "*")) {
+			CHECK(!fmime_edit_remove_part(edit, &parts[i]));
+			removed++;
+		}
+	}
+	out = iov_join(edit, &len);
+	again = fmime_parse_memory(out, len);
+	fmime_message_parts(again, &n2);
+	CHECK(removed > 0 && n2 == n - removed);
+	for(i=0;i<n2;i++) {
+		fmime_part_t *p = &fmime_message_parts(again, &n2)[i];
+		CHECK(!fmime_part_is_type(p, "image", "*"));
+	}
+	CHECK(!strcmp(fmime_get_header(again, "Received"), fmime_get_header(msg, "Received")));
+
+	f = tmpfile();
+	CHECK(f && fmime_edit_write(edit, fileno(f)) == (gssize)len);
+	back = g_malloc(len + 1);
+	CHECK(f && !fseek(f, 0, SEEK_SET) && fread(back, 1, len + 1, f) == len && !memcmp(back, out, len));
+	if(f) {
+		fclose(f);
+	}
+	g_free(back);
+	g_free(out);
+	fmime_free(again);
+	fmime_edit_free(edit);
+	fmime_free(msg);
+}
+
 int main(int argc, char **argv)
 {
 	fmime_message_t *msg;
+	fmime_summary_t summary;
 	const GList *headers;
+	fmime_address_t from[4];
+	char *text;
 	int num = 1;
+	int i, n;
 	fmime_init(0);
 
 	if(argc == 2) {
 		num = atoi(argv[1]);
 	}
 
+	check_sections();
+	check_summary();
+	check_dates();
+	check_headers();
+	check_attachments();
+	check_files();
+	check_load();
+	check_rules();
+	check_rules_api();
+	check_addresses();
+	check_hops();
+	check_crlf();
+	check_recover();
+	check_file_io();
+	check_ctx();
+	check_tree();
+	check_decode();
+	check_header_filter();
+	check_text_utf8();
+	check_plaintext();
+	check_tokens();
+	check_edit();
+	if(failed) {
+		fprintf(stderr, "%d checks failed\n", failed);
+		return 1;
+	}
+
 	while(num-- > 0) {
 		msg = fmime_parse_memory(rfc, strlen(rfc));
 		assert(msg);
 		printf("getheader(Received): %s\n", fmime_get_header(msg, "Received"));
 		headers = fmime_get_headers(msg, "Received");
 		printf("getheaders(Received)[0]: %s\n", (char *)headers->data);
+		// the start of the text, from the best alternative
+		text = fmime_get_plaintext(msg, 72, NULL);
+		printf("plaintext: %s\n", text);
+		g_free(text);
 		fmime_free(msg);
 
+		// msglist data, without building the tree
+		fmime_summarize(rfc, strlen(rfc), &summary, FMIME_SUMMARY_SUBJECT | FMIME_SUMMARY_PREVIEW);
+		printf("summary: %zi bytes from: %.*s subject: %s\n", summary.size,
+				(int)summary.from.len, summary.from.ptr, summary.subject_utf8);
+		printf("summary preview: %s\n", summary.preview);
+		n = fmime_parse_addresses(summary.from.ptr, summary.from.len, from, G_N_ELEMENTS(from));
+		for(i=0;i<n && i<(int)G_N_ELEMENTS(from);i++) {
+			printf("from: [%.*s] %.*s at %.*s\n", (int)from[i].display.len, from[i].display.ptr,
+					(int)from[i].local.len, from[i].local.ptr, (int)from[i].domain.len, from[i].domain.ptr);
+		}
+
 		msg = fmime_parse_file("testmsgs/rfc.txt");
 		assert(msg);
 		printf("getheader(Received): %s\n", fmime_get_header(msg, "received"));
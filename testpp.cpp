@@ -0,0 +1,141 @@
+// Checks of the C++ wrapper, run by make check. Exits with 1 if one of
+// them failed.
+#include "fmime.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <memory_resource>
+#include <string>
+#include <utility>
+
+static int failed;
+
+static void check(bool ok, const char *what, int line)
+{
+	if(!ok) {
+		fprintf(stderr, "FAIL testpp.cpp:%d: %s\n", line, what);
+		failed++;
+	}
+}
+#define CHECK(cond) check(!!(cond), #cond, __LINE__)
+
+static const char msg_text[] =
+	"Received: from a by b\n"
+	"Received: from b by c\n"
+	"Subject: =?utf-8?q?caf=C3=A9?=\n"
+	"Content-Type: multipart/mixed; boundary=\"x\"\n"
+	"\n"
+	"--x\n"
+	"Content-Type: text/plain\n"
+	"\n"
+	"hello\n"
+	"--x\n"
+	"Content-Type: image/png\n"
+	"Content-Disposition: attachment; filename=\"a.png\"\n"
+	"\n"
+	"png\n"
+	"--x\n"
+	"Content-Type: multipart/alternative; boundary=y\n"
+	"\n"
+	"--y\n"
+	"Content-Type: text/plain\n"
+	"\n"
+	"plain\n"
+	"--y\n"
+	"Content-Type: text/html\n"
+	"\n"
+	"<p>html</p>\n"
+	"--y--\n"
+	"--x--\n";
+
+static void check_message()
+{
+	fmime::Message msg = fmime::Message::parse(msg_text);
+	int n = 0;
+
+	CHECK(msg && msg.size() == sizeof(msg_text) - 1);
+	CHECK(msg.header("Subject") == "=?utf-8?q?caf=C3=A9?=");
+	CHECK(msg.header_decoded("subject") == "caf\xc3\xa9");
+	CHECK(msg.header("X-Missing").data() == nullptr);
+	for(std::string_view v : msg.headers("Received")) {
+		CHECK(v == (n ? "from b by c" : "from a by b"));
+		n++;
+	}
+	CHECK(n == 2 && msg.headers("X-Missing").empty());
+	CHECK(msg.has_attachment());
+	CHECK(!msg.envelope().empty() && !msg.bodystructure().empty());
+
+	// moved from, the old one is empty and frees nothing
+	fmime::Message other = std::move(msg);
+	CHECK(!msg && other && other.has_root());
+	msg = std::move(other);
+	CHECK(msg && !other);
+
+	CHECK(!fmime::Message::parse_file("testmsgs/missing"));
+}
+
+static void check_parts()
+{
+	fmime::Message msg = fmime::Message::parse(msg_text);
+	fmime::Part root = msg.root();
+	fmime::Part::Children children = root.children();
+	fmime::Part::Children::iterator it = children.begin();
+	int n = 0;
+
+	CHECK(root.is_type("multipart", "mixed"));
+	CHECK(children.size() == 3 && !children.empty());
+	CHECK(children.end() - children.begin() == 3);
+	CHECK((*it).is_type("text", "plain"));
+	CHECK(it[1].filename() == "a.png" && it[1].is_attachment() && it[1].is_disposition("attachment"));
+	CHECK((*(it + 2)).is_type("multipart", "alternative"));
+	CHECK(children[0].filename().data() == nullptr);
+	CHECK(children[1].header("Content-Type") == "image/png");
+	CHECK(children[2].raw().substr(0, 13) == "Content-Type:");
+	++it;
+	CHECK(it != children.begin() && children.begin() < it && (it - 1) == children.begin());
+	for(fmime::Part p : children) {
+		n += p.children().size();
+	}
+	CHECK(n == 2);
+	for(fmime::Part p : children[2].children()) {
+		CHECK(p.is_type("text", "*") && p.children().empty());
+	}
+	CHECK(msg.root().children()[2].children()[1].is_type("text", "html"));
+}
+
+// A context keeps the message, fmime::copy() takes a value past it
+static void check_copy()
+{
+	char arena[256];
+	std::pmr::monotonic_buffer_resource mr(arena, sizeof(arena), std::pmr::null_memory_resource());
+	fmime_parser_ctx_t *ctx = fmime_ctx_new();
+	std::pmr::string subject(&mr);
+	std::string raw(msg_text);
+
+	{
+		fmime::Message msg = fmime::Message::parse(ctx, raw);
+		subject = fmime::copy(msg.header_decoded("Subject"), &mr);
+		CHECK(msg.root().children().size() == 3);
+	}
+	raw.assign(raw.size(), 'x');
+	CHECK(subject == "caf\xc3\xa9" && subject.get_allocator().resource() == &mr);
+
+	fmime::Message again = fmime::Message::parse(ctx, "Subject: second\n\nbody\n");
+	CHECK(again.header("Subject") == "second" && !again.has_root());
+	fmime_free(again.release());
+	CHECK(!again);
+	fmime_ctx_free(ctx);
+}
+
+int main()
+{
+	fmime_init(0);
+	check_message();
+	check_parts();
+	check_copy();
+	if(failed) {
+		fprintf(stderr, "%d checks failed\n", failed);
+		return 1;
+	}
+	return 0;
+}